@@ -70,11 +70,11 @@
 #define REG_8(regs_struct) (regs_struct).r8
 #define REG_9(regs_struct) (regs_struct).r9
 #define REG_10(regs_struct) (regs_struct).r10
-#define REG_11(regs_struct) (regs_struct).r10
-#define REG_12(regs_struct) (regs_struct).r10
-#define REG_13(regs_struct) (regs_struct).r10
-#define REG_14(regs_struct) (regs_struct).r10
-#define REG_15(regs_struct) (regs_struct).r10
+#define REG_11(regs_struct) (regs_struct).r11
+#define REG_12(regs_struct) (regs_struct).r12
+#define REG_13(regs_struct) (regs_struct).r13
+#define REG_14(regs_struct) (regs_struct).r14
+#define REG_15(regs_struct) (regs_struct).r15
 #define NUM_REGS 15
 #define ElfXX_Sym Elf64_Sym
 #define ElfXX_Rel Elf64_Rel
@@ -82,6 +82,7 @@
 #define ElfXX_Shdr Elf64_Shdr
 #define ElfXX_Ehdr Elf64_Ehdr
 #define ElfXX_Dyn Elf64_Dyn
+#define ElfXX_Phdr Elf64_Phdr
 #define elfxx_getshdr elf64_getshdr
 #define elfxx_newehdr elf64_newehdr
 #define ELFXX_R_TYPE ELF64_R_TYPE
@@ -111,6 +112,7 @@
 #define ElfXX_Shdr Elf32_Shdr
 #define ElfXX_Ehdr Elf32_Ehdr
 #define ElfXX_Dyn Elf32_Dyn
+#define ElfXX_Phdr Elf32_Phdr
 #define elfxx_getshdr elf32_getshdr
 #define elfxx_newehdr elf32_newehdr
 #define ELFXX_R_TYPE ELF32_R_TYPE
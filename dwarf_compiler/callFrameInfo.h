@@ -103,10 +103,8 @@ typedef struct CIE
 {
   RegInstruction* initialInstructions;
   int numInitialInstructions;
-  Dictionary* initialRules; //dictionary mapping the stringified
-                            //version of a register to the rule (of
-                            //type PoRegRule) for setting that
-                            //register
+  RuleSet* initialRules; //the rule for each register set up by the
+                         //initial instructions
 
   Dwarf_Signed dataAlign;
   Dwarf_Unsigned codeAlign;
@@ -150,6 +148,7 @@ typedef struct FDE
   
   bool hasLSDAPointer;
   idx_t lsdaIdx;
+  struct CFITable* rowTable;//compiled lazily by getCFITable
 } FDE;
 
 //struct for raw data returned from buildCallFrameSectionData
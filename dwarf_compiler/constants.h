@@ -53,7 +53,6 @@
   Description: miscellaneous constants for Katana
 */
 
-#define WAIT_FOR_SAFE_PATCHING_USLEEP 10000
 #define DWARF_VERSION 4
 #define DWARF_CIE_VERSION 4
 #define DEBUG_CIE_ID 0xffffffff //the value of CIE_id as defined by the DWARFv4 spec
@@ -63,3 +62,45 @@
 #define EH_FRAME_HDR_VERSION 1
 
 #define SHT_KATANA_UNSAFE_FUNCTIONS SHT_LOUSER+0x1
+
+//fewest hash buckets a symbol name index is created with. The
+//dictionary can't grow its bucket array, and symbol tables we're
+//writing start empty
+#define SYMBOL_INDEX_MIN_BUCKETS 1024
+
+//most of a thread's stack the native unwinder copies out of the
+//target. Anything a frame saved beyond this is read separately
+#define UNWIND_MAX_STACK_SNAPSHOT (1024*1024)
+//a walk this deep has surely gone wrong
+#define UNWIND_MAX_FRAMES 4096
+
+//nothing is ever mapped below this (the usual vm.mmap_min_addr)
+#define TARGET_MIN_MAP_ADDRESS 0x10000
+//how far from the instruction using it a rel32 displacement can reach
+#define REL32_REACH 0x7fffffffULL
+
+//longest we let the main thread of the target run code we've put in
+//it (a call to malloc, a system call, the agent) before giving up on
+//it. The other threads are stopped, and one of them may hold a lock the
+//call needs
+#define TARGET_CALL_TIMEOUT_MS 2000
+
+//memory mapped into the target for the agent, its code and the
+//commands it's to run
+#define AGENT_REGION_SIZE (256*1024)
+
+//memory shared with the target through a memfd. Pages only cost
+//anything once touched, so it can be generous
+#define TARGET_CHANNEL_SIZE (64*1024*1024)
+//writes smaller than this aren't worth an in-target copy
+#define TARGET_CHANNEL_MIN_COPY 4096
+
+//the smallest piece of alignment padding in target memory worth
+//keeping to hand out again
+#define TARGET_ARENA_MIN_BLOCK 16
+//the least memory an arena takes from the target at once
+#define TARGET_ARENA_CHUNK_SIZE (64*1024)
+
+//alignment in the patch file of the sections which can be mapped
+//directly into the target. Should be a multiple of the page size
+#define PATCH_SECTION_ALIGN 4096
@@ -57,14 +57,13 @@
 #include "leb.h"
 #include "register.h"
 #include <libdwarf/dwarf.h>
-#include "util/dictionary.h"
 #include "patcher/target.h"
 #include <assert.h>
 #include "util/logging.h"
 #include "symbol.h"
 #include "util/map.h"
 #include "patcher/hotpatch.h"
-#include "util/stack.h"
+#include "patcher/agent.h"
 #include "elfutil.h"
 
 //returns a list of PatchData objects
@@ -73,14 +72,140 @@ List* generatePatchesFromFDEAndState(FDE* fde,SpecialRegsState* state,ElfInfo* p
 //keys are old addresses of data objects (variables). Values are the new addresses
 Map* dataMoved=NULL;
 
-//this is the stack of saved register states used by the
-//DW_CFA_remember_state and DW_CFA_restore_state instructions
-static Stack* stateStack;
-//unfortunately because the way we currently evaluate
-//static Map* rememberedStatesByLocation;
+MovedObjectLookup movedObjectLookup=NULL;
 
-//evaluates the given instructions and stores them in the output rules
-//dictionary.The initial condition of regarray IS taken into account.
+//during a transformation batch, heap objects which need a new home
+//aren't allocated straight away. Each is given a placeholder address
+//instead and they are all allocated together at the end of the batch,
+//when the placeholders in the patch data are replaced. Placeholders
+//are non-canonical addresses, which the target can never have, so
+//batching is only done on x86_64
+#ifdef KATANA_X86_64_ARCH
+#define HEAP_PLACEHOLDER_BASE 0x8000000000000000ULL
+#endif
+#define HEAP_OBJECT_ALIGN 16
+
+typedef struct
+{
+  word_t size;
+  word_t placeholderOffset;//from HEAP_PLACEHOLDER_BASE
+  addr_t newAddr;//once allocated
+  addr_t* movedTo;//value in dataMoved, updated once allocated
+} PendingHeapObject;
+
+bool batchingTransformations=false;
+PendingHeapObject* pendingHeapObjects=NULL;
+int numPendingHeapObjects=0;
+int allocatedPendingHeapObjects=0;
+word_t heapPlaceholderSize=0;
+List* batchedPatches=NULL;
+List* batchedPatchesEnd=NULL;
+E_HEAP_ALLOC_STRATEGY heapAllocStrategy=EHA_INDIVIDUAL;
+
+void setHeapAllocStrategy(E_HEAP_ALLOC_STRATEGY strategy)
+{
+  heapAllocStrategy=strategy;
+}
+
+void setMovedObjectLookup(MovedObjectLookup lookup)
+{
+  movedObjectLookup=lookup;
+}
+
+//the saved register states used by the DW_CFA_remember_state and
+//DW_CFA_restore_state instructions. Rather than copying the whole
+//rule set on remember, we keep an undo log: the first time a register
+//is changed after a remember, its previous rule is logged, and
+//restore plays the log back. Remember is then O(1) and restore is
+//O(registers changed since the remember). Each evaluation gets its own
+//log
+typedef struct
+{
+  PoReg reg;
+  PoRegRule old;//old.regLH.type is ERT_NONE if reg had no rule
+} RuleUndoEntry;
+
+typedef struct
+{
+  RuleUndoEntry* entries;
+  int numEntries;
+  int allocatedEntries;
+  int* marks;//index into entries at which each remembered state starts
+  int numMarks;
+  int allocatedMarks;
+} RememberedRuleStates;
+
+static void rememberRuleState(RememberedRuleStates* states)
+{
+  if(states->numMarks>=states->allocatedMarks)
+  {
+    states->allocatedMarks=(max(states->allocatedMarks*2,4));
+    states->marks=realloc(states->marks,states->allocatedMarks*sizeof(int));
+    MALLOC_CHECK(states->marks);
+  }
+  states->marks[states->numMarks++]=states->numEntries;
+}
+
+//called before the rule for reg is changed
+static void logRuleChange(RememberedRuleStates* states,RuleSet* rules,PoReg reg)
+{
+  if(!states->numMarks)
+  {
+    return;
+  }
+  //only the value from when the state was remembered matters. Few
+  //registers change between a remember and its restore, so a scan is
+  //fine
+  for(int i=states->marks[states->numMarks-1];i<states->numEntries;i++)
+  {
+    if(0==comparePoRegs(&states->entries[i].reg,&reg))
+    {
+      return;
+    }
+  }
+  if(states->numEntries>=states->allocatedEntries)
+  {
+    states->allocatedEntries=(max(states->allocatedEntries*2,8));
+    states->entries=realloc(states->entries,states->allocatedEntries*sizeof(RuleUndoEntry));
+    MALLOC_CHECK(states->entries);
+  }
+  RuleUndoEntry* entry=&states->entries[states->numEntries++];
+  entry->reg=reg;
+  PoRegRule* old=ruleSetGet(rules,reg);
+  if(old)
+  {
+    entry->old=*old;
+  }
+  else
+  {
+    memset(&entry->old,0,sizeof(PoRegRule));
+  }
+}
+
+static void restoreRuleState(RememberedRuleStates* states,RuleSet* rules)
+{
+  if(!states->numMarks)
+  {
+    death("Attempt to use DW_CFA_restore_state without using DW_CFA_remember_state\n");
+  }
+  int mark=states->marks[--states->numMarks];
+  for(int i=states->numEntries-1;i>=mark;i--)
+  {
+    RuleUndoEntry* entry=&states->entries[i];
+    if(ERT_NONE==entry->old.regLH.type)
+    {
+      ruleSetRemove(rules,entry->reg);
+    }
+    else
+    {
+      *ruleSetGetOrAdd(rules,entry->reg)=entry->old;
+    }
+  }
+  states->numEntries=mark;
+}
+
+//evaluates the given instructions and stores them in the output rule
+//set.The initial condition of regarray IS taken into account.
 //Execution continues until the end of the instructions or until the
 //location is advanced past stopLocation. stopLocation should be
 //relative to the start of the instructions (i.e. the instructions are
@@ -89,7 +214,14 @@ static Stack* stateStack;
 //the end of the instructions) returns the location stopped at (will
 //be the lowest location that a change was actually made).
 //outInstrsCnt, if non-NULL, is used to store the number of instructions read
-int evaluateInstructionsToRules(CIE* cie,RegInstruction* instrs,int numInstrs,Dictionary* rules,int startLocation, int stopLocation,int* outInstrsCnt)
+//if rowCallback is non-NULL, it is called with the rules in effect
+//for each range of locations [lowLoc,highLoc) as the location is
+//advanced past it
+typedef void (*RuleRowCallback)(RuleSet* rules,int lowLoc,int highLoc,void* arg);
+static int evaluateInstructionsWithStates(CIE* cie,RegInstruction* instrs,int numInstrs,
+                                          RuleSet* rules,RememberedRuleStates* states,
+                                          int startLocation, int stopLocation,
+                                          RuleRowCallback rowCallback,void* rowArg)
 {
   int loc=startLocation;
   for(int i=0;i<numInstrs;i++)
@@ -107,75 +239,50 @@ int evaluateInstructionsToRules(CIE* cie,RegInstruction* instrs,int numInstrs,Di
       {
         return loc;
       }
+      if(rowCallback && inst.arg1>loc)
+      {
+        rowCallback(rules,loc,inst.arg1,rowArg);
+      }
       loc=inst.arg1;
       continue;
     case DW_CFA_advance_loc:
     case DW_CFA_advance_loc1:
     case DW_CFA_advance_loc2:
+    case DW_CFA_advance_loc4:
       if(stopLocation >=0 && loc+inst.arg1>stopLocation)
       {
         return loc;
       }
+      if(rowCallback && inst.arg1>0)
+      {
+        rowCallback(rules,loc,loc+inst.arg1*cie->codeAlign,rowArg);
+      }
       loc+=inst.arg1*cie->codeAlign;
       continue;
     case DW_CFA_remember_state:
-      {
-        //Note that the storage used for remember and restore state is
-        //global.  no attempt is made to verify that a
-        //DW_CFA_restore_state is used in a sensible manner. It will
-        //restore whatever was last pushed onto the stack when Katana is
-        //running. It is assumed that the DWARF file will be constructed
-        //in a sensible manner. Otherwise the generated rules may make
-        //little sense.
-        Dictionary* rulesCopy=dictDuplicate(rules,(DictDataCopy)duplicatePoRegRule);
-        if(!stateStack)
-        {
-          stateStack=stackCreate();
-        }
-        stackPush(stateStack,rulesCopy);
-        continue;
-      }
-      break;
+      //no attempt is made to verify that a DW_CFA_restore_state is
+      //used in a sensible manner. It will restore whatever was last
+      //remembered in this evaluation. It is assumed that the DWARF
+      //file will be constructed in a sensible manner. Otherwise the
+      //generated rules may make little sense.
+      rememberRuleState(states);
+      continue;
     case DW_CFA_restore_state:
-      {
-        if(!stateStack)
-        {
-          death("Attempt to use DW_CFA_restore_state without using DW_CFA_remember_state\n");
-        }
-        Dictionary* savedRules=stackPop(stateStack);
-        if(!savedRules)
-        {
-          death("Attempt to use DW_CFA_restore_state without using DW_CFA_remember_state\n");
-        }
-        char** keys=dictKeys(savedRules);
-        for(int i=0;keys[i];i++)
-        {
-          char* key=keys[i];
-          PoRegRule* currentRule=dictGet(rules,key);
-          PoRegRule* savedRule=dictGet(savedRules,key);
-          assert(savedRule);
-          if(currentRule)
-          {
-            memcpy(currentRule,savedRule,sizeof(PoRegRule));
-          }
-          else
-          {
-            currentRule=duplicatePoRegRule(savedRule);
-            dictInsert(rules,key,currentRule);
-          }
-        }
-        dictDelete(savedRules,free);
-        continue;
-      }
+      restoreRuleState(states,rules);
+      continue;
+    case DW_CFA_GNU_args_size:
+      //only matters for unwinding during exception handling
+      continue;
     }
 
     
     
     PoReg reg;
-    char* str=NULL;
     if(DW_CFA_def_cfa==inst.type ||
        DW_CFA_def_cfa_register==inst.type ||
-       DW_CFA_def_cfa_offset==inst.type)
+       DW_CFA_def_cfa_offset==inst.type ||
+       DW_CFA_def_cfa_offset_sf==inst.type ||
+       DW_CFA_def_cfa_expression==inst.type)
     {
       memset(&reg,0,sizeof(reg));
       reg.type=ERT_CFA;
@@ -184,17 +291,8 @@ int evaluateInstructionsToRules(CIE* cie,RegInstruction* instrs,int numInstrs,Di
     {
       reg=inst.arg1Reg;
     }
-    str=strForReg(reg,0);
-              
-    rule=dictGet(rules,str);
-    if(!rule)
-    {
-      rule=zmalloc(sizeof(PoRegRule));
-      rule->regLH=reg;
-      dictInsert(rules,str,rule);
-        
-    }
-    free(str);
+    logRuleChange(states,rules,reg);
+    rule=ruleSetGetOrAdd(rules,reg);
     //printf("evaluating instruction of type 0x%x\n",(uint)inst.type);
     switch(inst.type)
     {
@@ -218,9 +316,15 @@ int evaluateInstructionsToRules(CIE* cie,RegInstruction* instrs,int numInstrs,Di
       rule->type=ERRT_UNDEF;
       break;
     case DW_CFA_offset:
+    case DW_CFA_offset_extended:
+    case DW_CFA_offset_extended_sf:
       rule->type=ERRT_OFFSET;
       rule->offset=inst.arg2*cie->dataAlign;
       break;
+    case DW_CFA_same_value:
+      rule->type=ERRT_REGISTER;
+      rule->regRH=reg;
+      break;
     case DW_CFA_register:
       rule->type=ERRT_REGISTER;
       rule->regRH=inst.arg2Reg;
@@ -238,17 +342,29 @@ int evaluateInstructionsToRules(CIE* cie,RegInstruction* instrs,int numInstrs,Di
       rule->type=ERRT_CFA;
       rule->offset=inst.arg1;
       break;
+    case DW_CFA_def_cfa_offset_sf:
+      rule->type=ERRT_CFA;
+      rule->offset=inst.arg1*cie->dataAlign;
+      break;
+    case DW_CFA_def_cfa_expression:
+      //the expression itself isn't kept, but anyone evaluating the
+      //rules can at least tell they can't compute the cfa
+      rule->type=ERRT_EXPR;
+      memset(&rule->regRH,0,sizeof(PoReg));
+      break;
     case DW_CFA_restore:
       {
-        PoRegRule* initialRule=dictGet(cie->initialRules,str);
+        PoRegRule* initialRule=ruleSetGet(cie->initialRules,reg);
         if(initialRule)
         {
           *rule=*initialRule;
         }
         else
         {
-          //there was no inital rule. Is there ever a valid usage for this?
-          death("Unable to create DW_CFA_restore rule because no rule assigned in the CIE\n");
+          //there was no initial rule, e.g. GCC restoring a callee-saved
+          //register in an epilogue, so the register goes back to
+          //having no rule at all
+          ruleSetRemove(rules,reg);
         }
       }
       break;
@@ -277,6 +393,183 @@ int evaluateInstructionsToRules(CIE* cie,RegInstruction* instrs,int numInstrs,Di
   return loc;
 }
 
+int evaluateInstructionsToRules(CIE* cie,RegInstruction* instrs,int numInstrs,RuleSet* rules,int startLocation, int stopLocation,int* outInstrsCnt)
+{
+  RememberedRuleStates states;
+  memset(&states,0,sizeof(states));
+  int loc=evaluateInstructionsWithStates(cie,instrs,numInstrs,rules,&states,
+                                         startLocation,stopLocation,NULL,NULL);
+  free(states.entries);
+  free(states.marks);
+  return loc;
+}
+
+typedef struct
+{
+  CFITable* table;
+  int allocatedRows;
+  int allocatedRules;
+} CFITableBuilder;
+
+static bool rowRulesEqual(CFITable* table,CFIRow* row,RuleSet* rules)
+{
+  int pos=0;
+  int i=0;
+  PoRegRule* rule;
+  while((rule=ruleSetNext(rules,&pos)))
+  {
+    if(i>=row->numRules ||
+       memcmp(&table->rules[row->firstRule+i],rule,sizeof(PoRegRule)))
+    {
+      return false;
+    }
+    i++;
+  }
+  return i==row->numRules;
+}
+
+static void addCFIRow(RuleSet* rules,int lowLoc,int highLoc,void* arg)
+{
+  CFITableBuilder* builder=arg;
+  CFITable* table=builder->table;
+  //advancing without changing anything just makes the last row longer
+  if(table->numRows &&
+     rowRulesEqual(table,&table->rows[table->numRows-1],rules))
+  {
+    return;
+  }
+  if(table->numRows>=builder->allocatedRows)
+  {
+    builder->allocatedRows=(max(builder->allocatedRows*2,8));
+    table->rows=realloc(table->rows,builder->allocatedRows*sizeof(CFIRow));
+    MALLOC_CHECK(table->rows);
+  }
+  CFIRow* row=&table->rows[table->numRows++];
+  row->lowpc=lowLoc;
+  row->firstRule=table->numRules;
+  row->numRules=0;
+  int pos=0;
+  PoRegRule* rule;
+  while((rule=ruleSetNext(rules,&pos)))
+  {
+    if(table->numRules>=builder->allocatedRules)
+    {
+      builder->allocatedRules=(max(builder->allocatedRules*2,32));
+      table->rules=realloc(table->rules,builder->allocatedRules*sizeof(PoRegRule));
+      MALLOC_CHECK(table->rules);
+    }
+    table->rules[table->numRules++]=*rule;
+    row->numRules++;
+  }
+}
+
+//runs the FDE's instructions once, from the CIE's initial rules,
+//recording the rules in effect between each pair of locations
+static CFITable* compileCFITable(FDE* fde)
+{
+  CFITableBuilder builder;
+  memset(&builder,0,sizeof(builder));
+  builder.table=zmalloc(sizeof(CFITable));
+  builder.table->highpc=fde->highpc;
+  RuleSet* rules=ruleSetCreate();
+  if(fde->cie->initialRules)
+  {
+    ruleSetCopy(rules,fde->cie->initialRules);
+  }
+  RememberedRuleStates states;
+  memset(&states,0,sizeof(states));
+  int loc=evaluateInstructionsWithStates(fde->cie,fde->instructions,fde->numInstructions,
+                                         rules,&states,fde->lowpc,-1,
+                                         addCFIRow,&builder);
+  //the last row runs to the end of the FDE
+  if(loc<fde->highpc || !builder.table->numRows)
+  {
+    addCFIRow(rules,loc,fde->highpc,&builder);
+  }
+  free(states.entries);
+  free(states.marks);
+  ruleSetDelete(rules);
+  CFITable* table=builder.table;
+  //we're done growing, so give back what we didn't use
+  if(table->numRows)
+  {
+    table->rows=realloc(table->rows,table->numRows*sizeof(CFIRow));
+  }
+  if(table->numRules)
+  {
+    table->rules=realloc(table->rules,table->numRules*sizeof(PoRegRule));
+  }
+  return table;
+}
+
+CFITable* getCFITable(FDE* fde)
+{
+  if(!fde->rowTable)
+  {
+    fde->rowTable=compileCFITable(fde);
+  }
+  return fde->rowTable;
+}
+
+CFIRow* findCFIRow(CFITable* table,addr_t pc)
+{
+  if(!table->numRows || pc<table->rows[0].lowpc || pc>=table->highpc)
+  {
+    return NULL;
+  }
+  //find the last row starting at or before pc
+  int lower=0;
+  int upper=table->numRows;
+  while(upper-lower>1)
+  {
+    int mid=lower+(upper-lower)/2;
+    if(table->rows[mid].lowpc<=pc)
+    {
+      lower=mid;
+    }
+    else
+    {
+      upper=mid;
+    }
+  }
+  return &table->rows[lower];
+}
+
+PoRegRule* getCFIRowRule(CFITable* table,CFIRow* row,PoReg reg)
+{
+  //rows only hold a handful of rules
+  for(int i=0;i<row->numRules;i++)
+  {
+    PoRegRule* rule=&table->rules[row->firstRule+i];
+    if(0==comparePoRegs(&rule->regLH,&reg))
+    {
+      return rule;
+    }
+  }
+  return NULL;
+}
+
+void getCFIRowRules(CFITable* table,CFIRow* row,RuleSet* rulesOut)
+{
+  ruleSetClear(rulesOut);
+  for(int i=0;i<row->numRules;i++)
+  {
+    PoRegRule* rule=&table->rules[row->firstRule+i];
+    *ruleSetGetOrAdd(rulesOut,rule->regLH)=*rule;
+  }
+}
+
+void freeCFITable(CFITable* table)
+{
+  if(!table)
+  {
+    return;
+  }
+  free(table->rows);
+  free(table->rules);
+  free(table);
+}
+
 //structure for holding one contiguous chunk of data
 //to be put into the target process
 //todo: there is a problem with our current scheme. We do not do patches immediately
@@ -289,6 +582,7 @@ typedef struct
   byte* data;//data to be poked into the target
   uint len;//how much data
   addr_t addr;//address to copy the data to
+  bool isPointer;//data is an address, which may be a heap placeholder
 } PatchData;
 
 void freePatchData(PatchData* pd)
@@ -300,6 +594,189 @@ void freePatchData(PatchData* pd)
   free(pd);
 }
 
+//returns the placeholder address for the object
+static addr_t addPendingHeapObject(word_t size)
+{
+#ifdef KATANA_X86_64_ARCH
+  if(numPendingHeapObjects==allocatedPendingHeapObjects)
+  {
+    allocatedPendingHeapObjects=(max(allocatedPendingHeapObjects*2,64));
+    pendingHeapObjects=realloc(pendingHeapObjects,allocatedPendingHeapObjects*sizeof(PendingHeapObject));
+    MALLOC_CHECK(pendingHeapObjects);
+  }
+  PendingHeapObject* obj=&pendingHeapObjects[numPendingHeapObjects++];
+  obj->size=size;
+  obj->placeholderOffset=heapPlaceholderSize;
+  obj->newAddr=0;
+  obj->movedTo=NULL;
+  //even empty objects need an address of their own
+  heapPlaceholderSize+=(max(size,1)+HEAP_OBJECT_ALIGN-1) & ~(word_t)(HEAP_OBJECT_ALIGN-1);
+  return HEAP_PLACEHOLDER_BASE+obj->placeholderOffset;
+#else
+  death("heap objects cannot be batched on this architecture\n");
+  return 0;
+#endif
+}
+
+static bool isHeapPlaceholder(addr_t addr)
+{
+#ifdef KATANA_X86_64_ARCH
+  return addr>=HEAP_PLACEHOLDER_BASE && addr<HEAP_PLACEHOLDER_BASE+heapPlaceholderSize;
+#else
+  return false;
+#endif
+}
+
+//the address of the allocated memory a placeholder stands for. Any
+//other address is returned unchanged
+static addr_t resolveHeapPlaceholder(addr_t addr)
+{
+#ifdef KATANA_X86_64_ARCH
+  if(!isHeapPlaceholder(addr))
+  {
+    return addr;
+  }
+  word_t offset=addr-HEAP_PLACEHOLDER_BASE;
+  //objects are in placeholder order, find the last starting at or
+  //before offset
+  int lo=0,hi=numPendingHeapObjects-1;
+  while(lo<hi)
+  {
+    int mid=(lo+hi+1)/2;
+    if(pendingHeapObjects[mid].placeholderOffset<=offset)
+    {
+      lo=mid;
+    }
+    else
+    {
+      hi=mid-1;
+    }
+  }
+  PendingHeapObject* obj=&pendingHeapObjects[lo];
+  return obj->newAddr+(offset-obj->placeholderOffset);
+#else
+  return addr;
+#endif
+}
+
+static void allocatePendingHeapObjects()
+{
+  if(!numPendingHeapObjects)
+  {
+    return;
+  }
+  if(EHA_SLAB==heapAllocStrategy)
+  {
+    //laid out in the slab just as they are in the placeholders
+    addr_t slab=mallocTarget(heapPlaceholderSize);
+    for(int i=0;i<numPendingHeapObjects;i++)
+    {
+      pendingHeapObjects[i].newAddr=slab+pendingHeapObjects[i].placeholderOffset;
+    }
+    logprintf(ELL_INFO_V1,ELS_DWARF_FRAME,"Allocated %i heap objects in a single block of 0x%zx bytes at 0x%zx\n",numPendingHeapObjects,heapPlaceholderSize,slab);
+  }
+  else if(targetAgentRunning())
+  {
+    //queued up so that they're all made in as few stops as possible
+    AgentHandle first=0;
+    for(int i=0;i<numPendingHeapObjects;i++)
+    {
+      AgentHandle handle=queueAgentCommand(EAC_MALLOC,pendingHeapObjects[i].size,0,0);
+      if(!i)
+      {
+        first=handle;
+      }
+    }
+    for(int i=0;i<numPendingHeapObjects;i++)
+    {
+      pendingHeapObjects[i].newAddr=getAgentResult(first+i);
+      if(!pendingHeapObjects[i].newAddr)
+      {
+        death("malloc in target of size %zu failed\n",pendingHeapObjects[i].size);
+      }
+    }
+    logprintf(ELL_INFO_V1,ELS_DWARF_FRAME,"Allocated %i heap objects through the agent\n",numPendingHeapObjects);
+  }
+  else
+  {
+    for(int i=0;i<numPendingHeapObjects;i++)
+    {
+      pendingHeapObjects[i].newAddr=mallocTarget(pendingHeapObjects[i].size);
+    }
+    logprintf(ELL_INFO_V1,ELS_DWARF_FRAME,"Allocated %i heap objects one at a time\n",numPendingHeapObjects);
+  }
+  for(int i=0;i<numPendingHeapObjects;i++)
+  {
+    if(pendingHeapObjects[i].movedTo)
+    {
+      *pendingHeapObjects[i].movedTo=pendingHeapObjects[i].newAddr;
+    }
+  }
+}
+
+static bool refersToHeapPlaceholder(PatchData* pd)
+{
+  if(isHeapPlaceholder(pd->addr))
+  {
+    return true;
+  }
+  addr_t value=0;
+  if(pd->isPointer)
+  {
+    memcpy(&value,pd->data,sizeof(addr_t));
+  }
+  return isHeapPlaceholder(value);
+}
+
+static void writePatchData(List* patchesList)
+{
+  //the writes are batched so that the many small fields get combined
+  beginTargetWriteBatch();
+  for(List* li=patchesList;li;li=li->next)
+  {
+    PatchData* pd=li->value;
+    memcpyToTarget(pd->addr,pd->data,pd->len);
+  }
+  commitTargetWriteBatch();
+}
+
+void beginTransformationBatch()
+{
+#ifdef KATANA_X86_64_ARCH
+  assert(!batchingTransformations);
+  batchingTransformations=true;
+#endif
+}
+
+void endTransformationBatch()
+{
+  if(!batchingTransformations)
+  {
+    return;
+  }
+  batchingTransformations=false;
+  allocatePendingHeapObjects();
+  for(List* li=batchedPatches;li;li=li->next)
+  {
+    PatchData* pd=li->value;
+    pd->addr=resolveHeapPlaceholder(pd->addr);
+    if(pd->isPointer)
+    {
+      addr_t value;
+      memcpy(&value,pd->data,sizeof(addr_t));
+      value=resolveHeapPlaceholder(value);
+      memcpy(pd->data,&value,sizeof(addr_t));
+    }
+  }
+  writePatchData(batchedPatches);
+  deleteList(batchedPatches,(FreeFunc)freePatchData);
+  batchedPatches=batchedPatchesEnd=NULL;
+  free(pendingHeapObjects);
+  pendingHeapObjects=NULL;
+  numPendingHeapObjects=allocatedPendingHeapObjects=0;
+  heapPlaceholderSize=0;
+}
+
 //returns a list of PatchData objects
 //this list generally only has one item unless a recurse rule
 //was encountered
@@ -328,6 +805,7 @@ List* makePatchData(PoRegRule* rule,SpecialRegsState* state,ElfInfo* patch,ElfIn
     result=zmalloc(sizeof(PatchData));
     head->value=result;
     result->addr=resultAddr;
+    result->isPointer=ERRT_RECURSE_FIXUP_POINTER==rule->type;
   }
   
   switch(rule->type)
@@ -414,12 +892,29 @@ List* makePatchData(PoRegRule* rule,SpecialRegsState* state,ElfInfo* patch,ElfIn
       }
 
       addr_t pointedObjectNewLocation=0;
+      bool pendingHeapObject=false;
       
       //now we have to see if the location corresponds to a symbol
       //that may be being relocated to a .data.new section or something
       //or the symbol itself may not even move
-      idx_t symIdxOld=findSymbolContainingAddress(state->oldBinaryElf,tmpState.currAddrOld,STT_OBJECT,SHN_UNDEF);
-      if(symIdxOld!=STN_UNDEF)
+      idx_t symIdxOld=STN_UNDEF;
+      if(movedObjectLookup)
+      {
+        //the symbols have already been matched up for us
+        if(movedObjectLookup(tmpState.currAddrOld,&pointedObjectNewLocation))
+        {
+          logprintf(ELL_INFO_V2,ELS_DWARF_FRAME,"Object at 0x%zx is known to have moved to 0x%zx\n",tmpState.currAddrOld,pointedObjectNewLocation);
+        }
+      }
+      else
+      {
+        symIdxOld=findSymbolContainingAddress(state->oldBinaryElf,tmpState.currAddrOld,STT_OBJECT,SHN_UNDEF);
+      }
+      if(pointedObjectNewLocation)
+      {
+        //already found above
+      }
+      else if(symIdxOld!=STN_UNDEF)
       {
         //ok, so it was in a symbol in the executing binary, Now we have to find
         //out where it might have been moved to. This will be the new location of
@@ -457,8 +952,18 @@ List* makePatchData(PoRegRule* rule,SpecialRegsState* state,ElfInfo* patch,ElfIn
         //      lacking important information)
         
         //pointedObjectNewLocation=getFreeSpaceInTarget(patch->fdes[rule->index-1].memSize);
-        pointedObjectNewLocation=mallocTarget(patch->callFrameInfo.fdes[rule->index-1].memSize);
-        logprintf(ELL_INFO_V2,ELS_DWARF_FRAME,"No symbol associated with object at address 0x%zx we have to relocate that we have a pointer to. Mallocced new memory at 0x%zx\n",tmpState.currAddrOld,pointedObjectNewLocation);
+        word_t size=patch->callFrameInfo.fdes[rule->index-1].memSize;
+        if(batchingTransformations)
+        {
+          pendingHeapObject=true;
+          pointedObjectNewLocation=addPendingHeapObject(size);
+          logprintf(ELL_INFO_V2,ELS_DWARF_FRAME,"No symbol associated with object at address 0x%zx we have to relocate that we have a pointer to. It will be allocated later, placeholder 0x%zx\n",tmpState.currAddrOld,pointedObjectNewLocation);
+        }
+        else
+        {
+          pointedObjectNewLocation=mallocTarget(size);
+          logprintf(ELL_INFO_V2,ELS_DWARF_FRAME,"No symbol associated with object at address 0x%zx we have to relocate that we have a pointer to. Mallocced new memory at 0x%zx\n",tmpState.currAddrOld,pointedObjectNewLocation);
+        }
       }
 
       addr_t* value=zmalloc(sizeof(addr_t));
@@ -466,6 +971,10 @@ List* makePatchData(PoRegRule* rule,SpecialRegsState* state,ElfInfo* patch,ElfIn
       size_t* key=zmalloc(sizeof(size_t));
       memcpy(key,&tmpState.currAddrOld,sizeof(size_t));
       mapInsert(dataMoved,key,value);
+      if(pendingHeapObject)
+      {
+        pendingHeapObjects[numPendingHeapObjects-1].movedTo=value;
+      }
       
       
       tmpState.currAddrNew=pointedObjectNewLocation;
@@ -496,10 +1005,9 @@ List* makePatchData(PoRegRule* rule,SpecialRegsState* state,ElfInfo* patch,ElfIn
 List* generatePatchesFromFDEAndState(FDE* fde,SpecialRegsState* state,ElfInfo* patch,ElfInfo* patchedBin)
 {
   //we build up rules for each register from the DW_CFA instructions
-  Dictionary* rulesDict=dictCreate(100);//todo: get rid of arbitrary constant 100
+  RuleSet* rules=ruleSetCreate();
   //todo: versioning?
-  evaluateInstructionsToRules(fde->cie,fde->instructions,fde->numInstructions,rulesDict,fde->lowpc,fde->highpc,NULL);
-  PoRegRule** rules=(PoRegRule**)dictValues(rulesDict);
+  evaluateInstructionsToRules(fde->cie,fde->instructions,fde->numInstructions,rules,fde->lowpc,fde->highpc,NULL);
   //we gather all of the the patch data together first before actually poking the target
   //because everything is supposed to be applied in parallel, as a table, and
   //it is possible that some writes would affect some reads, so we must
@@ -510,9 +1018,7 @@ List* generatePatchesFromFDEAndState(FDE* fde,SpecialRegsState* state,ElfInfo* p
   PoReg cfaReg;
   memset(&cfaReg,0,sizeof(PoReg));
   cfaReg.type=ERT_CFA;
-  char* str=strForReg(cfaReg,0);
-  PoRegRule* cfaRule=dictGet(rulesDict,str);
-  free(str);
+  PoRegRule* cfaRule=ruleSetGet(rules,cfaReg);
   if(cfaRule)
   {
     addr_t addr;
@@ -528,13 +1034,14 @@ List* generatePatchesFromFDEAndState(FDE* fde,SpecialRegsState* state,ElfInfo* p
   }
   List* liStart=NULL;
   List* liEnd=NULL;
-  for(int i=0;rules[i];i++)
+  int pos=0;
+  PoRegRule* rule;
+  while((rule=ruleSetNext(rules,&pos)))
   {
-    List* patchList=makePatchData(rules[i],state,patch,patchedBin);
+    List* patchList=makePatchData(rule,state,patch,patchedBin);
     liStart=concatLists(liStart,liEnd,patchList,NULL,&liEnd);
   }
-  free(rules);
-  dictDelete(rulesDict,free);
+  ruleSetDelete(rules);
   return liStart;
 }
 
@@ -550,13 +1057,31 @@ void patchDataWithFDE(VarInfo* var,FDE* fde,ElfInfo* oldBinaryElf,ElfInfo* patch
   state.oldBinaryElf=oldBinaryElf;
 
   List* patchesList=generatePatchesFromFDEAndState(fde,&state,patch,patchedBin);
-  //now that we've made all the patch data, apply it
-  List* li=patchesList;
-  for(;li;li=li->next)
+  if(batchingTransformations)
   {
-    PatchData* pd=li->value;
-    memcpyToTarget(pd->addr,pd->data,pd->len);
+    //anything to do with a heap object that hasn't been allocated yet
+    //is written once it has been. Everything else is written now, so
+    //that later transformations see it just as they would unbatched
+    List* immediate=NULL;
+    List* immediateEnd=NULL;
+    List* next=NULL;
+    for(List* li=patchesList;li;li=next)
+    {
+      next=li->next;
+      li->next=NULL;
+      if(refersToHeapPlaceholder(li->value))
+      {
+        batchedPatches=concatLists(batchedPatches,batchedPatchesEnd,li,li,&batchedPatchesEnd);
+      }
+      else
+      {
+        immediate=concatLists(immediate,immediateEnd,li,li,&immediateEnd);
+      }
+    }
+    patchesList=immediate;
   }
+  //now that we've made all the patch data, apply it
+  writePatchData(patchesList);
   deleteList(patchesList,(FreeFunc)freePatchData);
 }
 
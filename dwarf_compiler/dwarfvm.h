@@ -58,15 +58,72 @@
 #include "types.h"
 #include "fderead.h"
 void patchDataWithFDE(VarInfo* var,FDE* transformerFDE,ElfInfo* targetBin,ElfInfo* patch,ElfInfo* patchedBin);
-//evaluates the given instructions and stores them in the output rules dictionary
+//evaluates the given instructions and stores them in the output rule set
 //the initial condition of regarray IS taken into account
 //execution continues until the end of the instructions or until the location is advanced
 //past stopLocation. stopLocation should be relative to the start of the instructions (i.e. the instructions are considered to start at 0)
 //if stopLocation is negative, it is ignored
-int evaluateInstructionsToRules(CIE* cie,RegInstruction* instrs,int numInstrs,Dictionary* rules,int startLocation, int stopLocation,int* outInstrsCnt);
+int evaluateInstructionsToRules(CIE* cie,RegInstruction* instrs,int numInstrs,RuleSet* rules,int startLocation, int stopLocation,int* outInstrsCnt);
+
+//the rules in effect from lowpc up to the start of the next row (or
+//the end of the FDE for the last row). The row's rules are
+//rules[firstRule] to rules[firstRule+numRules-1] of its table
+typedef struct
+{
+  addr_t lowpc;
+  int firstRule;
+  int numRules;
+} CFIRow;
+
+//an FDE's instructions compiled into DWARF's conceptual CFI table,
+//one row per range of locations with the same rules. Rows are sorted
+//by lowpc
+typedef struct CFITable
+{
+  CFIRow* rows;
+  int numRows;
+  PoRegRule* rules;
+  int numRules;
+  addr_t highpc;
+} CFITable;
+
+//the table is compiled on first use and kept with the FDE
+CFITable* getCFITable(FDE* fde);
+//returns NULL if pc isn't covered by the table
+CFIRow* findCFIRow(CFITable* table,addr_t pc);
+//returns NULL if the row has no rule for reg
+PoRegRule* getCFIRowRule(CFITable* table,CFIRow* row,PoReg reg);
+void getCFIRowRules(CFITable* table,CFIRow* row,RuleSet* rulesOut);
+void freeCFITable(CFITable* table);
 
 //stack length given in words
 word_t evaluateDwarfExpression(byte* bytes,int len,word_t* startingStack,int stackLen);
 
+//when set, pointer fixups use this to find where an object that
+//lived in a symbol of the old binary has been moved to, rather than
+//matching the symbol against the patch. It should return false if
+//oldAddr isn't part of any such object (i.e. it's on the heap)
+typedef bool (*MovedObjectLookup)(addr_t oldAddr,addr_t* newLocation);
+void setMovedObjectLookup(MovedObjectLookup lookup);
+
+//how heap objects that a transformation moves are allocated in the
+//target when transformations are batched
+typedef enum
+{
+  EHA_INDIVIDUAL=0,//a malloc each, so they can be freed individually
+                   //later. Made through the agent if it is running
+  EHA_SLAB,//one malloc for all of them, carved up by us. Faster, but
+           //none of them can be freed
+  EHA_CNT
+} E_HEAP_ALLOC_STRATEGY;
+void setHeapAllocStrategy(E_HEAP_ALLOC_STRATEGY strategy);
+
+//between these calls patchDataWithFDE only works out what to write.
+//The heap objects that need moving are then allocated all at once and
+//everything is written by endTransformationBatch. Batches are only
+//made on x86_64, elsewhere these do nothing
+void beginTransformationBatch();
+void endTransformationBatch();
+
 void cleanupDwarfVM();
 #endif
@@ -63,6 +63,7 @@
 #include "util/logging.h"
 #include "fderead.h"
 #include "symbol.h"
+#include "relocation.h"
 //#include "../config.h"
 
 //the ELF file is always opened read-only. If you want to write a copy
@@ -127,6 +128,8 @@ void endELF(ElfInfo* e)
   {
     freeDwarfInfo(e->dwarfInfo);
   }
+  freeSymbolIndices(e);
+  invalidateRelocIndex(e);
   //todo: this is not correct and leaks, need to a proper destroy function
   for(int i=0;i<e->callFrameInfo.numFDEs;i++)
   {
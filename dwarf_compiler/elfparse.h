@@ -64,6 +64,10 @@
 
 #include "callFrameInfo.h"
 
+typedef struct SymbolIndex SymbolIndex;
+typedef struct AddressIndex AddressIndex;
+typedef struct RelocIndex RelocIndex;
+
 typedef struct ElfInfo
 {
   int symTabCount;
@@ -81,6 +85,12 @@ typedef struct ElfInfo
   CallFrameInfo callFrameInfo;
   bool dataAllocatedByKatana;//used for memory management
   bool isPO;//is this elf object a patch object?
+  //name indices for .symtab and .dynsym, built on first lookup (see symbol.c)
+  struct SymbolIndex* symbolIndices[2];
+  //address indices of .symtab by symbol type, built on first lookup
+  struct AddressIndex* addressIndices[STT_NUM];
+  //all relocations by symbol and offset, built on first lookup (see relocation.c)
+  struct RelocIndex* relocIndex;
   #ifdef KATANA_X86_64_ARCH
   //set true if text sections use a small code
   //model, requiring any relocations of text, data, rodata, etc
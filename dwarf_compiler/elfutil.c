@@ -351,3 +351,27 @@ SectionHeaderData gshdrToSectionHeaderData(ElfInfo* e,GElf_Shdr shdr)
   shd.sh_entsize=shdr.sh_entsize; 
   return shd;
 }
+
+int getBuildId(ElfInfo* e,byte** buildId)
+{
+  *buildId=NULL;
+  Elf_Scn* scn=getSectionByName(e,".note.gnu.build-id");
+  if(!scn)
+  {
+    return 0;
+  }
+  Elf_Data* data=elf_getdata(scn,NULL);
+  size_t offset=0;
+  GElf_Nhdr nhdr;
+  size_t nameOffset,descOffset;
+  while(data && (offset=gelf_getnote(data,offset,&nhdr,&nameOffset,&descOffset))>0)
+  {
+    if(NT_GNU_BUILD_ID==nhdr.n_type && 4==nhdr.n_namesz &&
+       !memcmp((byte*)data->d_buf+nameOffset,"GNU",4))
+    {
+      *buildId=(byte*)data->d_buf+descOffset;
+      return nhdr.n_descsz;
+    }
+  }
+  return 0;
+}
@@ -152,6 +152,10 @@ bool hasERS(ElfInfo* e,E_RECOGNIZED_SECTION ers);
 //the returned string should be freed
 char* getFunctionNameAtPC(ElfInfo* elf,addr_t pc);
 void printSymTab(ElfInfo* e);
+//finds the GNU build-id note. Returns its length and points buildId at
+//it (the memory belongs to the ELF data, don't free it). Returns 0 if
+//the object has no build-id
+int getBuildId(ElfInfo* e,byte** buildId);
 
 
 #endif
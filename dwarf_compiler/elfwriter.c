@@ -200,9 +200,8 @@ void createSections(ElfInfo* e)
   shdr->sh_type=SHT_PROGBITS;
   shdr->sh_link=SHN_UNDEF;
   shdr->sh_info=SHN_UNDEF;
-  shdr->sh_addralign=1;  //todo: should this be word-aligned? It seems
-                         //that it is in the ELF files I've examined,
-                         //but does it have to be?
+  //page aligned in the file so that it can be mapped straight into the target
+  shdr->sh_addralign=PATCH_SECTION_ALIGN;
   shdr->sh_flags=SHF_WRITE;
   shdr->sh_name=addStrtabEntry(e,".data.new");
 
@@ -264,7 +263,8 @@ void createSections(ElfInfo* e)
   shdr->sh_type=SHT_PROGBITS;
   shdr->sh_link=0;
   shdr->sh_info=0;
-  shdr->sh_addralign=1;//normally text is aligned, but we never actually execute from this section
+  //page aligned in the file so that it can be mapped straight into the target
+  shdr->sh_addralign=PATCH_SECTION_ALIGN;
   shdr->sh_name=addStrtabEntry(e,".text.new");
   shdr->sh_addr=0;//going to have to relocate anyway so no point in trying to keep the same address
   shdr->sh_flags=SHF_EXECINSTR;
@@ -289,7 +289,7 @@ void createSections(ElfInfo* e)
   shdr->sh_type=SHT_PROGBITS;
   shdr->sh_link=0;
   shdr->sh_info=0;
-  shdr->sh_addralign=1;//normally text is aligned, but we never actually execute from this section
+  shdr->sh_addralign=PATCH_SECTION_ALIGN;
   shdr->sh_flags=0;
   shdr->sh_name=addStrtabEntry(e,".rodata.new");
 
@@ -376,7 +376,8 @@ RegInstruction* parseFDEInstructions(Dwarf_Debug dbg,unsigned char* bytes,
         break;
       case DW_CFA_advance_loc2:
         {
-        unsigned short delta = (unsigned short) *(bytes + 1);
+        unsigned short delta;
+        memcpy(&delta,bytes+1,sizeof(delta));
         result[*numInstrs].arg1=delta;
         bytes+=2;
         len -= 2;
@@ -395,12 +396,16 @@ RegInstruction* parseFDEInstructions(Dwarf_Debug dbg,unsigned char* bytes,
         bytes+=uleblen;
         len-=uleblen;
         result[*numInstrs].arg2=leb128ToUWord(bytes + 1, &uleblen);
+        bytes+=uleblen;
+        len-=uleblen;
         break;
       case DW_CFA_offset_extended_sf:
         result[*numInstrs].arg1Reg=readRegFromLEB128(bytes + 1, &uleblen);
         bytes+=uleblen;
         len-=uleblen;
         result[*numInstrs].arg2=leb128ToSWord(bytes + 1, &uleblen);
+        bytes+=uleblen;
+        len-=uleblen;
         break;
       case DW_CFA_undefined:
       case DW_CFA_same_value:
@@ -644,8 +649,7 @@ Map* readDebugFrame(ElfInfo* elf,bool ehInsteadOfDebug)
     elf->callFrameInfo.cies[i].initialInstructions=
       parseFDEInstructions(dbg,initInstr,initInstrLen,
                            &elf->callFrameInfo.cies[i].numInitialInstructions);
-    elf->callFrameInfo.cies[i].initialRules=dictCreate(100);//todo: get rid of
-    //arbitrary constant 100
+    elf->callFrameInfo.cies[i].initialRules=ruleSetCreate();
     evaluateInstructionsToRules(&elf->callFrameInfo.cies[i],
                                 elf->callFrameInfo.cies[i].initialInstructions,
                                 elf->callFrameInfo.cies[i].numInitialInstructions,
@@ -0,0 +1,318 @@
+/*
+  File: agent.c
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: a small agent injected into the target which runs a batch of
+               commands (allocations, mappings, copies) in a single stop
+*/
+
+#include "agent.h"
+#include "target.h"
+#include "transport.h"
+#include "linkmap.h"
+#include "constants.h"
+#include "util/logging.h"
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+
+//the agent's memory in the target is laid out as
+//  code, at the start
+//  AgentHeader, at AGENT_HEADER_OFFSET
+//  AgentCommand array, right after the header
+//filling in the header and commands takes a single write, running
+//them all a single continue and wait, and getting the results back a
+//single read
+#define AGENT_HEADER_OFFSET 256
+#define AGENT_COMMANDS_OFFSET (AGENT_HEADER_OFFSET+sizeof(AgentHeader))
+//the agent runs on the target's stack, below the red zone of whatever
+//the target was doing
+#define AGENT_STACK_GAP 256
+
+typedef struct
+{
+  addr_t mallocAddr;
+  addr_t freeAddr;
+  word_t numCommands;
+  word_t unused;
+} AgentHeader;
+
+typedef struct
+{
+  word_t type;//E_AGENT_COMMAND
+  word_t args[3];
+  word_t result;//filled in by the agent
+} AgentCommand;
+
+#ifdef KATANA_X86_64_ARCH
+//position independent, so it can be mapped in anywhere. Runs
+//numCommands commands, calling malloc and free through the header
+//and making mmap and mprotect syscalls directly, then traps back to
+//us. r12-r14 are preserved by malloc and free, the stack is 16-byte
+//aligned before each call
+static byte agentCode[]={
+  //start:
+  0xfc,                                   //cld
+  0x4c,0x8d,0x25,0xf8,0x00,0x00,0x00,     //lea r12,[rip+0xf8] (the header)
+  0x4d,0x8b,0x74,0x24,0x10,               //mov r14,[r12+0x10]
+  0x4d,0x8d,0x6c,0x24,0x20,               //lea r13,[r12+0x20]
+  //next:
+  0x4d,0x85,0xf6,                         //test r14,r14
+  0x0f,0x84,0x8c,0x00,0x00,0x00,          //je a7 <done>
+  0x49,0x8b,0x45,0x00,                    //mov rax,[r13+0x0]
+  0x49,0x8b,0x7d,0x08,                    //mov rdi,[r13+0x8]
+  0x49,0x8b,0x75,0x10,                    //mov rsi,[r13+0x10]
+  0x49,0x8b,0x55,0x18,                    //mov rdx,[r13+0x18]
+  0x48,0x83,0xf8,0x01,                    //cmp rax,0x1
+  0x74,0x22,                              //je 53 <do_malloc>
+  0x48,0x83,0xf8,0x02,                    //cmp rax,0x2
+  0x74,0x22,                              //je 59 <do_free>
+  0x48,0x83,0xf8,0x03,                    //cmp rax,0x3
+  0x74,0x25,                              //je 62 <do_mmap>
+  0x48,0x83,0xf8,0x04,                    //cmp rax,0x4
+  0x74,0x38,                              //je 7b <do_mprotect>
+  0x48,0x83,0xf8,0x05,                    //cmp rax,0x5
+  0x74,0x3b,                              //je 84 <do_memcpy>
+  0x48,0x83,0xf8,0x06,                    //cmp rax,0x6
+  0x74,0x3e,                              //je 8d <do_memset>
+  0x31,0xc0,                              //xor eax,eax
+  0xeb,0x44,                              //jmp 97 <store>
+  //do_malloc:
+  0x41,0xff,0x14,0x24,                    //call [r12]
+  0xeb,0x3e,                              //jmp 97 <store>
+  //do_free:
+  0x41,0xff,0x54,0x24,0x08,               //call [r12+0x8]
+  0x31,0xc0,                              //xor eax,eax
+  0xeb,0x35,                              //jmp 97 <store>
+  //do_mmap:
+  0x41,0xba,0x22,0x00,0x00,0x00,          //mov r10d,0x22 (MAP_PRIVATE|MAP_ANONYMOUS)
+  0x49,0xc7,0xc0,0xff,0xff,0xff,0xff,     //mov r8,0xffffffffffffffff
+  0x45,0x31,0xc9,                         //xor r9d,r9d
+  0xb8,0x09,0x00,0x00,0x00,               //mov eax,0x9 (SYS_mmap)
+  0x0f,0x05,                              //syscall
+  0xeb,0x1c,                              //jmp 97 <store>
+  //do_mprotect:
+  0xb8,0x0a,0x00,0x00,0x00,               //mov eax,0xa (SYS_mprotect)
+  0x0f,0x05,                              //syscall
+  0xeb,0x13,                              //jmp 97 <store>
+  //do_memcpy:
+  0x48,0x89,0xd1,                         //mov rcx,rdx
+  0xf3,0xa4,                              //rep movs es:[rdi],ds:[rsi]
+  0x31,0xc0,                              //xor eax,eax
+  0xeb,0x0a,                              //jmp 97 <store>
+  //do_memset:
+  0x48,0x89,0xf0,                         //mov rax,rsi
+  0x48,0x89,0xd1,                         //mov rcx,rdx
+  0xf3,0xaa,                              //rep stos es:[rdi],al
+  0x31,0xc0,                              //xor eax,eax
+  //store:
+  0x49,0x89,0x45,0x20,                    //mov [r13+0x20],rax
+  0x49,0x83,0xc5,0x28,                    //add r13,0x28
+  0x49,0xff,0xce,                         //dec r14
+  0xe9,0x6b,0xff,0xff,0xff,               //jmp 12 <next>
+  //done:
+  0xcc                                    //int3
+};
+#else
+//never mapped in, startTargetAgent refuses on other architectures
+static byte agentCode[]={0xcc};
+#endif
+
+bool agentEnabled=false;
+addr_t agentAddr=0;
+AgentHeader agentHeader;
+//commands waiting to be run. The first has handle firstQueuedHandle
+AgentCommand* queuedCommands=NULL;
+int numQueuedCommands=0;
+int maxQueuedCommands=0;
+AgentHandle firstQueuedHandle=0;
+//results of every command run so far, indexed by handle
+word_t* agentResults=NULL;
+int allocatedAgentResults=0;
+
+void setTargetAgentEnabled(bool enabled)
+{
+  agentEnabled=enabled;
+}
+
+bool targetAgentRunning()
+{
+  return 0!=agentAddr;
+}
+
+bool startTargetAgent(ElfInfo* targetBin,addr_t mallocAddr)
+{
+  if(!agentEnabled || agentAddr)
+  {
+    return false;
+  }
+#ifdef KATANA_X86_64_ARCH
+  memset(&agentHeader,0,sizeof(agentHeader));
+  agentHeader.mallocAddr=mallocAddr;
+  agentHeader.freeAddr=locateRuntimeSymbolInTarget(targetBin,"free");
+  addr_t addr=mmapTarget(AGENT_REGION_SIZE,PROT_READ|PROT_WRITE|PROT_EXEC,0);
+  memcpyToTarget(addr,agentCode,sizeof(agentCode));
+  agentAddr=addr;
+  maxQueuedCommands=(AGENT_REGION_SIZE-AGENT_COMMANDS_OFFSET)/sizeof(AgentCommand);
+  queuedCommands=zmalloc(maxQueuedCommands*sizeof(AgentCommand));
+  numQueuedCommands=0;
+  firstQueuedHandle=0;
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Started agent in the target at 0x%zx, it can run %i commands at a time\n",agentAddr,maxQueuedCommands);
+  return true;
+#else
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"The target agent is not supported on this architecture\n");
+  return false;
+#endif
+}
+
+void endTargetAgent()
+{
+  if(!agentAddr)
+  {
+    return;
+  }
+  runTargetAgent();
+  addr_t addr=agentAddr;
+  //so that munmapTarget doesn't try to use the agent
+  agentAddr=0;
+  munmapTarget(addr,AGENT_REGION_SIZE);
+  free(queuedCommands);
+  queuedCommands=NULL;
+  free(agentResults);
+  agentResults=NULL;
+  allocatedAgentResults=0;
+  numQueuedCommands=maxQueuedCommands=0;
+}
+
+AgentHandle queueAgentCommand(E_AGENT_COMMAND type,word_t arg0,word_t arg1,word_t arg2)
+{
+  assert(agentAddr);
+  if(numQueuedCommands>=maxQueuedCommands)
+  {
+    runTargetAgent();
+  }
+  AgentCommand* cmd=&queuedCommands[numQueuedCommands++];
+  cmd->type=type;
+  cmd->args[0]=arg0;
+  cmd->args[1]=arg1;
+  cmd->args[2]=arg2;
+  cmd->result=0;
+  return firstQueuedHandle+numQueuedCommands-1;
+}
+
+void runTargetAgent()
+{
+  if(!numQueuedCommands)
+  {
+    return;
+  }
+  struct timespec start,end;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  agentHeader.numCommands=numQueuedCommands;
+  memcpyToTarget(agentAddr+AGENT_HEADER_OFFSET,(byte*)&agentHeader,sizeof(agentHeader));
+  memcpyToTarget(agentAddr+AGENT_COMMANDS_OFFSET,(byte*)queuedCommands,
+                 numQueuedCommands*sizeof(AgentCommand));
+
+  struct user_regs_struct oldRegs,newRegs;
+  getTargetRegs(&oldRegs);
+  newRegs=oldRegs;
+  REG_IP(newRegs)=agentAddr;
+  REG_SP(newRegs)=(REG_SP(oldRegs)-AGENT_STACK_GAP) & ~(word_t)0xf;
+#ifdef KATANA_X86_64_ARCH
+  //if the target was stopped in a system call, don't let the kernel
+  //restart it on top of the agent
+  newRegs.orig_rax=-1;
+#endif
+  setTargetRegs(&newRegs);
+  //its mallocs and frees can wait forever on a lock held by one of the
+  //other (stopped) threads
+  if(!runTargetCall())
+  {
+    setTargetRegs(&oldRegs);
+    death("The agent in the target did not finish\n");
+  }
+  getTargetRegs(&newRegs);
+  if(REG_IP(newRegs)!=agentAddr+sizeof(agentCode))
+  {
+    death("The agent in the target stopped at 0x%zx rather than finishing\n",REG_IP(newRegs));
+  }
+  memcpyFromTarget((byte*)queuedCommands,agentAddr+AGENT_COMMANDS_OFFSET,
+                   numQueuedCommands*sizeof(AgentCommand));
+  setTargetRegs(&oldRegs);
+
+  int numResults=firstQueuedHandle+numQueuedCommands;
+  if(numResults>allocatedAgentResults)
+  {
+    allocatedAgentResults=(max(numResults,allocatedAgentResults*2));
+    agentResults=realloc(agentResults,allocatedAgentResults*sizeof(word_t));
+    MALLOC_CHECK(agentResults);
+  }
+  for(int i=0;i<numQueuedCommands;i++)
+  {
+    agentResults[firstQueuedHandle+i]=queuedCommands[i].result;
+  }
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"Agent ran %i commands in %.3fms\n",numQueuedCommands,
+            (end.tv_sec-start.tv_sec)*1e3+(end.tv_nsec-start.tv_nsec)/1e6);
+  firstQueuedHandle+=numQueuedCommands;
+  numQueuedCommands=0;
+}
+
+word_t getAgentResult(AgentHandle handle)
+{
+  assert(handle>=0 && handle<firstQueuedHandle+numQueuedCommands);
+  if(handle>=firstQueuedHandle)
+  {
+    runTargetAgent();
+  }
+  return agentResults[handle];
+}
@@ -0,0 +1,100 @@
+/*
+  File: agent.h
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: a small agent injected into the target which runs a batch of
+               commands (allocations, mappings, copies) in a single stop
+*/
+
+#ifndef agent_h
+#define agent_h
+#include "../types.h"
+#include "elfparse.h"
+
+//commands the agent understands, with the arguments each takes
+typedef enum
+{
+  EAC_NONE=0,
+  EAC_MALLOC,//size
+  EAC_FREE,//address
+  EAC_MMAP,//address hint, size, protection. Private anonymous memory
+  EAC_MPROTECT,//address, size, protection
+  EAC_MEMCPY,//destination, source, size
+  EAC_MEMSET,//destination, byte, size
+  EAC_FLUSH_ICACHE,//address, size. x86 keeps its instruction cache
+                   //coherent, so this does nothing there
+  EAC_CNT
+} E_AGENT_COMMAND;
+
+//identifies a queued command so its result can be retrieved
+typedef int AgentHandle;
+
+//the agent is off unless enabled
+void setTargetAgentEnabled(bool enabled);
+
+//map the agent into the (stopped) target. Returns false if it's
+//disabled or not supported on this architecture. While it's running
+//mallocTarget and mmapTarget go through it
+bool startTargetAgent(ElfInfo* targetBin,addr_t mallocAddr);
+//run anything still queued and unmap the agent
+void endTargetAgent();
+bool targetAgentRunning();
+
+//commands are queued and only run when one of their results is asked
+//for, when runTargetAgent is called, or when the queue fills up
+AgentHandle queueAgentCommand(E_AGENT_COMMAND type,word_t arg0,word_t arg1,word_t arg2);
+//run every queued command, all in one stop of the target
+void runTargetAgent();
+//what the command returned: the address for EAC_MALLOC (NULL on
+//failure) and EAC_MMAP (a negative errno on failure), 0 for anything
+//else. Runs the queue first if the command hasn't been run yet
+word_t getAgentResult(AgentHandle handle);
+#endif
@@ -0,0 +1,205 @@
+/*
+  File: arena.c
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Keeps track of which parts of the memory Katana has mapped into the target are in use
+*/
+
+#include "arena.h"
+#include "constants.h"
+#include "util/logging.h"
+#include <assert.h>
+
+typedef struct
+{
+  addr_t addr;
+  word_t size;
+} TargetBlock;
+
+//space is handed out from the front of a chunk. Everything past used
+//has never been handed out and so is still zero
+typedef struct
+{
+  addr_t addr;
+  word_t size;
+  word_t used;
+} ArenaChunk;
+
+struct TargetArena
+{
+  char* name;
+  ArenaChunk* chunks;
+  int numChunks;
+  int allocatedChunks;
+  //the padding that aligning allocations leaves behind. Nothing is
+  //ever given back, so pieces are never next to each other and there's
+  //nothing to merge
+  TargetBlock* freeBlocks;
+  int numFreeBlocks;
+  int allocatedFreeBlocks;
+  //statistics
+  int numAllocs;
+  int numReused;//allocations satisfied from the padding
+  word_t bytesInUse;
+  word_t bytesLost;//pieces too small to keep track of
+};
+
+TargetArena* targetArenaCreate(char* name)
+{
+  TargetArena* arena=zmalloc(sizeof(TargetArena));
+  arena->name=strdup(name);
+  return arena;
+}
+
+void targetArenaDelete(TargetArena* arena)
+{
+  free(arena->freeBlocks);
+  free(arena->chunks);
+  free(arena->name);
+  free(arena);
+}
+
+void targetArenaAddChunk(TargetArena* arena,addr_t addr,word_t size)
+{
+  if(arena->numChunks==arena->allocatedChunks)
+  {
+    arena->allocatedChunks=(max(arena->allocatedChunks*2,8));
+    arena->chunks=realloc(arena->chunks,arena->allocatedChunks*sizeof(ArenaChunk));
+    MALLOC_CHECK(arena->chunks);
+  }
+  ArenaChunk* chunk=&arena->chunks[arena->numChunks++];
+  chunk->addr=addr;
+  chunk->size=size;
+  chunk->used=0;
+}
+
+static void addFreeBlock(TargetArena* arena,addr_t addr,word_t size)
+{
+  if(size<TARGET_ARENA_MIN_BLOCK)
+  {
+    arena->bytesLost+=size;
+    return;
+  }
+  if(arena->numFreeBlocks==arena->allocatedFreeBlocks)
+  {
+    arena->allocatedFreeBlocks=(max(arena->allocatedFreeBlocks*2,8));
+    arena->freeBlocks=realloc(arena->freeBlocks,arena->allocatedFreeBlocks*sizeof(TargetBlock));
+    MALLOC_CHECK(arena->freeBlocks);
+  }
+  TargetBlock* b=&arena->freeBlocks[arena->numFreeBlocks++];
+  b->addr=addr;
+  b->size=size;
+}
+
+static addr_t alignUp(addr_t addr,word_t align)
+{
+  return (addr+align-1) & ~(addr_t)(align-1);
+}
+
+addr_t targetArenaAlloc(TargetArena* arena,word_t size,word_t align)
+{
+  assert(align && 0==(align&(align-1)));
+  //everything gets an address of its own
+  size=(max(size,1));
+  //padding first, there's never much of it
+  for(int i=0;i<arena->numFreeBlocks;i++)
+  {
+    TargetBlock b=arena->freeBlocks[i];
+    addr_t start=alignUp(b.addr,align);
+    if(start+size>b.addr+b.size)
+    {
+      continue;
+    }
+    //order doesn't matter
+    arena->freeBlocks[i]=arena->freeBlocks[--arena->numFreeBlocks];
+    addFreeBlock(arena,b.addr,start-b.addr);
+    addFreeBlock(arena,start+size,b.addr+b.size-(start+size));
+    arena->numAllocs++;
+    arena->numReused++;
+    arena->bytesInUse+=size;
+    return start;
+  }
+  //then space that's never been used, newest chunk first as it's the
+  //most likely to have room
+  for(int i=arena->numChunks-1;i>=0;i--)
+  {
+    ArenaChunk* chunk=&arena->chunks[i];
+    addr_t start=alignUp(chunk->addr+chunk->used,align);
+    if(start+size>chunk->addr+chunk->size)
+    {
+      continue;
+    }
+    addFreeBlock(arena,chunk->addr+chunk->used,start-(chunk->addr+chunk->used));
+    chunk->used=start+size-chunk->addr;
+    arena->numAllocs++;
+    arena->bytesInUse+=size;
+    return start;
+  }
+  return 0;
+}
+
+void logTargetArenaStats(TargetArena* arena)
+{
+  word_t bytesInChunks=0,bytesNeverUsed=0;
+  for(int i=0;i<arena->numChunks;i++)
+  {
+    bytesInChunks+=arena->chunks[i].size;
+    bytesNeverUsed+=arena->chunks[i].size-arena->chunks[i].used;
+  }
+  word_t bytesFree=0;
+  for(int i=0;i<arena->numFreeBlocks;i++)
+  {
+    bytesFree+=arena->freeBlocks[i].size;
+  }
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"%s arena: %i chunks of 0x%zx bytes, 0x%zx in use, 0x%zx never used, 0x%zx of padding in %i blocks, 0x%zx lost; %i allocations (%i in padding)\n",
+            arena->name,arena->numChunks,bytesInChunks,arena->bytesInUse,bytesNeverUsed,
+            bytesFree,arena->numFreeBlocks,arena->bytesLost,arena->numAllocs,arena->numReused);
+}
@@ -0,0 +1,237 @@
+/*
+  File: channel.c
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Memory shared between Katana and the target through a memfd, for moving large amounts of data
+*/
+
+#include "channel.h"
+#include "target.h"
+#include "transport.h"
+#include "agent.h"
+#include "pmap.h"
+#include "constants.h"
+#include "util/logging.h"
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+
+int channelFd=-1;
+byte* channelLocal=NULL;
+addr_t channelTarget=0;
+word_t channelSize=0;
+//copies are staged from the start of the channel and the space is
+//taken back once they've been made
+word_t channelUsed=0;
+TargetIOVec* channelCopies=NULL;
+int numChannelCopies=0;
+int allocatedChannelCopies=0;
+size_t channelBytesCopied=0;
+
+bool targetChannelOpen()
+{
+  return NULL!=channelLocal;
+}
+
+bool openTargetChannel(word_t size)
+{
+  if(channelLocal)
+  {
+    return true;
+  }
+#ifdef SYS_memfd_create
+  int fd=syscall(SYS_memfd_create,"katana-channel",MFD_CLOEXEC);
+  if(fd<0)
+  {
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Could not create a memfd to share with the target: %s\n",strerror(errno));
+    return false;
+  }
+  if(ftruncate(fd,size))
+  {
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Could not size the memfd to share with the target: %s\n",strerror(errno));
+    close(fd);
+    return false;
+  }
+  byte* local=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  if(MAP_FAILED==local)
+  {
+    close(fd);
+    return false;
+  }
+
+  addr_t addr=mmapTargetFd(fd,true,0,size,PROT_READ|PROT_WRITE,MAP_SHARED,0);
+  if(addr>(word_t)-4096)
+  {
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"The target could not map the memfd: %s\n",strerror(-(int)addr));
+    munmap(local,size);
+    close(fd);
+    return false;
+  }
+  channelFd=fd;
+  channelLocal=local;
+  channelTarget=addr;
+  channelSize=size;
+  channelUsed=0;
+  channelBytesCopied=0;
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Opened a 0x%zx byte channel, mapped at 0x%zx in the target\n",size,addr);
+  return true;
+#else
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"memfd is not supported, not opening a channel to the target\n");
+  return false;
+#endif
+}
+
+void closeTargetChannel()
+{
+  if(!channelLocal)
+  {
+    return;
+  }
+  assert(!numChannelCopies);
+  munmapTarget(channelTarget,channelSize);
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"%zu bytes were copied through the channel\n",channelBytesCopied);
+  munmap(channelLocal,channelSize);
+  close(channelFd);
+  channelFd=-1;
+  channelLocal=NULL;
+  channelTarget=0;
+  channelSize=channelUsed=0;
+  free(channelCopies);
+  channelCopies=NULL;
+  allocatedChannelCopies=0;
+}
+
+//returns the offset into the channel of len bytes, or -1 if there is
+//no room. Kept 16-byte aligned so the in-target copies are fast
+static sword_t channelAlloc(word_t len)
+{
+  word_t offset=(channelUsed+15) & ~(word_t)15;
+  if(offset>channelSize || channelSize-offset<len)
+  {
+    return -1;
+  }
+  channelUsed=offset+len;
+  return offset;
+}
+
+void stageWritesInTargetChannel(WriteBuffer* wb)
+{
+  if(!channelLocal || !targetAgentRunning())
+  {
+    return;
+  }
+  //only read when the first large write is found
+  MappedRegion* regions=NULL;
+  int numRegions=-1;
+  int numKept=0;
+  for(int i=0;i<wb->numWrites;i++)
+  {
+    PendingWrite* w=&wb->writes[i];
+    bool take=false;
+    if(w->len>=TARGET_CHANNEL_MIN_COPY)
+    {
+      if(numRegions<0)
+      {
+        numRegions=getMemoryMap(getTargetTransportPid(),&regions);
+      }
+      //the agent can only copy to memory the target can write to
+      int idx=numRegions>0?findMappedRegion(regions,numRegions,w->addr):-1;
+      take=idx>=0 && (regions[idx].prot & PROT_WRITE) &&
+        w->addr+w->len<=regions[idx].high;
+    }
+    sword_t offset=take?channelAlloc(w->len):-1;
+    if(offset<0)
+    {
+      wb->writes[numKept++]=*w;
+      continue;
+    }
+    memcpy(channelLocal+offset,w->data,w->len);
+    queueAgentCommand(EAC_MEMCPY,w->addr,channelTarget+offset,w->len);
+    if(numChannelCopies==allocatedChannelCopies)
+    {
+      allocatedChannelCopies=(max(allocatedChannelCopies*2,8));
+      channelCopies=realloc(channelCopies,allocatedChannelCopies*sizeof(TargetIOVec));
+      MALLOC_CHECK(channelCopies);
+    }
+    channelCopies[numChannelCopies].addr=w->addr;
+    channelCopies[numChannelCopies].data=channelLocal+offset;
+    channelCopies[numChannelCopies].len=w->len;
+    numChannelCopies++;
+    free(w->data);
+  }
+  wb->numWrites=numKept;
+  free(regions);
+}
+
+void finishTargetChannelCopies(E_TARGET_VERIFY_MODE verifyMode)
+{
+  if(!numChannelCopies)
+  {
+    return;
+  }
+  runTargetAgent();
+  verifyTargetv(channelCopies,numChannelCopies,verifyMode);
+  size_t bytes=0;
+  for(int i=0;i<numChannelCopies;i++)
+  {
+    bytes+=channelCopies[i].len;
+  }
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"Copied %i ranges (%zu bytes) through the channel\n",numChannelCopies,bytes);
+  channelBytesCopied+=bytes;
+  numChannelCopies=0;
+  channelUsed=0;
+}
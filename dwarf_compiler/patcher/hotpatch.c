@@ -60,9 +60,38 @@
 #include "../relocation.h"
 #include "../symbol.h"
 #include <math.h>
+#include "pmap.h"
+#include "arena.h"
+#include "transport.h"
+#include "../constants.h"
+#include "../util/logging.h"
+#include <fcntl.h>
+#include <sys/mman.h>
 
-addr_t addrFreeSpace;
-addr_t freeSpaceLeft;
+//the memory we've mapped into the target, kept separately for code
+//and data so that data needn't be executable. This only lives as long
+//as the patcher does: space left over in chunks mapped by an earlier
+//run of the patcher isn't known about and isn't reused
+TargetArena* targetArenas[ETA_CNT]={NULL};
+//whether the arenas hold space that has only been planned
+bool arenasHoldPlannedSpace=false;
+
+//while planning, reserving space doesn't touch the target, it just
+//records what will need to be mapped in when the plan is committed
+bool planningFreeSpace=false;
+PlannedRegion* plannedRegions=NULL;
+int numPlannedRegions=0;
+//the memory map of the target as it will be once the planned regions
+//are mapped
+MappedRegion* planningMap=NULL;
+int numPlanningMapRegions=0;
+//where the patch's memory may go so that rel32 references between it
+//and the target reach. Kept after planning ends for chunks reserved
+//later
+addr_t planningLow=0;
+addr_t planningHigh=0;
+//the end of the last chunk reserved
+addr_t lastChunkEnd=0;
 
 
 
@@ -78,41 +107,323 @@ int getIdxForField(TypeInfo* type,char* name)
   return FIELD_DELETED;
 }
 
-//mmap some contiguous space in the target, but don't
-//assume it's being used right now. It will be claimed
-//by later calls to getFreeSpaceInTarget
-//if where is non-NULL, try to map in the space at the given address
-//returns the address of where the space was actually mapped in
-//note however that the user should NOT USE this address directly,
-//call getFreeSpaceInTarget instead
-addr_t reserveFreeSpaceInTarget(uint howMuch,addr_t where)
+static TargetArena* getTargetArena(E_TARGET_ARENA arena)
+{
+  if(!targetArenas[arena])
+  {
+    targetArenas[arena]=targetArenaCreate(ETA_CODE==arena?"code":"data");
+  }
+  return targetArenas[arena];
+}
+
+static int targetArenaProt(E_TARGET_ARENA arena)
+{
+  //code stays writable so that it can be written without forcing
+  return ETA_CODE==arena?PROT_READ|PROT_WRITE|PROT_EXEC:PROT_READ|PROT_WRITE;
+}
+
+static void resetTargetArenas()
+{
+  for(int i=0;i<ETA_CNT;i++)
+  {
+    if(targetArenas[i])
+    {
+      targetArenaDelete(targetArenas[i]);
+      targetArenas[i]=NULL;
+    }
+  }
+  arenasHoldPlannedSpace=false;
+}
+
+//record that [addr,addr+size) will be mapped, so that nothing else
+//planned goes there
+static void addToPlanningMap(addr_t addr,word_t size,int prot)
+{
+  int idx=findMappedRegionAfter(planningMap,numPlanningMapRegions,addr);
+  if(idx<numPlanningMapRegions && planningMap[idx].low<addr+size)
+  {
+    death("Region planned at 0x%zx overlaps %s mapped at 0x%zx-0x%zx\n",addr,
+          planningMap[idx].name,planningMap[idx].low,planningMap[idx].high);
+  }
+  planningMap=realloc(planningMap,sizeof(MappedRegion)*(numPlanningMapRegions+1));
+  MALLOC_CHECK(planningMap);
+  memmove(&planningMap[idx+1],&planningMap[idx],sizeof(MappedRegion)*(numPlanningMapRegions-idx));
+  numPlanningMapRegions++;
+  MappedRegion* region=&planningMap[idx];
+  memset(region,0,sizeof(MappedRegion));
+  region->low=addr;
+  region->high=addr+size;
+  region->prot=prot;
+  strcpy(region->name,"(planned for the patch)");
+}
+
+addr_t reserveFreeSpaceInTarget(E_TARGET_ARENA arena,word_t howMuch,addr_t where)
+{
+  word_t pageSize=sysconf(_SC_PAGE_SIZE);
+  word_t size=(max((howMuch+pageSize-1)/pageSize*pageSize,pageSize));
+  int prot=targetArenaProt(arena);
+  addr_t addr;
+  if(planningFreeSpace)
+  {
+    if(!where)
+    {
+      if(!numPlannedRegions)
+      {
+        death("The first region planned for the target must be given an address\n");
+      }
+      //carry on as close after the last region we planned as is free.
+      //Regions mapped from files lie within it
+      PlannedRegion* last=&plannedRegions[numPlannedRegions-1];
+      while(last->fileName)
+      {
+        last--;
+      }
+      where=findFreeRange(planningMap,numPlanningMapRegions,size,planningLow,
+                          planningHigh,last->addr+last->size);
+      if(!where)
+      {
+        death("Could not find 0x%zx more bytes of free space in the target between 0x%zx and 0x%zx\n",
+              size,planningLow,planningHigh);
+      }
+    }
+    addToPlanningMap(where,size,prot);
+    numPlannedRegions++;
+    plannedRegions=realloc(plannedRegions,sizeof(PlannedRegion)*numPlannedRegions);
+    MALLOC_CHECK(plannedRegions);
+    PlannedRegion* region=&plannedRegions[numPlannedRegions-1];
+    region->addr=where;
+    region->size=size;
+    region->prot=prot;
+    region->fileName=NULL;
+    region->fileOffset=0;
+    logprintf(ELL_INFO_V2,ELS_HOTPATCH,"planned region of 0x%zx bytes at 0x%zx\n",region->size,region->addr);
+    addr=where;
+    arenasHoldPlannedSpace=true;
+  }
+  else
+  {
+    bool placed=false;
+    if(!where)
+    {
+      if(!planningHigh)
+      {
+        death("No space in the target has been planned for the patch, don't know where to reserve more\n");
+      }
+      //the kernel would put it wherever it liked, possibly out of reach
+      //of the rest of the patch
+      MappedRegion* mapped=NULL;
+      int numMapped=getMemoryMap(getTargetTransportPid(),&mapped);
+      if(numMapped<0)
+      {
+        death("Could not read the memory map of the target\n");
+      }
+      where=findFreeRange(mapped,numMapped,size,planningLow,planningHigh,
+                          (max(lastChunkEnd,planningLow)));
+      free(mapped);
+      if(!where)
+      {
+        death("Could not find 0x%zx more bytes of free space in the target between 0x%zx and 0x%zx\n",
+              size,planningLow,planningHigh);
+      }
+      placed=true;
+    }
+    addr=mmapTarget(size,prot,where);
+    if(placed && addr!=where)
+    {
+      death("Could not map 0x%zx bytes in the target at 0x%zx\n",size,where);
+    }
+  }
+  lastChunkEnd=addr+size;
+  targetArenaAddChunk(getTargetArena(arena),addr,size);
+  return addr;
+}
+
+addr_t getFreeSpaceInTarget(E_TARGET_ARENA arena,word_t howMuch,word_t align)
+{
+  TargetArena* ta=getTargetArena(arena);
+  addr_t addr=targetArenaAlloc(ta,howMuch,align);
+  if(!addr)
+  {
+    //the new chunk has room for the alignment, and for whatever else
+    //comes along after
+    reserveFreeSpaceInTarget(arena,(max(howMuch+align,TARGET_ARENA_CHUNK_SIZE)),0);
+    addr=targetArenaAlloc(ta,howMuch,align);
+    assert(addr);
+  }
+  return addr;
+}
+
+void logTargetSpaceStats()
+{
+  for(int i=0;i<ETA_CNT;i++)
+  {
+    if(targetArenas[i])
+    {
+      logTargetArenaStats(targetArenas[i]);
+    }
+  }
+}
+
+bool planFileMapping(addr_t addr,word_t size,char* fileName,word_t offset)
 {
-  if(howMuch<=freeSpaceLeft && (0==where || addrFreeSpace==where))
+  if(!planningFreeSpace)
+  {
+    return false;
+  }
+  //the plan may be committed from somewhere else
+  char* path=realpath(fileName,NULL);
+  if(!path)
+  {
+    return false;
+  }
+  word_t pageSize=sysconf(_SC_PAGE_SIZE);
+  assert(0==addr%pageSize && 0==offset%pageSize);
+  //mapped just like the region it lies within. Space mapped for an
+  //earlier patch is already in use and isn't mapped over
+  int prot=0;
+  for(int i=0;i<numPlannedRegions;i++)
+  {
+    if(!plannedRegions[i].fileName && addr>=plannedRegions[i].addr &&
+       addr<plannedRegions[i].addr+plannedRegions[i].size)
+    {
+      prot=plannedRegions[i].prot;
+    }
+  }
+  if(!prot)
   {
-    return addrFreeSpace;
+    free(path);
+    return false;
   }
-  uint numPages=(uint)ceil((double)howMuch/(double)sysconf(_SC_PAGE_SIZE));
-  //todo: separate out different function/structure for executable code
-  addrFreeSpace=mmapTarget(numPages*sysconf(_SC_PAGE_SIZE),PROT_READ|PROT_WRITE|PROT_EXEC,where);
-  freeSpaceLeft=numPages*sysconf(_SC_PAGE_SIZE);
-  //todo: if there's a little bit of free space left,
-  //we just discard it. This is wasteful
-  return addrFreeSpace;
+  numPlannedRegions++;
+  plannedRegions=realloc(plannedRegions,sizeof(PlannedRegion)*numPlannedRegions);
+  MALLOC_CHECK(plannedRegions);
+  PlannedRegion* region=&plannedRegions[numPlannedRegions-1];
+  region->addr=addr;
+  region->size=(size+pageSize-1)/pageSize*pageSize;
+  region->prot=prot;
+  region->fileName=path;
+  region->fileOffset=offset;
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"planned mapping 0x%zx bytes of %s at 0x%zx\n",region->size,path,addr);
+  return true;
 }
 
+void freePlannedRegions(PlannedRegion* regions,int numRegions)
+{
+  for(int i=0;i<numRegions;i++)
+  {
+    free(regions[i].fileName);
+  }
+  free(regions);
+}
+
+void beginPlanningFreeSpace(MappedRegion* regions,int numRegions,addr_t low,addr_t high)
+{
+  planningFreeSpace=true;
+  free(planningMap);
+  planningMap=regions;
+  numPlanningMapRegions=numRegions;
+  planningLow=low;
+  planningHigh=high;
+  //space planned before and never mapped can't be handed out again.
+  //Space that has been mapped can
+  if(arenasHoldPlannedSpace)
+  {
+    resetTargetArenas();
+  }
+  freePlannedRegions(plannedRegions,numPlannedRegions);
+  plannedRegions=NULL;
+  numPlannedRegions=0;
+}
 
-addr_t getFreeSpaceInTarget(uint howMuch)
+int endPlanningFreeSpace(PlannedRegion** regions)
 {
-  addr_t retval;
-  if(howMuch<=freeSpaceLeft)
-  {
-    retval=addrFreeSpace;
-  }
-  reserveFreeSpaceInTarget(howMuch,0);
-  retval=addrFreeSpace;
-  freeSpaceLeft-=howMuch;
-  addrFreeSpace+=howMuch;
-  return retval;
-  //todo: if there's a little bit of free space left,
-  //we just discard it. This is wasteful
+  planningFreeSpace=false;
+  free(planningMap);
+  planningMap=NULL;
+  numPlanningMapRegions=0;
+  *regions=plannedRegions;
+  int cnt=numPlannedRegions;
+  plannedRegions=NULL;
+  numPlannedRegions=0;
+  return cnt;
+}
+
+//returns false if any of the regions overlaps something already
+//mapped in the target
+bool plannedRegionsStillFree(int pid,PlannedRegion* regions,int numRegions)
+{
+  MappedRegion* mapped=NULL;
+  int numMapped=getMemoryMap(pid,&mapped);
+  if(numMapped<0)
+  {
+    return false;
+  }
+  bool result=true;
+  for(int i=0;i<numRegions && result;i++)
+  {
+    //the first mapping ending after the region starts is the only one
+    //that could overlap it without one before it doing so too
+    int j=findMappedRegionAfter(mapped,numMapped,regions[i].addr);
+    if(j<numMapped && mapped[j].low<regions[i].addr+regions[i].size)
+    {
+      logprintf(ELL_WARN,ELS_HOTPATCH,"Planned region at 0x%zx overlaps %s mapped at 0x%zx-0x%zx\n",regions[i].addr,mapped[j].name,mapped[j].low,mapped[j].high);
+      result=false;
+    }
+  }
+  free(mapped);
+  return result;
+}
+
+//map region from its file over the anonymous memory already there,
+//then drop from writes what the file provides. Returns false if it
+//couldn't be mapped
+static bool mapPlannedRegionFromFile(PlannedRegion* region,WriteBuffer* writes)
+{
+  int fd=open(region->fileName,O_RDONLY);
+  if(fd<0)
+  {
+    logprintf(ELL_WARN,ELS_HOTPATCH,"Could not open %s to map it into the target, its contents will be copied instead\n",region->fileName);
+    return false;
+  }
+  word_t result=mmapTargetFd(fd,false,region->addr,region->size,region->prot,
+                             MAP_PRIVATE|MAP_FIXED,region->fileOffset);
+  if(result!=region->addr)
+  {
+    logprintf(ELL_WARN,ELS_HOTPATCH,"Could not map %s into the target at 0x%zx, its contents will be copied instead\n",region->fileName,region->addr);
+    close(fd);
+    return false;
+  }
+  //compare with what's actually in the file, not what we think is
+  //there, in case it has changed
+  byte* contents=zmalloc(region->size);
+  ssize_t len=pread(fd,contents,region->size,region->fileOffset);
+  close(fd);
+  if(len>0)
+  {
+    writeBufferElide(writes,region->addr,contents,len);
+  }
+  free(contents);
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"Mapped 0x%zx bytes of %s into the target at 0x%zx\n",region->size,region->fileName,region->addr);
+  return true;
+}
+
+void mapPlannedRegions(PlannedRegion* regions,int numRegions,WriteBuffer* writes)
+{
+  for(int i=0;i<numRegions;i++)
+  {
+    if(regions[i].fileName)
+    {
+      //everything it lies within has already been mapped
+      mapPlannedRegionFromFile(&regions[i],writes);
+      continue;
+    }
+    addr_t addr=mmapTarget(regions[i].size,regions[i].prot,regions[i].addr);
+    if(addr!=regions[i].addr)
+    {
+      death("Could not map planned region at 0x%zx (got 0x%zx instead)\n",regions[i].addr,addr);
+    }
+  }
+  //what the arenas have left is now real, and can be handed out by
+  //later patches
+  arenasHoldPlannedSpace=false;
 }
@@ -56,15 +56,76 @@
 #ifndef hotpatch_h
 #define hotpatch_h
 #include "../types.h"
+#include "writebuffer.h"
+#include "pmap.h"
 #ifdef legacy
 addr_t getFreeSpaceForTransformation(TransformationInfo* trans,uint howMuch);
 #endif
-addr_t getFreeSpaceInTarget(uint howMuch);
+//memory in the target is handed out from separate arenas for code
+//and data, so that data needn't be executable
+typedef enum
+{
+  ETA_CODE=0,
+  ETA_DATA,
+  ETA_CNT
+} E_TARGET_ARENA;
 
-//mmap some contiguous space in the target, but don't
+//howMuch bytes in the target aligned to align (a power of 2), reusing
+//space left over from aligning earlier allocations where possible
+addr_t getFreeSpaceInTarget(E_TARGET_ARENA arena,word_t howMuch,word_t align);
+
+//mmap some contiguous space in the target for an arena, but don't
 //assume it's being used right now. It will be claimed
 //by later calls to getFreeSpaceInTarget
-//if where is non-NULL, try to map in the space at the given address
+//if where is non-NULL, try to map in the space at the given address,
+//otherwise it goes in free space within the bounds given to the last
+//beginPlanningFreeSpace, nearest the end of the last space reserved
 //returns the address of where the space was actually mapped in
-addr_t reserveFreeSpaceInTarget(uint howMuch,addr_t where);
+addr_t reserveFreeSpaceInTarget(E_TARGET_ARENA arena,word_t howMuch,addr_t where);
+
+//log how the target memory in each arena is being used
+void logTargetSpaceStats();
+
+//a region of the target which the plan for a patch expects to have
+//mapped in
+typedef struct
+{
+  addr_t addr;
+  word_t size;
+  int prot;
+  //if not NULL, the region lies within an earlier one and is mapped
+  //privately over it from fileOffset in this file
+  char* fileName;
+  word_t fileOffset;
+} PlannedRegion;
+
+//between these calls, reserveFreeSpaceInTarget and
+//getFreeSpaceInTarget hand out addresses without mapping anything in
+//the target. The first reservation must specify where. Later ones go
+//in the free space within [low,high) nearest the end of the last,
+//directly after it where there's room. What's free is worked out
+//from regions, the memory map of the target, which
+//beginPlanningFreeSpace takes over. Space planned but never mapped is
+//forgotten when planning begins again. endPlanningFreeSpace returns
+//the number of regions and stores them (which should be freed with
+//freePlannedRegions) in regions
+void beginPlanningFreeSpace(MappedRegion* regions,int numRegions,addr_t low,addr_t high);
+int endPlanningFreeSpace(PlannedRegion** regions);
+
+//while planning, record that the page aligned space at addr (whole
+//pages handed out by getFreeSpaceInTarget) should be mapped from offset
+//into fileName rather than have its contents written. Returns false if
+//nothing is being planned
+bool planFileMapping(addr_t addr,word_t size,char* fileName,word_t offset);
+void freePlannedRegions(PlannedRegion* regions,int numRegions);
+
+//returns false if any of the regions overlaps something already
+//mapped in the target
+bool plannedRegionsStillFree(int pid,PlannedRegion* regions,int numRegions);
+//map the regions in at exactly the addresses planned. Dies if that
+//isn't possible. A region that should come from a file but can't be
+//mapped from it is left as anonymous memory, for the writes to fill
+//in. Where it can be, whatever in writes the file already provides is
+//dropped from them
+void mapPlannedRegions(PlannedRegion* regions,int numRegions,WriteBuffer* writes);
 #endif
@@ -65,10 +65,77 @@
 */
 
 #include <link.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "elfutil.h"
 #include "target.h"
+#include "transport.h"
+#include "pmap.h"
+#include "linkmap.h"
+#include "util/dictionary.h"
 #include "util/logging.h"
 
+//a library loaded by the target, mapped in from disk so that its
+//dynamic symbols can be looked up without reading the target
+typedef struct
+{
+  byte* image;
+  size_t size;
+  ElfXX_Sym* syms;
+  ElfXX_Word numSyms;
+  char* strtab;
+  size_t strtabSize;
+  ElfXX_Word* hashtable;//NULL if the library has no .hash
+  byte* gnuHashtable;//NULL if the library has no .gnu.hash
+  size_t gnuHashtableSize;
+} DSOImage;
+
+//the header of a .gnu.hash section. It's followed by a Bloom filter of
+//bloomSize address-sized words, numBuckets bucket words and then a
+//chain word (a symbol's hash with the low bit marking the end of its
+//bucket) for every symbol from symOffset on
+typedef struct
+{
+  ElfXX_Word numBuckets;
+  ElfXX_Word symOffset;
+  ElfXX_Word bloomSize;
+  ElfXX_Word bloomShift;
+} GnuHashHeader;
+
+//an object in the target's link map, with what we need from its
+//dynamic section. Read once and then reused for every lookup
+typedef struct
+{
+  addr_t lAddr;
+  addr_t lLd;
+  char* name;//never NULL, empty if the object has no name
+  DSOImage* dso;//NULL if the object has to be read from the target
+  bool dynamicRead;
+  //the rest are only filled in for objects read from the target, once
+  //dynamicRead is set. They're addresses in the target
+  addr_t strtab;
+  addr_t symtab;
+  addr_t hashtable;
+  ElfXX_Word numBuckets;
+  ElfXX_Word numChains;
+  addr_t gnuHashtable;
+  GnuHashHeader gnuHeader;
+} LinkMapEntry;
+
+//library name (as in l_name) -> DSOImage*, or NULL if the library
+//can't be used from disk and must be read from the target
+Dictionary* dsoImages=NULL;
+//the target's /proc/pid/maps, read the first time a library is opened
+MappedRegion* targetRegions=NULL;
+int numTargetRegions=0;
+//the target's link map, read the first time a symbol is looked up
+LinkMapEntry* linkMapEntries=NULL;
+int numLinkMapEntries=0;
+
 
 //locate the address of the link map
 //todo: this may be more architecture-specific than I'd like
@@ -102,123 +169,549 @@ addr_t locateLinkMap(ElfInfo* e)
   return result;
 }
 
-//looks for the dynamic symbol with a given name
-//in a linkmap entry
-//returns true (and stores result) on success
-bool locateSymbolInLinkMap(struct link_map* lm,addr_t* result,char* symName,int symNameHash)
+static void deleteDSOImage(void* dso_)
 {
-  //todo: this is unsafe, need to check pages mapped into target
-  //to make sure this access will be ok
-  char nameBuf[256];
-  memset(nameBuf, 0, 256);
+  DSOImage* dso=dso_;
+  if(dso)
+  {
+    munmap(dso->image,dso->size);
+    free(dso);
+  }
+}
 
-  //Start out trying to copy a small amount, as trying to copy 256
-  //bytes could extend past mapped memory
-  int maxName = 32;
-  do
+//whether the library at path (as the target named it), which st
+//describes, is what the target has mapped with load bias lAddr. It may
+//since have been deleted or replaced on disk
+static bool dsoImageMatchesTarget(DSOImage* dso,char* path,struct stat* st,addr_t lAddr)
+{
+  if(!targetRegions)
   {
-    memcpyFromTarget((byte*)nameBuf, (addr_t)lm->l_name, maxName);
+    numTargetRegions=getMemoryMap(getTargetTransportPid(),&targetRegions);
+    if(numTargetRegions<0)
+    {
+      numTargetRegions=0;
+      return false;
+    }
   }
-  while(nameBuf[maxName] != '\0' && (maxName += 32) <= 256);
-  
-  nameBuf[255]=0;
-  if(!strlen(nameBuf))
+  //the kernel shows the path with any symlinks resolved
+  char realPath[PATH_MAX];
+  if(!realpath(path,realPath))
   {
-    logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in nameless library, it's probably not what we want\n");
     return false;
   }
-  
-  logprintf(ELL_INFO_V2,ELS_LINKMAP,"Looking for symbol %s in link map for object %s loaded at 0x%x with dynamic section at 0x%x\n",symName,nameBuf,lm->l_addr,lm->l_ld);
-    
-  addr_t strtab=0;
-  addr_t symtab=0;
-  addr_t hashtableBuckets=0;
-  ElfXX_Word numBuckets=0;
-  addr_t hashtableChains=0;
-  addr_t hashtable=0;
-  
+  ElfXX_Ehdr* ehdr=(ElfXX_Ehdr*)dso->image;
+  if(ehdr->e_phoff+ehdr->e_phnum*sizeof(ElfXX_Phdr)>dso->size)
+  {
+    return false;
+  }
+  ElfXX_Phdr* phdrs=(ElfXX_Phdr*)(dso->image+ehdr->e_phoff);
+  for(int i=0;i<ehdr->e_phnum;i++)
+  {
+    if(PT_LOAD!=phdrs[i].p_type)
+    {
+      continue;
+    }
+    //the first loadable segment is mapped at the lowest address
+    addr_t low=(lAddr+phdrs[i].p_vaddr) & ~((addr_t)sysconf(_SC_PAGESIZE)-1);
+    for(int j=0;j<numTargetRegions;j++)
+    {
+      if(low==targetRegions[j].low && !strcmp(realPath,targetRegions[j].name))
+      {
+        //a file replaced under the same name is a different inode
+        return st->st_ino==targetRegions[j].inode && st->st_dev==targetRegions[j].device;
+      }
+    }
+    return false;
+  }
+  return false;
+}
+
+//map a library the target has loaded from disk, returns NULL if we
+//have to read it from the target instead
+static DSOImage* openDSOImage(char* path,addr_t lAddr)
+{
+  int fd=open(path,O_RDONLY);
+  if(fd<0)
+  {
+    return NULL;
+  }
+  struct stat st;
+  if(fstat(fd,&st)<0 || st.st_size<sizeof(ElfXX_Ehdr))
+  {
+    close(fd);
+    return NULL;
+  }
+  DSOImage* dso=zmalloc(sizeof(DSOImage));
+  dso->size=st.st_size;
+  dso->image=mmap(NULL,dso->size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if(MAP_FAILED==dso->image)
+  {
+    free(dso);
+    return NULL;
+  }
+  ElfXX_Ehdr* ehdr=(ElfXX_Ehdr*)dso->image;
+  if(memcmp(ehdr->e_ident,ELFMAG,SELFMAG) || ELFCLASSXX!=ehdr->e_ident[EI_CLASS] ||
+     ehdr->e_shoff+ehdr->e_shnum*sizeof(ElfXX_Shdr)>dso->size ||
+     !dsoImageMatchesTarget(dso,path,&st,lAddr))
+  {
+    logprintf(ELL_INFO_V2,ELS_LINKMAP,"%s on disk does not match what the target has mapped\n",path);
+    deleteDSOImage(dso);
+    return NULL;
+  }
+  ElfXX_Shdr* shdrs=(ElfXX_Shdr*)(dso->image+ehdr->e_shoff);
+  for(int i=0;i<ehdr->e_shnum;i++)
+  {
+    if(shdrs[i].sh_offset+shdrs[i].sh_size>dso->size)
+    {
+      continue;
+    }
+    if(SHT_DYNSYM==shdrs[i].sh_type && shdrs[i].sh_link<ehdr->e_shnum)
+    {
+      ElfXX_Shdr* strtabShdr=&shdrs[shdrs[i].sh_link];
+      if(strtabShdr->sh_offset+strtabShdr->sh_size>dso->size)
+      {
+        continue;
+      }
+      dso->syms=(ElfXX_Sym*)(dso->image+shdrs[i].sh_offset);
+      dso->numSyms=shdrs[i].sh_size/sizeof(ElfXX_Sym);
+      dso->strtab=(char*)(dso->image+strtabShdr->sh_offset);
+      dso->strtabSize=strtabShdr->sh_size;
+    }
+    else if(SHT_GNU_HASH==shdrs[i].sh_type && shdrs[i].sh_size>=sizeof(GnuHashHeader))
+    {
+      dso->gnuHashtable=dso->image+shdrs[i].sh_offset;
+      dso->gnuHashtableSize=shdrs[i].sh_size;
+    }
+    else if(SHT_HASH==shdrs[i].sh_type)
+    {
+      dso->hashtable=(ElfXX_Word*)(dso->image+shdrs[i].sh_offset);
+      ElfXX_Word numBuckets=dso->hashtable[0];
+      if(shdrs[i].sh_size<(2+numBuckets)*sizeof(ElfXX_Word))
+      {
+        dso->hashtable=NULL;
+      }
+    }
+  }
+  if(!dso->syms)
+  {
+    deleteDSOImage(dso);
+    return NULL;
+  }
+  logprintf(ELL_INFO_V2,ELS_LINKMAP,"Looking up symbols in %s from disk\n",path);
+  return dso;
+}
+
+static DSOImage* getDSOImage(char* path,addr_t lAddr)
+{
+  if(!dsoImages)
+  {
+    dsoImages=dictCreate(32);
+  }
+  if(dictExists(dsoImages,path))
+  {
+    return dictGet(dsoImages,path);
+  }
+  DSOImage* dso=openDSOImage(path,lAddr);
+  dictInsert(dsoImages,path,dso);
+  return dso;
+}
+
+static bool symbolNameIs(DSOImage* dso,ElfXX_Sym* sym,char* symName)
+{
+  return sym->st_name<dso->strtabSize &&
+    !strncmp(dso->strtab+sym->st_name,symName,dso->strtabSize-sym->st_name);
+}
+
+//the hash function used by .gnu.hash
+static uint32_t gnuHash(char* name)
+{
+  uint32_t h=5381;
+  for(;*name;name++)
+  {
+    h=(h<<5)+h+(byte)*name;
+  }
+  return h;
+}
+
+//the two bits of a .gnu.hash Bloom filter word a symbol hashing to h
+//sets. If either is clear the object doesn't define the symbol
+static addr_t gnuBloomMask(GnuHashHeader* header,uint32_t h)
+{
+  int bitsPerWord=sizeof(addr_t)*8;
+  return ((addr_t)1<<(h%bitsPerWord)) | ((addr_t)1<<((h>>header->bloomShift)%bitsPerWord));
+}
+
+static ElfXX_Sym* findSymbolInDSOGnuHash(DSOImage* dso,char* symName,uint32_t h)
+{
+  GnuHashHeader* header=(GnuHashHeader*)dso->gnuHashtable;
+  if(!header->bloomSize || !header->numBuckets)
+  {
+    return NULL;
+  }
+  addr_t* bloom=(addr_t*)(dso->gnuHashtable+sizeof(GnuHashHeader));
+  ElfXX_Word* buckets=(ElfXX_Word*)(bloom+header->bloomSize);
+  ElfXX_Word* chain=buckets+header->numBuckets;
+  if((byte*)chain>dso->gnuHashtable+dso->gnuHashtableSize)
+  {
+    return NULL;
+  }
+  size_t numChainWords=(dso->gnuHashtable+dso->gnuHashtableSize-(byte*)chain)/sizeof(ElfXX_Word);
+  addr_t mask=gnuBloomMask(header,h);
+  if((bloom[(h/(sizeof(addr_t)*8))%header->bloomSize] & mask)!=mask)
+  {
+    return NULL;
+  }
+  ElfXX_Word symIdx=buckets[h%header->numBuckets];
+  if(symIdx<header->symOffset)
+  {
+    return NULL;
+  }
+  for(;symIdx<dso->numSyms && symIdx-header->symOffset<numChainWords;symIdx++)
+  {
+    ElfXX_Word chainHash=chain[symIdx-header->symOffset];
+    if((chainHash|1)==(h|1) && symbolNameIs(dso,&dso->syms[symIdx],symName))
+    {
+      return &dso->syms[symIdx];
+    }
+    if(chainHash&1)
+    {
+      break;//end of the bucket
+    }
+  }
+  return NULL;
+}
+
+//returns NULL if the library does not define symName
+static ElfXX_Sym* findSymbolInDSOImage(DSOImage* dso,char* symName,
+                                       unsigned long symNameHash,uint32_t symNameGnuHash)
+{
+  ElfXX_Sym* sym=NULL;
+  if(dso->gnuHashtable)
+  {
+    sym=findSymbolInDSOGnuHash(dso,symName,symNameGnuHash);
+  }
+  else if(dso->hashtable)
+  {
+    ElfXX_Word numBuckets=dso->hashtable[0];
+    ElfXX_Word numChains=dso->hashtable[1];
+    ElfXX_Word* buckets=dso->hashtable+2;
+    ElfXX_Word* chains=buckets+numBuckets;
+    ElfXX_Word symIdx=numBuckets?buckets[symNameHash % numBuckets]:STN_UNDEF;
+    for(;symIdx!=STN_UNDEF && symIdx<numChains && symIdx<dso->numSyms;symIdx=chains[symIdx])
+    {
+      if(symbolNameIs(dso,&dso->syms[symIdx],symName))
+      {
+        sym=&dso->syms[symIdx];
+        break;
+      }
+    }
+  }
+  else
+  {
+    for(ElfXX_Word i=1;i<dso->numSyms;i++)
+    {
+      if(symbolNameIs(dso,&dso->syms[i],symName))
+      {
+        sym=&dso->syms[i];
+        break;
+      }
+    }
+  }
+  if(sym && SHN_UNDEF==sym->st_shndx)
+  {
+    //this is an import symbol
+    return NULL;
+  }
+  return sym;
+}
+
+void endLinkMap()
+{
+  if(dsoImages)
+  {
+    dictDelete(dsoImages,deleteDSOImage);
+    dsoImages=NULL;
+  }
+  free(targetRegions);
+  targetRegions=NULL;
+  numTargetRegions=0;
+  for(int i=0;i<numLinkMapEntries;i++)
+  {
+    free(linkMapEntries[i].name);
+  }
+  free(linkMapEntries);
+  linkMapEntries=NULL;
+  numLinkMapEntries=0;
+}
+
+//read the name of a link map entry. Names are read a bit at a time, as
+//trying to copy a whole path's worth could extend past mapped memory.
+//Sets *complete to false if no path could be that long and the name was
+//cut short. The returned string should be freed
+static char* readLinkMapName(addr_t nameAddr,bool* complete)
+{
+  int bufSize=64;
+  char* nameBuf=zmalloc(bufSize);
+  *complete=true;
+  if(!nameAddr)
+  {
+    return nameBuf;
+  }
+  for(int offset=0;;offset+=32)
+  {
+    if(offset+32>=PATH_MAX)
+    {
+      *complete=false;
+      break;
+    }
+    if(offset+32>=bufSize)
+    {
+      nameBuf=realloc(nameBuf,bufSize*2);
+      MALLOC_CHECK(nameBuf);
+      memset(nameBuf+bufSize,0,bufSize);
+      bufSize*=2;
+    }
+    memcpyFromTarget((byte*)nameBuf+offset,nameAddr+offset,32);
+    if(memchr(nameBuf+offset,0,32))
+    {
+      break;
+    }
+  }
+  return nameBuf;
+}
+
+//read the entries of the target's link map, along with the libraries
+//they name if those can be used from disk
+static void snapshotLinkMap(ElfInfo* e)
+{
+  addr_t linkmapAddr=locateLinkMap(e);
+  //there is a linkmap entry for the original binary and for each library that's been linked
+  //in. We scan all the link maps and look for the symbol in the hash table of each
+  //todo: is there a global hash table or something we can use. Some comments in
+  //the code by grugq (mentioned in Attribution in the file header) seem to indicate
+  //that he considers this method slow
+  //for details of the linkmap structure see /usr/include/link.h
+  int allocatedEntries=0;
+  struct link_map lm;
+  for(addr_t lmAddr=linkmapAddr;lmAddr;lmAddr=(addr_t)lm.l_next)
+  {
+    memcpyFromTarget((byte*)&lm,lmAddr,sizeof(lm));
+    if(numLinkMapEntries>=allocatedEntries)
+    {
+      allocatedEntries=(max(allocatedEntries*2,8));
+      linkMapEntries=realloc(linkMapEntries,allocatedEntries*sizeof(LinkMapEntry));
+      MALLOC_CHECK(linkMapEntries);
+    }
+    LinkMapEntry* entry=&linkMapEntries[numLinkMapEntries++];
+    memset(entry,0,sizeof(LinkMapEntry));
+    entry->lAddr=lm.l_addr;
+    entry->lLd=(addr_t)lm.l_ld;
+    bool complete;
+    entry->name=readLinkMapName((addr_t)lm.l_name,&complete);
+    if(!complete)
+    {
+      logprintf(ELL_WARN,ELS_LINKMAP,"Name of library at 0x%zx is too long to be a path, reading it from the target\n",entry->lAddr);
+    }
+    //reading the library from disk is far cheaper than reading the
+    //target a word at a time. Only libraries which have been deleted or
+    //replaced since they were loaded, have names we couldn't read, or
+    //have no file at all (like the vdso), have to be read from the target
+    if(complete && strlen(entry->name))
+    {
+      entry->dso=getDSOImage(entry->name,entry->lAddr);
+    }
+  }
+  logprintf(ELL_INFO_V2,ELS_LINKMAP,"Read %i link map entries\n",numLinkMapEntries);
+}
+
+//read what we need from the .dynamic section of an object we're
+//reading from the target
+static void readLinkMapEntryDynamic(LinkMapEntry* entry)
+{
+  entry->dynamicRead=true;
   //first we look at the link the linkmap entry has to the .dynamic section
   //for whatever program or library it corresponds to
   ElfXX_Dyn dyn;
   for(int i=0;;i++)
   {
-    memcpyFromTarget((byte*)&dyn,(addr_t)(lm->l_ld+i),sizeof(dyn));
+    memcpyFromTarget((byte*)&dyn,entry->lLd+i*sizeof(ElfXX_Dyn),sizeof(dyn));
     if(dyn.d_tag==DT_NULL)
     {
       break;//end of .dynamic
     }
-    //logprintf(ELL_INFO_V4,ELS_LINKMAP,"on dynamic tag %i tag is %i\n",i,dyn.d_tag);
     switch(dyn.d_tag)
     {
     case DT_HASH:
-      {
-        hashtable=dyn.d_un.d_ptr;
-      }
+      entry->hashtable=dyn.d_un.d_ptr;
+      break;
+    case DT_GNU_HASH:
+      entry->gnuHashtable=dyn.d_un.d_ptr;
       break;
     case DT_STRTAB:
-      strtab=dyn.d_un.d_ptr;
+      entry->strtab=dyn.d_un.d_ptr;
       break;
     case DT_SYMTAB:
-      symtab=dyn.d_un.d_ptr;
-    case DT_SONAME:
+      entry->symtab=dyn.d_un.d_ptr;
       break;
     default:
       break;
     }
   }
 
-  if(!symtab || !strtab || !hashtable)
+  //in practice, I sometimes see invalid hashtable entries and no good way that
+  //I've found to detect them. So we just look for an invalid memory access and
+  //bail when we get it, hope the symbol wasn't in that library
+  if(entry->gnuHashtable &&
+     !memcpyFromTargetNoDeath((byte*)&entry->gnuHeader,entry->gnuHashtable,sizeof(GnuHashHeader)))
+  {
+    entry->gnuHashtable=0;
+  }
+  if(entry->hashtable)
+  {
+    ElfXX_Word header[2];
+    if(memcpyFromTargetNoDeath((byte*)header,entry->hashtable,sizeof(header)))
+    {
+      entry->numBuckets=header[0];
+      entry->numChains=header[1];
+      logprintf(ELL_INFO_V4,ELS_LINKMAP,"there are %i hashtable buckets and %i chains\n The hashtable lives at 0x%x\n",entry->numBuckets,entry->numChains,entry->hashtable);
+    }
+    else
+    {
+      entry->hashtable=0;
+    }
+  }
+}
+
+//look for a symbol in an object through its .gnu.hash in the target
+static bool findSymbolInTargetGnuHash(LinkMapEntry* entry,char* symName,uint32_t h,
+                                      ElfXX_Sym* symOut)
+{
+  GnuHashHeader* header=&entry->gnuHeader;
+  if(!header->bloomSize || !header->numBuckets)
   {
-    logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in library %s because not all the needed entries were found in the .dynamic section\n",nameBuf);
     return false;
   }
-          
+  addr_t bloom=entry->gnuHashtable+sizeof(GnuHashHeader);
+  addr_t buckets=bloom+header->bloomSize*sizeof(addr_t);
+  addr_t chain=buckets+header->numBuckets*sizeof(ElfXX_Word);
+  //the Bloom filter answers most lookups for symbols the object
+  //doesn't have with a single read
+  addr_t bloomWord;
+  memcpyFromTarget((byte*)&bloomWord,bloom+sizeof(addr_t)*((h/(sizeof(addr_t)*8))%header->bloomSize),sizeof(addr_t));
+  addr_t mask=gnuBloomMask(header,h);
+  if((bloomWord & mask)!=mask)
+  {
+    return false;
+  }
+  ElfXX_Word symIdx;
+  memcpyFromTarget((byte*)&symIdx,buckets+sizeof(ElfXX_Word)*(h%header->numBuckets),sizeof(ElfXX_Word));
+  if(symIdx<header->symOffset)
+  {
+    return false;
+  }
+  for(;;symIdx++)
+  {
+    ElfXX_Word chainHash;
+    memcpyFromTarget((byte*)&chainHash,chain+sizeof(ElfXX_Word)*(symIdx-header->symOffset),sizeof(ElfXX_Word));
+    if((chainHash|1)==(h|1))
+    {
+      memcpyFromTarget((byte*)symOut,entry->symtab+sizeof(ElfXX_Sym)*symIdx,sizeof(ElfXX_Sym));
+      //todo: using strnmatchTarget we don't support symbols with names
+      //that are a substring of another symbol's name
+      if(strnmatchTarget(symName,entry->strtab+symOut->st_name))
+      {
+        return true;
+      }
+    }
+    if(chainHash&1)
+    {
+      return false;//end of the bucket
+    }
+  }
+}
 
-  //in practice, I sometimes see invalid hashtable entries and no good way that
-  //I've found to detect them. So we just look for an invalid memory access and
-  //bail when we get it, hope the symbol wasn't in that library
-  if(!memcpyFromTargetNoDeath((byte*)&numBuckets,hashtable,sizeof(ElfXX_Word)))
+//look for a symbol in an object through its .hash in the target
+static bool findSymbolInTargetHash(LinkMapEntry* entry,char* symName,unsigned long symNameHash,
+                                   ElfXX_Sym* symOut)
+{
+  if(!entry->numBuckets)
   {
-    logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in this library ('%s'), doesn't seem to contain valid hashtable\n",nameBuf);
     return false;
   }
-  ElfXX_Word numChains;
-  memcpyFromTarget((byte*)&numChains,hashtable + sizeof(ElfXX_Word),sizeof(ElfXX_Word));
-  
-  logprintf(ELL_INFO_V4,ELS_LINKMAP,"there are %i hashtable buckets and %i chains\n The hashtable lives at 0x%x\n",numBuckets,numChains,hashtable);
-  hashtableBuckets=hashtable+2*sizeof(ElfXX_Word);
-  hashtableChains=hashtable+2*sizeof(ElfXX_Word)+numBuckets*sizeof(ElfXX_Word);
+  addr_t hashtableBuckets=entry->hashtable+2*sizeof(ElfXX_Word);
+  addr_t hashtableChains=hashtableBuckets+entry->numBuckets*sizeof(ElfXX_Word);
 
   //now that we've found what we need to look at the hashtable, we actually index into
   //the hash table
   ElfXX_Word symIdx=0;
-  memcpyFromTarget((byte*)&symIdx,hashtableBuckets+sizeof(ElfXX_Word)*(symNameHash % numBuckets),sizeof(ElfXX_Word));
+  memcpyFromTarget((byte*)&symIdx,hashtableBuckets+sizeof(ElfXX_Word)*(symNameHash % entry->numBuckets),sizeof(ElfXX_Word));
   for(;symIdx != STN_UNDEF;memcpyFromTarget((byte*)&symIdx,hashtableChains+sizeof(ElfXX_Word)*symIdx,sizeof(ElfXX_Word)))
   {
-    
     logprintf(ELL_INFO_V4,ELS_LINKMAP,"symbol index is %i\n",symIdx);
-    ElfXX_Sym sym;
-    memcpyFromTarget((byte*)&sym,symtab+sizeof(ElfXX_Sym)*symIdx,sizeof(ElfXX_Sym));
+    memcpyFromTarget((byte*)symOut,entry->symtab+sizeof(ElfXX_Sym)*symIdx,sizeof(ElfXX_Sym));
 
     //todo: using strnmatchTarget we don't support symbols with names
     //that are a substring of another symbol's name
-    if(strnmatchTarget(symName,strtab+sym.st_name))
+    if(strnmatchTarget(symName,entry->strtab+symOut->st_name))
     {
-      if(0==sym.st_value && SHN_UNDEF==sym.st_shndx)
-      {
-        //this is an import symbol
-        return false;
-      }
-      logprintf(ELL_INFO_V1,ELS_LINKMAP,"Found symbol %s in %s\n",symName,nameBuf);
-      *result=lm->l_addr+sym.st_value;//l_addr is used to rebase the symbol index
       return true;
     }
-    if(symIdx > numChains)
+    if(symIdx > entry->numChains)
     {
       return false;
     }
   }
-  return false;  
+  return false;
+}
+
+//looks for the dynamic symbol with a given name
+//in a linkmap entry
+//returns true (and stores result) on success
+static bool locateSymbolInLinkMap(LinkMapEntry* entry,addr_t* result,char* symName,
+                                  unsigned long symNameHash,uint32_t symNameGnuHash)
+{
+  if(!strlen(entry->name))
+  {
+    logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in nameless library, it's probably not what we want\n");
+    return false;
+  }
+
+  logprintf(ELL_INFO_V2,ELS_LINKMAP,"Looking for symbol %s in link map for object %s loaded at 0x%x with dynamic section at 0x%x\n",symName,entry->name,entry->lAddr,entry->lLd);
+
+  ElfXX_Sym sym;
+  if(entry->dso)
+  {
+    ElfXX_Sym* dsoSym=findSymbolInDSOImage(entry->dso,symName,symNameHash,symNameGnuHash);
+    if(!dsoSym)
+    {
+      return false;
+    }
+    sym=*dsoSym;
+  }
+  else
+  {
+    if(!entry->dynamicRead)
+    {
+      readLinkMapEntryDynamic(entry);
+    }
+    if(!entry->symtab || !entry->strtab || (!entry->hashtable && !entry->gnuHashtable))
+    {
+      logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in library %s because not all the needed entries were found in the .dynamic section\n",entry->name);
+      return false;
+    }
+    bool found=entry->gnuHashtable?
+      findSymbolInTargetGnuHash(entry,symName,symNameGnuHash,&sym):
+      findSymbolInTargetHash(entry,symName,symNameHash,&sym);
+    if(!found || (0==sym.st_value && SHN_UNDEF==sym.st_shndx))
+    {
+      //not there, or this is an import symbol
+      return false;
+    }
+  }
+  logprintf(ELL_INFO_V1,ELS_LINKMAP,"Found symbol %s in %s\n",symName,entry->name);
+  *result=entry->lAddr+sym.st_value;//l_addr is used to rebase the symbol index
+  return true;
 }
 
 //the passed ElfInfo object must correspond to the
@@ -226,30 +719,21 @@ bool locateSymbolInLinkMap(struct link_map* lm,addr_t* result,char* symName,int
 //in target.c
 addr_t locateRuntimeSymbolInTarget(ElfInfo* e,char* name)
 {
-  //todo: cache this
-  addr_t linkmapAddr=locateLinkMap(e);
-  //there is a linkmap entry for the original binary and for each library that's been linked
-  //in. We scan all the link maps and look for the symbol in the hash table of each
-  //todo: is there a global hash table or something we can use. Some comments in
-  //the code by grugq (mentioned in Attribution in the file header) seem to indicate
-  //that he considers this method slow
-  //for details of the linkmap structure see /usr/include/link.h
-
-  struct link_map lm;
-  memcpyFromTarget((byte*)&lm,linkmapAddr,sizeof(lm));
-  for(;;memcpyFromTarget((byte*)&lm,(addr_t)lm.l_next,sizeof(lm)))
+  if(!linkMapEntries)
+  {
+    snapshotLinkMap(e);
+  }
+  //can't seem to get rid of a sign cast warning in below line, it seems
+  //different library versions of libelf have different signdness for the param there
+  unsigned long symNameHash=elf_hash(name);
+  uint32_t symNameGnuHash=gnuHash(name);
+  for(int i=0;i<numLinkMapEntries;i++)
   {
     addr_t addr;//store the result address
-    //can't seem to get rid of a sign cast warning in below line, it seems
-    //different library versions of libelf have different signdness for the param there
-    if(locateSymbolInLinkMap(&lm,&addr,name,elf_hash(name)))
+    if(locateSymbolInLinkMap(&linkMapEntries[i],&addr,name,symNameHash,symNameGnuHash))
     {
       return addr;
     }
-    if(0==lm.l_next)
-    {
-      break;
-    }
   }
   death("could not locate runtime symbol %s\n",name);
   return 0;
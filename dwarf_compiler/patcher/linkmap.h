@@ -65,8 +65,16 @@
 
 #ifndef linkmap_h
 #define linkmap_h
+//returns the address of the target's link map, read from GOT[1]
+addr_t locateLinkMap(ElfInfo* e);
+
 //the passed ElfInfo object must correspond to the
 //currently running target known to the methods
 //in target.c
 addr_t locateRuntimeSymbolInTarget(ElfInfo* e,char* name);
+
+//the target's link map is read once, along with the dynamic sections
+//and on-disk images of its libraries, and reused for every runtime
+//symbol lookup until this is called
+void endLinkMap();
 #endif
@@ -69,6 +69,9 @@
 #include "util/logging.h"
 #include "linkmap.h"
 #include "safety.h"
+#include "unwind.h"
+#include "agent.h"
+#include "channel.h"
 #include "info/fdedump.h"
 #include "constants.h"
 #include <sys/wait.h>
@@ -79,6 +82,7 @@
 
 ElfInfo* patchedBin=NULL;
 ElfInfo* targetBin=NULL;
+PatchPlan* plan=NULL;//the plan currently being prepared or committed
 addr_t patchTextAddr=0;
 addr_t patchRodataAddr=0;
 addr_t patchRelTextAddr=0;
@@ -91,7 +95,7 @@ void allocateMemoryForVarRelocation(VarInfo* var)
 {
   printf("allocating memory for relocating variabl %s\n",var->name);
   int length=var->type->length;
-  var->newLocation=getFreeSpaceInTarget(length);
+  var->newLocation=getFreeSpaceInTarget(ETA_DATA,length,sizeof(word_t));
   byte* zeros=zmalloc(length);
   printf("zeroing out new memory at 0x%lx with length %i\n",(unsigned long)var->newLocation,length);
   memcpyToTarget(var->newLocation,zeros,length);
@@ -118,7 +122,8 @@ void relocateVar(VarInfo* var,ElfInfo* targetBin)
 
   //do this first so that addend computation will be done
   //before we change the symtab entry
-  List* relocItems=getRelocationItemsFor(patchedBin,symIdx);
+  int numRelocs;
+  RelocInfo** relocs=getRelocationsForSymbol(patchedBin,symIdx,&numRelocs);
 
   //record in the patched binary that we're putting the variable here
   GElf_Sym sym;
@@ -127,12 +132,16 @@ void relocateVar(VarInfo* var,ElfInfo* targetBin)
   //now we write the symbol to the new binary
   Elf_Data* symTabData=getDataByERS(patchedBin,ERS_SYMTAB);
   gelf_update_sym(symTabData,symIdx,&sym);
+  invalidateAddressIndices(patchedBin);
 
   logprintf(ELL_INFO_V4,ELS_PATCHAPPLY,"var new location is 0x%x\n",var->newLocation);
 
   //we do need to do this because may contain some relocations
   //not in new code
-  applyRelocations(relocItems,IN_MEM);
+  for(int i=0;i<numRelocs;i++)
+  {
+    applyRelocation(relocs[i],IN_MEM);
+  }
 }
 
 void insertTrampolineJump(addr_t insertAt,addr_t jumpTo)
@@ -161,17 +170,9 @@ void insertTrampolineJump(addr_t insertAt,addr_t jumpTo)
   #error Unknown architecture
   #endif
   
+  //verified along with everything else when the writes are committed
   memcpyToTarget(insertAt,code,len);
-  //todo: probably don't need verify as memcpyToTarget can
-  //be made to verify it's writings
-  byte* verify=zmalloc(len);
-  memcpyFromTarget(verify,insertAt,len);
-  if(memcmp(code,verify,len))
-  {
-    death("failed to copy code into target properly\n");
-  }
   free(code);
-  free(verify);
 }
 
 void applyVariablePatch(VarInfo* var,Map* fdeMap,ElfInfo* patch)
@@ -200,7 +201,15 @@ void applyVariablePatch(VarInfo* var,Map* fdeMap,ElfInfo* patch)
     }
     if(var->type->fde)//might not have an fde if just a constant with a changed initializer
     {
-      transformVarData(var,fdeMap,patch);
+      //the data can only be transformed once the target has been
+      //stopped, but we want to find out now if we can't do it
+      if(!mapGet(fdeMap,&var->type->fde))
+      {
+        death("could not find transformer for variable %s referencing fde%i\n",var->name,var->type->fde);
+      }
+      List* li=zmalloc(sizeof(List));
+      li->value=var;
+      plan->varsToTransform=concatLists(plan->varsToTransform,plan->varsToTransformEnd,li,li,&plan->varsToTransformEnd);
     }
     if(var->newLocation!=var->oldLocation)
     {
@@ -257,7 +266,13 @@ void applyFunctionPatch(SubprogramInfo* func,int pid,ElfInfo* targetBin,ElfInfo*
     //track of where it is for future patches
     Elf_Data* symTabData=getDataByERS(patchedBin,ERS_SYMTAB);
     gelf_update_sym(symTabData,idx,&sym);
-    insertTrampolineJump(oldAddr,addr);
+    invalidateAddressIndices(patchedBin);
+    //the jump itself is only written when the plan is committed
+    plan->numTrampolines++;
+    plan->trampolines=realloc(plan->trampolines,sizeof(Trampoline)*plan->numTrampolines);
+    MALLOC_CHECK(plan->trampolines);
+    plan->trampolines[plan->numTrampolines-1].insertAt=oldAddr;
+    plan->trampolines[plan->numTrampolines-1].jumpTo=addr;
 
   }
   else
@@ -339,10 +354,34 @@ addr_t copyInEntireSection(ElfInfo* patch,char* name,char* newName)
   {
     death("Failed to find data for section %s in patch\n",name);
   }
-  addr_t addr=getFreeSpaceInTarget(data->d_size);
+  GElf_Shdr shdr;
+  gelf_getshdr(scn,&shdr);
+  word_t pageSize=sysconf(_SC_PAGE_SIZE);
+  E_TARGET_ARENA arena=(shdr.sh_flags & SHF_EXECINSTR)?ETA_CODE:ETA_DATA;
+  addr_t addr;
+  //sections the patch lays out on page boundaries can be mapped
+  //straight from its file, so that only the pages which are written
+  //to afterwards are ever copied
+  if(patch->isPO && patch->fname && data->d_size && SHT_PROGBITS==shdr.sh_type &&
+     shdr.sh_addralign>=pageSize && 0==shdr.sh_offset%pageSize)
+  {
+    //whole pages, so that nothing else shares them
+    addr=getFreeSpaceInTarget(arena,(data->d_size+pageSize-1)/pageSize*pageSize,pageSize);
+    if(planFileMapping(addr,data->d_size,patch->fname,shdr.sh_offset))
+    {
+      logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"%s will be mapped from %s at 0x%lx\n",name,patch->fname,(unsigned long)addr);
+    }
+  }
+  else
+  {
+    addr=getFreeSpaceInTarget(arena,data->d_size,(max(shdr.sh_addralign,1)));
+  }
   if(data->d_size)
   {
     logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"mapping in the entirety of %s Copying %li bytes to 0x%lx\n",name,(long)data->d_size,(unsigned long)addr);
+    //staged even when the section will be mapped from the file, so
+    //that reads see it while planning. Whatever the file provides is
+    //dropped when the mapping is made
     memcpyToTarget(addr,data->d_buf,data->d_size);
   }
   else
@@ -352,8 +391,7 @@ addr_t copyInEntireSection(ElfInfo* patch,char* name,char* newName)
 
   //and create a section for it
   Elf_Scn* newscn = elf_newscn (patchedBin->e);
-  GElf_Shdr shdr,shdrNew;
-  gelf_getshdr(scn,&shdr);
+  GElf_Shdr shdrNew;
   gelf_getshdr(scn,&shdrNew);
   shdrNew.sh_addr=addr;
   shdrNew.sh_name=addStrtabEntryToExisting(patchedBin,newName,true);
@@ -540,25 +578,35 @@ void fixupPatchRelocations(ElfInfo* patch)
 
   Elf_Scn* textScn=getSectionByName(patch,".text.new");
   Elf_Data* textData=elf_getdata(textScn,NULL);
- 
+
+  //many relocations share a symbol, only reindex each one once
+  idx_t* reindexed=zmalloc(sizeof(idx_t)*(max(patch->symTabCount,1)));
   for(int i=0;i<numRelocs;i++)
   {
     ElfXX_Rela* rela=((ElfXX_Rela*)data->d_buf)+i;
     int symIdx=ELFXX_R_SYM(rela->r_info);
     int type=ELFXX_R_TYPE(rela->r_info);
-    GElf_Sym sym;
-    getSymbol(patch,symIdx,&sym);
-
-    int flags=ESFF_MANGLED_OK | ESFF_BSS_MATCH_DATA_OK;
-    if(ELF64_ST_TYPE(sym.st_info)!=STT_SECTION)
-    {
-      flags|=ESFF_VERSIONED_SECTIONS_OK;
-    }
-    int reindex=reindexSymbol(patch,patchedBin,symIdx,flags);
-    logprintf(ELL_INFO_V2,ELS_SYMBOL,"reindexed to %i at 0x%x\n",reindex,(uint)getSymAddress(patchedBin,reindex));
+    int reindex=symIdx<patch->symTabCount?reindexed[symIdx]:STN_UNDEF;
     if(STN_UNDEF==reindex)
     {
-      death("Could not reindex symbol from patch to patchedBin\n");
+      GElf_Sym sym;
+      getSymbol(patch,symIdx,&sym);
+
+      int flags=ESFF_MANGLED_OK | ESFF_BSS_MATCH_DATA_OK;
+      if(ELF64_ST_TYPE(sym.st_info)!=STT_SECTION)
+      {
+        flags|=ESFF_VERSIONED_SECTIONS_OK;
+      }
+      reindex=reindexSymbol(patch,patchedBin,symIdx,flags);
+      logprintf(ELL_INFO_V2,ELS_SYMBOL,"reindexed to %i at 0x%x\n",reindex,(uint)getSymAddress(patchedBin,reindex));
+      if(STN_UNDEF==reindex)
+      {
+        death("Could not reindex symbol from patch to patchedBin\n");
+      }
+      if(symIdx<patch->symTabCount)
+      {
+        reindexed[symIdx]=reindex;
+      }
     }
     rela->r_info=ELFXX_R_INFO(reindex,type);
     addr_t newOffset=rela->r_offset-oldTextNewStart+patchTextAddr;
@@ -589,6 +637,9 @@ void fixupPatchRelocations(ElfInfo* patch)
     }
     rela->r_offset=newOffset;
   }
+  free(reindexed);
+  //we've rewritten the entries in place
+  invalidateRelocIndex(patch);
 }
 
 //copy PLT and GOT to new locations, as we may need to expand them
@@ -768,11 +819,16 @@ void katanaPLT()
 
 }
 
-void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
+PatchPlan* preparePatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
 {
-  startPtrace(pid);
+  //nothing in here stops the target. Everything we need from its
+  //memory can be read while it runs
+  startTargetTransport(pid);
   targetBin=targetBin_;
-  
+  plan=zmalloc(sizeof(PatchPlan));
+  plan->pid=pid;
+  plan->targetBin=targetBin;
+  plan->patch=patch;
   
   //we create an on-disk version of the patched binary
   //setting this up is much easier than modifying the in-memory ELF
@@ -786,6 +842,7 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
   free(dir);
   elf_flagelf(targetBin->e,ELF_C_SET,ELF_F_LAYOUT);
   patchedBin=duplicateElf(targetBin,patchedBinFname,false,true);
+  plan->patchedBin=patchedBin;
   
   elf_flagelf(patchedBin->e,ELF_C_SET,ELF_F_LAYOUT);//we assume all responsibility
   //for layout. For some reason libelf seems to have issues with some of the program
@@ -806,74 +863,107 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
   //this isn't necessarily going to be the case
   char cwd[PATH_MAX];
   getcwd(cwd,PATH_MAX);
-  DwarfInfo* diPatch=readDWARFTypes(patch,cwd);
-  Map* fdeMap=readDebugFrame(patch,false);//get mapping between fde offsets and fde structures
-  if(!fdeMap)
+  plan->diPatch=readDWARFTypes(patch,cwd);
+  plan->fdeMap=readDebugFrame(patch,false);//get mapping between fde offsets and fde structures
+  if(!plan->fdeMap)
   {
     death("Unable to read frame info, can't apply patch\n");
   }
-  
-
 
   //we need to know where malloc lives in the target because
   //we may need it when dealing with the heap
-  addr_t mallocAddr=locateRuntimeSymbolInTarget(targetBin,"malloc");
-  if(mallocAddr)
-  {
-    setMallocAddress(mallocAddr);
-  }
-  else
+  plan->linkMapAddr=locateLinkMap(targetBin);
+  plan->mallocAddr=locateRuntimeSymbolInTarget(targetBin,"malloc");
+  if(!plan->mallocAddr)
   {
     death("Cannot find malloc in the target program\n");
   }
-  setTargetTextStart(targetBin->textStart[IN_MEM]);
-
-  
-  bringTargetToSafeState(targetBin,patch,pid);
 
-  //reserve memory in a big block so that we'll have as much as we need
-  uint amount=0;
+  //reserve memory in two big blocks, one for code and one for data,
+  //so that we'll have as much as we need
+  word_t pageSize=sysconf(_SC_PAGE_SIZE);
+  word_t codeAmount=0,dataAmount=0;
   GElf_Shdr shdr;
   char* sectionsToMapIn[]={".text.new",".rodata.new",".data.new",".rela.text.new",NULL};
   for(int i=0;sectionsToMapIn[i];i++)
   {
     getShdr(getSectionByName(patch,sectionsToMapIn[i]),&shdr);
-    amount+=shdr.sh_size;
+    //room to put it on a page of its own, if it can be mapped from the
+    //patch file
+    word_t size=shdr.sh_size+2*pageSize;
+    if(shdr.sh_flags & SHF_EXECINSTR)
+    {
+      codeAmount+=size;
+    }
+    else
+    {
+      dataAmount+=size;
+    }
   }
   //include their sizes so we can use ALTPLT/EXTPLT technique from ERESI/Elfsh
   getShdrByERS(targetBin,ERS_GOT,&shdr);
-  amount+=shdr.sh_size;
+  dataAmount+=shdr.sh_size+shdr.sh_addralign;
   getShdrByERS(targetBin,ERS_PLT,&shdr);
-  amount+=shdr.sh_size;
+  codeAmount+=shdr.sh_size+shdr.sh_addralign;
   getShdrByERS(targetBin,ERS_GOTPLT,&shdr);
-  amount+=shdr.sh_size;
-
-  #ifdef KATANA_X86_64_ARCH
-  addr_t desiredAddress=0;
-
-  //we need to request a memory address near the beginning
-  //of the binary to accomodate small code model
-  //TODO: make sure this is scalable, that I've taken
-  //all possibilities into account
+  dataAmount+=shdr.sh_size+shdr.sh_addralign;
+  codeAmount=(max((codeAmount+pageSize-1)/pageSize*pageSize,pageSize));
+  dataAmount=(max((dataAmount+pageSize-1)/pageSize*pageSize,pageSize));
+  uint amount=codeAmount+dataAmount;
+
+  //we need an address for the new memory now, as everything we
+  //write refers to it. It goes in the free space closest to the end of
+  //the binary, where rel32 references to and from the binary can
+  //reach it. With the small code model it has to be in the lower 32
+  //bits of the address space. Whether it's still free is checked when
+  //the plan is committed
   MappedRegion* regions=0;
   int numRegions=getMemoryMap(pid,&regions);
-  if(numRegions>=2)
+  if(numRegions<1)
   {
-    desiredAddress=(regions[1].high+1+sizeof(word_t));
-    uint misalignment=desiredAddress%sizeof(word_t);
-    desiredAddress-=misalignment;
+    death("Could not read the memory map of the target\n");
   }
-  #endif
-
+  //the binary is every region mapped from the same file as its text
+  int binaryRegion=findMappedRegion(regions,numRegions,targetBin->textStart[IN_MEM]);
+  if(binaryRegion<0)
+  {
+    death("The text of the target is not mapped where we expected, at 0x%x\n",targetBin->textStart[IN_MEM]);
+  }
+  while(binaryRegion+1<numRegions &&
+        !strcmp(regions[binaryRegion+1].name,regions[binaryRegion].name))
+  {
+    binaryRegion++;
+  }
+  addr_t binaryEnd=regions[binaryRegion].high;
+  addr_t lowest=TARGET_MIN_MAP_ADDRESS;
+  addr_t highest=(addr_t)-1;
   #ifdef KATANA_X86_64_ARCH
-  addr_t receivedAddres=reserveFreeSpaceInTarget(amount,desiredAddress);
-  if(receivedAddres > 0xFFFFFFFF && patchedBin->textUsesSmallCodeModel)
+  if(patchedBin->textUsesSmallCodeModel)
+  {
+    highest=0x100000000ULL;
+  }
+  else
   {
-    //todo: if at first we don't succeed, try again
-    death("Needed to put new memory pages in the lower 32 bits of the address space and was unable to accomplish this");
+    lowest=(max(lowest,binaryEnd>REL32_REACH?binaryEnd-REL32_REACH:0));
+    highest=binaryEnd+REL32_REACH;
   }
   #endif
-    
+  addr_t desiredAddress=findFreeRange(regions,numRegions,amount,lowest,highest,binaryEnd);
+  plan->targetBase=findExecutableBase(pid,regions,numRegions);
+  if(!desiredAddress)
+  {
+    death("Could not find 0x%x bytes of free space in the target between 0x%zx and 0x%zx\n",
+          amount,lowest,highest);
+  }
+  logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Placing the patch at 0x%zx\n",desiredAddress);
+
+  //anything more the patch turns out to need (relocated variables, say)
+  //goes in the free space nearest it, within the same bounds
+  beginPlanningFreeSpace(regions,numRegions,lowest,highest);
+  reserveFreeSpaceInTarget(ETA_CODE,codeAmount,desiredAddress);
+  reserveFreeSpaceInTarget(ETA_DATA,dataAmount,0);
+  //all the writes we work out are kept for when the target is stopped
+  beginTargetWriteBatch();
 
   //map in the entirety of .text.new
   patchTextAddr=copyInEntireSection(patch,".text.new",NULL);
@@ -889,8 +979,8 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
   
   writeOutPatchedBin(false);
 
-  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"======Applying patches=======\n");
-  for(List* cuLi=diPatch->compilationUnits;cuLi;cuLi=cuLi->next)
+  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"======Planning patches=======\n");
+  for(List* cuLi=plan->diPatch->compilationUnits;cuLi;cuLi=cuLi->next)
   {
     CompilationUnit* cu=cuLi->value;
     printf("reading patch compilation unit %s\n",cu->name);
@@ -899,7 +989,7 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
     VarInfo** vars=(VarInfo**) dictValues(cu->tv->globalVars);
     for(int i=0;vars[i];i++)
     {
-      applyVariablePatch(vars[i],fdeMap,patch);
+      applyVariablePatch(vars[i],plan->fdeMap,patch);
     }
     free(vars);
 
@@ -912,8 +1002,6 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
     free(subprograms);
   }
 
-
-  mapDelete(fdeMap,NULL,free);
   logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"======Fixup Patch Relocations=======\n");
   fixupPatchRelocations(patch);
   logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"====================================\n");
@@ -921,7 +1009,7 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
 
   writeOutPatchedBin(false);
 
-  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"======Performing Patch Relocations=======\n");
+  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"======Planning Patch Relocations=======\n");
     
   //now perform relocations to our functions to give them a chance
   //of working
@@ -947,10 +1035,111 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
     applyRelocation(&reloc,IN_MEM);//todo: on disk as well
   }
 
-  writeOutPatchedBin(true);
+  plan->unsafeFunctions=getUnsafeFunctionsInTarget(targetBin,patch,
+                                                   &plan->numUnsafeFunctions);
+  plan->unsafeFunctionSet=createUnsafeFunctionSet(plan->unsafeFunctions,
+                                                  plan->numUnsafeFunctions);
+  plan->writes=suspendTargetWriteBatch();
+  plan->numRegions=endPlanningFreeSpace(&plan->regions);
+  logTargetSpaceStats();
+  plan->patchTextAddr=patchTextAddr;
+  plan->patchRodataAddr=patchRodataAddr;
+  plan->patchDataAddr=patchDataAddr;
+  plan->patchRelTextAddr=patchRelTextAddr;
+  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"Prepared patch: %i regions to map, %i writes staged, %i trampolines, %i variables to transform\n",plan->numRegions,plan->writes->numWrites,plan->numTrampolines,listLength(plan->varsToTransform));
+  PatchPlan* result=plan;
+  plan=NULL;
+  return result;
+}
+
+void commitPatch(PatchPlan* plan_)
+{
+  plan=plan_;
+  targetBin=plan->targetBin;
+  patchedBin=plan->patchedBin;
+  patchTextAddr=plan->patchTextAddr;
+  patchRodataAddr=plan->patchRodataAddr;
+  patchDataAddr=plan->patchDataAddr;
+  patchRelTextAddr=plan->patchRelTextAddr;
+  int pid=plan->pid;
+  ElfInfo* patch=plan->patch;
+
+  startPtrace(pid);
+
+  //make sure the few things we read from the running target still hold
+  addr_t linkMapAddr=locateLinkMap(targetBin);
+  if(linkMapAddr!=plan->linkMapAddr)
+  {
+    logprintf(ELL_WARN,ELS_PATCHAPPLY,"Link map moved from 0x%zx to 0x%zx since the patch was prepared, looking up malloc again\n",plan->linkMapAddr,linkMapAddr);
+    endLinkMap();
+    plan->linkMapAddr=linkMapAddr;
+    plan->mallocAddr=locateRuntimeSymbolInTarget(targetBin,"malloc");
+  }
+  setMallocAddress(plan->mallocAddr);
+  setTargetTextStart(targetBin->textStart[IN_MEM]);
+
+  bringTargetToSafeState(targetBin,plan->unsafeFunctionSet,pid);
+  endUnwind();
+
+  //nothing has been written yet, so if the space we planned on has
+  //been taken we can still back out cleanly
+  if(!plannedRegionsStillFree(pid,plan->regions,plan->numRegions))
+  {
+    endPtrace(false);
+    death("Memory planned for the patch is no longer free, aborting before modifying the target\n");
+  }
+  mapPlannedRegions(plan->regions,plan->numRegions,plan->writes);
+  //started after the planned regions are in place, so that it can't
+  //take their space
+  if(startTargetAgent(targetBin,plan->mallocAddr))
+  {
+    //only worth having when the agent can copy out of it
+    openTargetChannel(TARGET_CHANNEL_SIZE);
+  }
+  endLinkMap();
+
+  resumeTargetWriteBatch(plan->writes);
+  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"======Transforming variables=======\n");
+  beginTransformationBatch();
+  for(List* li=plan->varsToTransform;li;li=li->next)
+  {
+    transformVarData(li->value,plan->fdeMap,patch);
+  }
+  endTransformationBatch();
+  for(int i=0;i<plan->numTrampolines;i++)
+  {
+    insertTrampolineJump(plan->trampolines[i].insertAt,plan->trampolines[i].jumpTo);
+  }
+  commitTargetWriteBatch();
+  plan->writes=NULL;
+  closeTargetChannel();
+  endTargetAgent();
+
+  if(patchedBin)
+  {
+    writeOutPatchedBin(true);
+    endELF(patchedBin);
+  }
+  else
+  {
+    logprintf(ELL_WARN,ELS_PATCHAPPLY,"No record of the patched binary is kept when applying a plan file, it will not be possible to apply a further patch to this process\n");
+  }
   endELF(targetBin);
-  endELF(patchedBin);
   cleanupDwarfVM();
   endPtrace(isFlag(EKCF_P_STOP_TARGET));
+
+  mapDelete(plan->fdeMap,NULL,free);
+  deleteList(plan->varsToTransform,NULL);
+  freePlannedRegions(plan->regions,plan->numRegions);
+  free(plan->trampolines);
+  free(plan->unsafeFunctions);
+  deleteUnsafeFunctionSet(plan->unsafeFunctionSet);
+  free(plan);
+  plan=NULL;
   printf("hooray! completed application of patch successfully\n");
 }
+
+void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
+{
+  commitPatch(preparePatch(pid,targetBin_,patch));
+}
@@ -55,7 +55,70 @@
 
 #ifndef patchapply_h
 #define patchapply_h
+#include "elfparse.h"
+#include "hotpatch.h"
+#include "target.h"
+#include "safety.h"
 
+//a jump from the start of an old function to its replacement
+typedef struct
+{
+  addr_t insertAt;
+  addr_t jumpTo;
+} Trampoline;
+
+//everything needed to apply a patch, worked out ahead of time so
+//that the target only needs to be stopped while it's applied
+typedef struct
+{
+  int pid;
+  ElfInfo* targetBin;
+  ElfInfo* patch;
+  ElfInfo* patchedBin;//NULL if the plan was read from a plan file
+  DwarfInfo* diPatch;
+  Map* fdeMap;//maps fde offsets to FDE structures for the patch
+  //volatile inputs. These were read from the running target and
+  //are checked again once it has been stopped
+  addr_t linkMapAddr;
+  addr_t mallocAddr;
+  //where the target binary is mapped. Most of what the plan holds
+  //is absolute addresses which only hold for this layout
+  addr_t targetBase;
+  //memory the patch will live in, not yet mapped in the target
+  PlannedRegion* regions;
+  int numRegions;
+  //every write to the target with a value known ahead of time
+  WriteBuffer* writes;
+  //written last, so that nothing can reach the new code before
+  //everything it depends on is in place
+  Trampoline* trampolines;
+  int numTrampolines;
+  //variables (VarInfo*) whose data can only be transformed once the
+  //target is stopped
+  List* varsToTransform;
+  List* varsToTransformEnd;
+  //symbol indices in targetBin of functions which may not be on the
+  //stack while the patch is applied
+  idx_t* unsafeFunctions;
+  int numUnsafeFunctions;
+  //the same functions, built once for the safety checks
+  UnsafeFunctionSet* unsafeFunctionSet;
+  addr_t patchTextAddr;
+  addr_t patchRodataAddr;
+  addr_t patchDataAddr;
+  addr_t patchRelTextAddr;
+} PatchPlan;
+
+//do all of the work of applying a patch that can be done
+//without stopping the target
+PatchPlan* preparePatch(int pid,ElfInfo* targetBin,ElfInfo* patch);
+//stop the target, check that the plan still holds, and apply it. The
+//plan is freed
+void commitPatch(PatchPlan* plan);
+
+void insertTrampolineJump(addr_t insertAt,addr_t jumpTo);
+
+//preparePatch followed by commitPatch
 void readAndApplyPatch(int pid,ElfInfo* targetBin,ElfInfo* patch);
 
 #endif
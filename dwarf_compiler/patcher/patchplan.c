@@ -0,0 +1,572 @@
+/*
+  File: patchplan.c
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Reading and writing patch plans so that a patch can be prepared once and
+               applied to many processes running the same binary
+*/
+
+#include "patchplan.h"
+#include "elfutil.h"
+#include "symbol.h"
+#include "fderead.h"
+#include "dwarfvm.h"
+#include "dwarf_instr.h"
+#include "pmap.h"
+#include <sys/stat.h>
+#include "util/logging.h"
+
+//Layout of a plan file. Every number is a word_t in the byte order of
+//the machine that wrote it, plans are only meaningful on the machine
+//(or at least the architecture) they were made for anyway.
+//  magic (8 bytes), version, word size, build-id length, build-id
+//  base address of the target binary
+//  link map address, malloc address
+//  text, rodata, data, and rela.text addresses of the patch
+//  regions: count, then {addr,size,prot,file name,file offset}
+//  writes: count, then {addr,len,data}
+//  trampolines: count, then {insertAt,jumpTo}
+//  unsafe functions: count, then symbol indices in the target
+//  CIEs: count, then {dataAlign,codeAlign,returnAddrRuleNum,
+//                     addressSize,version,initial instructions}
+//  FDEs: count, then {cie index,offset,memSize,lowpc,highpc,idx,instructions}
+//  variables to transform: count, then {name,oldLocation,newLocation,fde}
+//  moved objects: count, then {symbol index in the target,newLocation}
+//instructions and names are written as a length followed by the bytes.
+//Counts and lengths are checked against what's left of the file before
+//anything is allocated for them
+
+//where each data object in the target ends up after patching, by its
+//symbol index in the target (0 if the patch doesn't contain the
+//object). Used in place of the patch's symbol table when fixing up
+//pointers to variables while applying a plan file
+static ElfInfo* movedObjectsBin=NULL;
+static addr_t* movedObjectLocations=NULL;
+
+static size_t planFileSize=0;
+
+static void writePlanBytes(FILE* file,void* data,size_t len)
+{
+  if(len && 1!=fwrite(data,len,1,file))
+  {
+    death("Failed to write to patch plan file\n");
+  }
+}
+
+static void writePlanWord(FILE* file,word_t value)
+{
+  writePlanBytes(file,&value,sizeof(word_t));
+}
+
+static void writePlanBlock(FILE* file,void* data,size_t len)
+{
+  writePlanWord(file,len);
+  writePlanBytes(file,data,len);
+}
+
+static void writePlanInstructions(FILE* file,RegInstruction* instrs,int numInstrs)
+{
+  DwarfInstructions raw=serializeDwarfRegInstructions(instrs,numInstrs);
+  writePlanBlock(file,raw.instrs,raw.numBytes);
+  destroyRawInstructions(raw);
+}
+
+static void readPlanBytes(FILE* file,void* data,size_t len)
+{
+  if(len && 1!=fread(data,len,1,file))
+  {
+    death("Patch plan file is truncated or unreadable\n");
+  }
+}
+
+static word_t readPlanWord(FILE* file)
+{
+  word_t value;
+  readPlanBytes(file,&value,sizeof(word_t));
+  return value;
+}
+
+static size_t planBytesLeft(FILE* file)
+{
+  long pos=ftell(file);
+  return (pos<0 || (size_t)pos>planFileSize)?0:planFileSize-pos;
+}
+
+//a count of things each taking at least entrySize bytes of the file
+static word_t readPlanCount(FILE* file,size_t entrySize)
+{
+  word_t count=readPlanWord(file);
+  if(count>planBytesLeft(file)/entrySize)
+  {
+    death("Patch plan file is corrupt, it claims %zu entries but is too short to hold them\n",count);
+  }
+  return count;
+}
+
+//the returned memory should be freed. It is always null-terminated
+static byte* readPlanBlock(FILE* file,size_t* lenOut)
+{
+  size_t len=readPlanWord(file);
+  if(len>planBytesLeft(file))
+  {
+    death("Patch plan file is corrupt, it claims a %zu byte block but is too short to hold it\n",len);
+  }
+  byte* data=zmalloc(len+1);
+  readPlanBytes(file,data,len);
+  if(lenOut)
+  {
+    *lenOut=len;
+  }
+  return data;
+}
+
+static RegInstruction* readPlanInstructions(FILE* file,int* numInstrs)
+{
+  size_t len;
+  byte* bytes=readPlanBlock(file,&len);
+  RegInstruction* instrs=parseFDEInstructions(NULL,bytes,len,numInstrs);
+  free(bytes);
+  return instrs;
+}
+
+//work out where every data object in the target will live once the
+//patch is applied, the same way the DWARF VM would when it has the
+//patch in hand
+static void writeMovedObjects(FILE* file,PatchPlan* plan)
+{
+  ElfInfo* targetBin=plan->targetBin;
+  ElfInfo* patch=plan->patch;
+  if(!hasERS(targetBin,ERS_SYMTAB))
+  {
+    writePlanWord(file,0);
+    return;
+  }
+  Elf_Data* symTabData=getDataByERS(targetBin,ERS_SYMTAB);
+  int patchDataScnIdx=elf_ndxscn(getSectionByERS(patch,ERS_DATA));
+  int count=0;
+  idx_t* symIdxs=zmalloc(sizeof(idx_t)*(max(targetBin->symTabCount,1)));
+  addr_t* newLocations=zmalloc(sizeof(addr_t)*(max(targetBin->symTabCount,1)));
+  for(int i=1;i<targetBin->symTabCount;i++)
+  {
+    GElf_Sym sym;
+    if(!gelf_getsym(symTabData,i,&sym))
+    {
+      death("gelf_getsym failed\n");
+    }
+    if(ELFXX_ST_TYPE(sym.st_info)!=STT_OBJECT)
+    {
+      continue;
+    }
+    symIdxs[count]=i;
+    idx_t symIdxPatch=reindexSymbol(targetBin,patch,i,ESFF_FUZZY_MATCHING_OK|ESFF_BSS_MATCH_DATA_OK);
+    if(STN_UNDEF!=symIdxPatch)
+    {
+      GElf_Sym patchSym;
+      getSymbol(patch,symIdxPatch,&patchSym);
+      if(patchSym.st_shndx==patchDataScnIdx)
+      {
+        newLocations[count]=plan->patchDataAddr+patchSym.st_value;
+      }
+    }
+    count++;
+  }
+  writePlanWord(file,count);
+  for(int i=0;i<count;i++)
+  {
+    writePlanWord(file,symIdxs[i]);
+    writePlanWord(file,newLocations[i]);
+  }
+  free(symIdxs);
+  free(newLocations);
+}
+
+void writePatchPlan(PatchPlan* plan,char* fname)
+{
+  byte* buildId;
+  int buildIdLen=getBuildId(plan->targetBin,&buildId);
+  if(!buildIdLen)
+  {
+    death("Target binary has no build-id, cannot write a plan file for it\n");
+  }
+  FILE* file=fopen(fname,"wb");
+  if(!file)
+  {
+    death("Could not open %s to write the patch plan\n",fname);
+  }
+  char magic[8]=PATCH_PLAN_MAGIC;
+  writePlanBytes(file,magic,sizeof(magic));
+  writePlanWord(file,PATCH_PLAN_VERSION);
+  writePlanWord(file,sizeof(word_t));
+  writePlanBlock(file,buildId,buildIdLen);
+  writePlanWord(file,plan->targetBase);
+
+  writePlanWord(file,plan->linkMapAddr);
+  writePlanWord(file,plan->mallocAddr);
+  writePlanWord(file,plan->patchTextAddr);
+  writePlanWord(file,plan->patchRodataAddr);
+  writePlanWord(file,plan->patchDataAddr);
+  writePlanWord(file,plan->patchRelTextAddr);
+
+  writePlanWord(file,plan->numRegions);
+  for(int i=0;i<plan->numRegions;i++)
+  {
+    writePlanWord(file,plan->regions[i].addr);
+    writePlanWord(file,plan->regions[i].size);
+    writePlanWord(file,plan->regions[i].prot);
+    char* fileName=plan->regions[i].fileName;
+    writePlanBlock(file,fileName,fileName?strlen(fileName):0);
+    writePlanWord(file,plan->regions[i].fileOffset);
+  }
+
+  //the buffer has already merged the small writes together
+  writePlanWord(file,plan->writes->numWrites);
+  for(int i=0;i<plan->writes->numWrites;i++)
+  {
+    PendingWrite* w=&plan->writes->writes[i];
+    writePlanWord(file,w->addr);
+    writePlanBlock(file,w->data,w->len);
+  }
+
+  writePlanWord(file,plan->numTrampolines);
+  for(int i=0;i<plan->numTrampolines;i++)
+  {
+    writePlanWord(file,plan->trampolines[i].insertAt);
+    writePlanWord(file,plan->trampolines[i].jumpTo);
+  }
+
+  writePlanWord(file,plan->numUnsafeFunctions);
+  for(int i=0;i<plan->numUnsafeFunctions;i++)
+  {
+    writePlanWord(file,plan->unsafeFunctions[i]);
+  }
+
+  //the variable transformers. The whole table is kept because FDEs
+  //refer to each other by index when fixing up pointers
+  CallFrameInfo* cfi=&plan->patch->callFrameInfo;
+  writePlanWord(file,cfi->numCIEs);
+  for(int i=0;i<cfi->numCIEs;i++)
+  {
+    CIE* cie=&cfi->cies[i];
+    writePlanWord(file,cie->dataAlign);
+    writePlanWord(file,cie->codeAlign);
+    writePlanWord(file,cie->returnAddrRuleNum);
+    writePlanWord(file,cie->addressSize);
+    writePlanWord(file,cie->version);
+    writePlanInstructions(file,cie->initialInstructions,cie->numInitialInstructions);
+  }
+  writePlanWord(file,cfi->numFDEs);
+  for(int i=0;i<cfi->numFDEs;i++)
+  {
+    FDE* fde=&cfi->fdes[i];
+    writePlanWord(file,fde->cie-cfi->cies);
+    writePlanWord(file,fde->offset);
+    writePlanWord(file,fde->memSize);
+    writePlanWord(file,fde->lowpc);
+    writePlanWord(file,fde->highpc);
+    writePlanWord(file,fde->idx);
+    writePlanInstructions(file,fde->instructions,fde->numInstructions);
+  }
+
+  writePlanWord(file,listLength(plan->varsToTransform));
+  for(List* li=plan->varsToTransform;li;li=li->next)
+  {
+    VarInfo* var=li->value;
+    writePlanBlock(file,var->name,strlen(var->name));
+    writePlanWord(file,var->oldLocation);
+    writePlanWord(file,var->newLocation);
+    writePlanWord(file,var->type->fde);
+  }
+
+  writeMovedObjects(file,plan);
+  fclose(file);
+  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"Wrote patch plan to %s\n",fname);
+}
+
+PatchPlan* readPatchPlan(char* fname,ElfInfo* targetBin)
+{
+  FILE* file=fopen(fname,"rb");
+  if(!file)
+  {
+    death("Could not open patch plan %s\n",fname);
+  }
+  struct stat st;
+  if(fstat(fileno(file),&st))
+  {
+    death("Could not stat patch plan %s\n",fname);
+  }
+  planFileSize=st.st_size;
+  char magic[8];
+  readPlanBytes(file,magic,sizeof(magic));
+  if(memcmp(magic,PATCH_PLAN_MAGIC,sizeof(magic)))
+  {
+    death("%s is not a patch plan\n",fname);
+  }
+  word_t version=readPlanWord(file);
+  if(PATCH_PLAN_VERSION!=version)
+  {
+    death("Patch plan %s has version %zu, only version %i is supported\n",fname,version,PATCH_PLAN_VERSION);
+  }
+  if(sizeof(word_t)!=readPlanWord(file))
+  {
+    death("Patch plan %s was made for a different architecture\n",fname);
+  }
+  byte* targetBuildId;
+  int targetBuildIdLen=getBuildId(targetBin,&targetBuildId);
+  size_t buildIdLen;
+  byte* buildId=readPlanBlock(file,&buildIdLen);
+  if(buildIdLen!=targetBuildIdLen || memcmp(buildId,targetBuildId,buildIdLen))
+  {
+    death("Patch plan %s was not made for this target binary (build-id does not match)\n",fname);
+  }
+  free(buildId);
+
+  PatchPlan* plan=zmalloc(sizeof(PatchPlan));
+  plan->targetBin=targetBin;
+  plan->targetBase=readPlanWord(file);
+  plan->linkMapAddr=readPlanWord(file);
+  plan->mallocAddr=readPlanWord(file);
+  plan->patchTextAddr=readPlanWord(file);
+  plan->patchRodataAddr=readPlanWord(file);
+  plan->patchDataAddr=readPlanWord(file);
+  plan->patchRelTextAddr=readPlanWord(file);
+
+  plan->numRegions=readPlanCount(file,5*sizeof(word_t));
+  plan->regions=zmalloc(sizeof(PlannedRegion)*(max(plan->numRegions,1)));
+  for(int i=0;i<plan->numRegions;i++)
+  {
+    plan->regions[i].addr=readPlanWord(file);
+    plan->regions[i].size=readPlanWord(file);
+    plan->regions[i].prot=readPlanWord(file);
+    size_t fileNameLen;
+    plan->regions[i].fileName=(char*)readPlanBlock(file,&fileNameLen);
+    if(!fileNameLen)
+    {
+      free(plan->regions[i].fileName);
+      plan->regions[i].fileName=NULL;
+    }
+    plan->regions[i].fileOffset=readPlanWord(file);
+  }
+
+  plan->writes=writeBufferCreate();
+  int numWrites=readPlanCount(file,2*sizeof(word_t));
+  for(int i=0;i<numWrites;i++)
+  {
+    addr_t addr=readPlanWord(file);
+    size_t len;
+    byte* data=readPlanBlock(file,&len);
+    writeBufferAdd(plan->writes,addr,data,len);
+    free(data);
+  }
+
+  plan->numTrampolines=readPlanCount(file,2*sizeof(word_t));
+  plan->trampolines=zmalloc(sizeof(Trampoline)*(max(plan->numTrampolines,1)));
+  for(int i=0;i<plan->numTrampolines;i++)
+  {
+    plan->trampolines[i].insertAt=readPlanWord(file);
+    plan->trampolines[i].jumpTo=readPlanWord(file);
+  }
+
+  plan->numUnsafeFunctions=readPlanCount(file,sizeof(word_t));
+  plan->unsafeFunctions=zmalloc(sizeof(idx_t)*(max(plan->numUnsafeFunctions,1)));
+  for(int i=0;i<plan->numUnsafeFunctions;i++)
+  {
+    plan->unsafeFunctions[i]=readPlanWord(file);
+  }
+  plan->unsafeFunctionSet=createUnsafeFunctionSet(plan->unsafeFunctions,
+                                                  plan->numUnsafeFunctions);
+
+  //stand-in for the patch object, holding only its frame info
+  ElfInfo* patch=zmalloc(sizeof(ElfInfo));
+  patch->isPO=true;
+  CallFrameInfo* cfi=&patch->callFrameInfo;
+  cfi->numCIEs=readPlanCount(file,6*sizeof(word_t));
+  cfi->cies=zmalloc(sizeof(CIE)*(max(cfi->numCIEs,1)));
+  for(int i=0;i<cfi->numCIEs;i++)
+  {
+    CIE* cie=&cfi->cies[i];
+    cie->idx=i;
+    cie->dataAlign=(Dwarf_Signed)readPlanWord(file);
+    cie->codeAlign=readPlanWord(file);
+    cie->returnAddrRuleNum=readPlanWord(file);
+    cie->addressSize=readPlanWord(file);
+    cie->version=readPlanWord(file);
+    cie->initialInstructions=readPlanInstructions(file,&cie->numInitialInstructions);
+    cie->initialRules=ruleSetCreate();
+    evaluateInstructionsToRules(cie,cie->initialInstructions,
+                                cie->numInitialInstructions,
+                                cie->initialRules,0,-1,NULL);
+  }
+  cfi->numFDEs=readPlanCount(file,7*sizeof(word_t));
+  cfi->fdes=zmalloc(sizeof(FDE)*(max(cfi->numFDEs,1)));
+  plan->fdeMap=integerMapCreate(100);//todo: get rid of arbitrary constant 100
+  for(int i=0;i<cfi->numFDEs;i++)
+  {
+    FDE* fde=&cfi->fdes[i];
+    word_t cieIdx=readPlanWord(file);
+    if(cieIdx>=cfi->numCIEs)
+    {
+      death("Patch plan %s refers to a nonexistent CIE\n",fname);
+    }
+    fde->cie=&cfi->cies[cieIdx];
+    fde->offset=readPlanWord(file);
+    fde->memSize=readPlanWord(file);
+    fde->lowpc=readPlanWord(file);
+    fde->highpc=readPlanWord(file);
+    fde->idx=readPlanWord(file);
+    fde->instructions=readPlanInstructions(file,&fde->numInstructions);
+    int* key=zmalloc(sizeof(int));
+    *key=fde->offset;
+    mapInsert(plan->fdeMap,key,fde);
+  }
+  plan->patch=patch;
+
+  int numVars=readPlanCount(file,4*sizeof(word_t));
+  for(int i=0;i<numVars;i++)
+  {
+    VarInfo* var=zmalloc(sizeof(VarInfo));
+    var->name=(char*)readPlanBlock(file,NULL);
+    var->oldLocation=readPlanWord(file);
+    var->newLocation=readPlanWord(file);
+    var->type=zmalloc(sizeof(TypeInfo));
+    var->type->fde=readPlanWord(file);
+    List* li=zmalloc(sizeof(List));
+    li->value=var;
+    plan->varsToTransform=concatLists(plan->varsToTransform,plan->varsToTransformEnd,li,li,&plan->varsToTransformEnd);
+  }
+
+  int numMovedObjects=readPlanCount(file,2*sizeof(word_t));
+  free(movedObjectLocations);
+  movedObjectsBin=targetBin;
+  movedObjectLocations=zmalloc(sizeof(addr_t)*(max(targetBin->symTabCount,1)));
+  for(int i=0;i<numMovedObjects;i++)
+  {
+    word_t symIdx=readPlanWord(file);
+    if(symIdx>=targetBin->symTabCount)
+    {
+      death("Patch plan %s refers to a nonexistent symbol\n",fname);
+    }
+    movedObjectLocations[symIdx]=readPlanWord(file);
+  }
+  fclose(file);
+  return plan;
+}
+
+//MovedObjectLookup for the DWARF VM, standing in for the patch's symbol table
+static bool lookupMovedObject(addr_t oldAddr,addr_t* newLocation)
+{
+  //the same binary the plan was made from, so the same symbol the
+  //DWARF VM would have found
+  idx_t symIdx=findSymbolContainingAddress(movedObjectsBin,oldAddr,STT_OBJECT,SHN_UNDEF);
+  if(STN_UNDEF==symIdx)
+  {
+    return false;
+  }
+  if(!movedObjectLocations[symIdx])
+  {
+    death("need to fix up a pointer that is supposedly part of a variable (rather than arbitrary stuff on the heap) but the patch doesn't seem to contain this variable\n");
+  }
+  *newLocation=movedObjectLocations[symIdx];
+  return true;
+}
+
+void applyPatchPlanFile(int pid,ElfInfo* targetBin,char* fname)
+{
+  PatchPlan* plan=readPatchPlan(fname,targetBin);
+  plan->pid=pid;
+  //everything in the plan is an absolute address, so it can only be
+  //replayed on a process laid out the same way
+  MappedRegion* regions=NULL;
+  int numRegions=getMemoryMap(pid,&regions);
+  addr_t targetBase=numRegions>0?findExecutableBase(pid,regions,numRegions):0;
+  free(regions);
+  if(!targetBase || targetBase!=plan->targetBase)
+  {
+    death("Patch plan %s was made for a process with the target binary mapped at 0x%zx, but in process %i it is mapped at 0x%zx. Prepare a new plan for this process\n",
+          fname,plan->targetBase,pid,targetBase);
+  }
+  ElfInfo* patch=plan->patch;
+  //commitPatch frees the list but not the variables themselves
+  int numVars=listLength(plan->varsToTransform);
+  VarInfo** vars=zmalloc(sizeof(VarInfo*)*(max(numVars,1)));
+  int i=0;
+  for(List* li=plan->varsToTransform;li;li=li->next,i++)
+  {
+    vars[i]=li->value;
+  }
+
+  setMovedObjectLookup(lookupMovedObject);
+  commitPatch(plan);
+  setMovedObjectLookup(NULL);
+
+  for(i=0;i<numVars;i++)
+  {
+    free(vars[i]->name);
+    free(vars[i]->type);
+    free(vars[i]);
+  }
+  free(vars);
+  for(int i=0;i<patch->callFrameInfo.numCIEs;i++)
+  {
+    free(patch->callFrameInfo.cies[i].initialInstructions);
+    ruleSetDelete(patch->callFrameInfo.cies[i].initialRules);
+  }
+  for(int i=0;i<patch->callFrameInfo.numFDEs;i++)
+  {
+    free(patch->callFrameInfo.fdes[i].instructions);
+    freeCFITable(patch->callFrameInfo.fdes[i].rowTable);
+  }
+  free(patch->callFrameInfo.cies);
+  free(patch->callFrameInfo.fdes);
+  free(patch);
+  free(movedObjectLocations);
+  movedObjectLocations=NULL;
+  movedObjectsBin=NULL;
+}
@@ -59,7 +59,11 @@
 */
 
 #include "pmap.h"
-#include <util/logging.h>
+#include "../util/logging.h"
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
 
 
 
@@ -79,26 +83,136 @@ int getMemoryMap(int pid,MappedRegion** regions)
   }
   char linebuf[PATH_MAX+512];
   int numRegions=0;
+  int allocatedRegions=0;
   *regions=NULL;
   while(fgets(linebuf,PATH_MAX+512,f))
   {
-    linebuf[strlen(linebuf)-1]='\0';//strip the trailing newline
-    numRegions++;
-    *regions=realloc(*regions,sizeof(MappedRegion)*numRegions);
-    assert(*regions);
-    memset(&(*regions)[numRegions-1],0,sizeof(MappedRegion));
-    sscanf(linebuf,"%zx-%zx",&(*regions)[numRegions-1].low,&(*regions)[numRegions-1].high);
+    linebuf[strcspn(linebuf,"\n")]='\0';//strip the trailing newline
+    if(numRegions>=allocatedRegions)
+    {
+      allocatedRegions=(max(allocatedRegions*2,64));
+      *regions=realloc(*regions,sizeof(MappedRegion)*allocatedRegions);
+      MALLOC_CHECK(*regions);
+    }
+    MappedRegion* region=&(*regions)[numRegions++];
+    memset(region,0,sizeof(MappedRegion));
+    //lines look like
+    //low-high perms offset major:minor inode   path
+    char perms[5]={0};
+    unsigned int major=0,minor=0;
+    unsigned long inode=0;
+    sscanf(linebuf,"%zx-%zx %4s %zx %x:%x %lu",&region->low,&region->high,perms,
+           &region->offset,&major,&minor,&inode);
+    region->device=makedev(major,minor);
+    region->inode=inode;
+    region->prot=('r'==perms[0]?PROT_READ:0) | ('w'==perms[1]?PROT_WRITE:0) |
+      ('x'==perms[2]?PROT_EXEC:0);
+    region->shared=('s'==perms[3]);
     char* path=strchr(linebuf,'/');
     if(path)
     {
-      strncpy((*regions)[numRegions-1].name,path,PATH_MAX-1);
+      strncpy(region->name,path,PATH_MAX-1);
     }
     else
     {
       char* name="(no corresponding file)";
-      strcpy((*regions)[numRegions-1].name,name);
+      strcpy(region->name,name);
     }
   }
   fclose(f);
   return numRegions;
 }
+
+int findMappedRegionAfter(MappedRegion* regions,int numRegions,addr_t addr)
+{
+  //the kernel lists regions in address order, so we can binary search
+  int low=0;
+  int high=numRegions;
+  while(low<high)
+  {
+    int mid=low+(high-low)/2;
+    if(regions[mid].high<=addr)
+    {
+      low=mid+1;
+    }
+    else
+    {
+      high=mid;
+    }
+  }
+  return low;
+}
+
+int findMappedRegion(MappedRegion* regions,int numRegions,addr_t addr)
+{
+  int idx=findMappedRegionAfter(regions,numRegions,addr);
+  if(idx<numRegions && regions[idx].low<=addr)
+  {
+    return idx;
+  }
+  return -1;
+}
+
+addr_t findExecutableBase(int pid,MappedRegion* regions,int numRegions)
+{
+  char buf[64];
+  snprintf(buf,64,"/proc/%i/exe",pid);
+  char exe[PATH_MAX];
+  ssize_t len=readlink(buf,exe,PATH_MAX-1);
+  if(len<=0)
+  {
+    logprintf(ELL_WARN,ELS_MISC,"Could not read %s\n",buf);
+    return 0;
+  }
+  exe[len]='\0';
+  //the regions are in address order, so the first is the lowest
+  for(int i=0;i<numRegions;i++)
+  {
+    if(!strcmp(regions[i].name,exe))
+    {
+      return regions[i].low;
+    }
+  }
+  return 0;
+}
+
+addr_t findFreeRange(MappedRegion* regions,int numRegions,word_t size,
+                     addr_t low,addr_t high,addr_t near)
+{
+  addr_t pageSize=sysconf(_SC_PAGE_SIZE);
+  size=(size+pageSize-1) & ~(pageSize-1);
+  low=(low+pageSize-1) & ~(pageSize-1);
+  high&=~(pageSize-1);
+  near&=~(pageSize-1);
+  addr_t best=0;
+  addr_t bestDistance=0;
+  //gap i lies between region i-1 and region i
+  for(int i=0;i<=numRegions;i++)
+  {
+    addr_t gapLow=i?regions[i-1].high:0;
+    addr_t gapHigh=i<numRegions?regions[i].low:high;
+    gapLow=(max(gapLow,low));
+    gapHigh=(min(gapHigh,high));
+    if(gapHigh<=gapLow || gapHigh-gapLow<size)
+    {
+      continue;
+    }
+    //the place in this gap nearest to near
+    addr_t candidate=near;
+    if(candidate<gapLow)
+    {
+      candidate=gapLow;
+    }
+    else if(candidate>gapHigh-size)
+    {
+      candidate=gapHigh-size;
+    }
+    addr_t distance=candidate>near?candidate-near:near-candidate;
+    if(!best || distance<bestDistance)
+    {
+      best=candidate;
+      bestDistance=distance;
+    }
+  }
+  return best;
+}
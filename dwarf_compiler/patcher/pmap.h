@@ -57,8 +57,11 @@
 
 */
 
+#ifndef pmap_h
+#define pmap_h
 #include <limits.h>
-#include <types.h>
+#include <sys/types.h>
+#include "../types.h"
 
 /* PATH_MAX is not defined in limits.h on some platforms */
 #ifndef PATH_MAX
@@ -69,11 +72,33 @@ typedef struct
 {
   addr_t low;
   addr_t high;
+  int prot;//PROT_READ etc
+  bool shared;
+  word_t offset;//into the mapped file
+  dev_t device;//of the mapped file
+  ino_t inode;//0 if no file is mapped
   char name[PATH_MAX];
 } MappedRegion;
 
 //returns the number of mapped regions found
-//these regions are placed in MappedRegion** regions
+//these regions are placed in MappedRegion** regions, sorted by address
 //this memory should be freed when it is no longer needed
 //returns -1 if /proc/pid/maps could not be opened
 int getMemoryMap(int pid,MappedRegion** regions);
+
+//the index of the region containing addr, -1 if it isn't mapped
+int findMappedRegion(MappedRegion* regions,int numRegions,addr_t addr);
+//the index of the first region ending after addr (which may or may not
+//contain it), numRegions if there is none
+int findMappedRegionAfter(MappedRegion* regions,int numRegions,addr_t addr);
+
+//the lowest address at which the executable of process pid is mapped,
+//0 if it can't be found in regions
+addr_t findExecutableBase(int pid,MappedRegion* regions,int numRegions);
+
+//find size bytes of unmapped, page aligned address space lying entirely
+//within [low,high), as close as possible to near. Returns 0 if there
+//is no such space
+addr_t findFreeRange(MappedRegion* regions,int numRegions,word_t size,
+                     addr_t low,addr_t high,addr_t near);
+#endif
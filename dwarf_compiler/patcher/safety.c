@@ -65,38 +65,66 @@
 #include "constants.h"
 #include <unistd.h>
 #include <sys/wait.h>
+#include <time.h>
 #include "safety.h"
+#include "unwind.h"
 #include "katana_config.h"
 #include "elfutil.h"
 
 static const int MAX_WAIT_SECONDS_BEFORE_TRY_CURRENT_FRAME = 2;
 
+//stack sampling before choosing breakpoints, off unless
+//setSafePointSampling is called
+static int numSafePointSamples=0;
+static int safePointSampleWindowMs=0;
+
+typedef struct
+{
+  addr_t pc;
+  int count;
+} SafePointCount;
+
+static struct timespec timespecAfter(struct timespec* start,double seconds)
+{
+  struct timespec result=*start;
+  long wholeSeconds=(long)seconds;
+  result.tv_sec+=wholeSeconds;
+  result.tv_nsec+=(long)((seconds-wholeSeconds)*1e9);
+  if(result.tv_nsec>=1000000000)
+  {
+    result.tv_sec++;
+    result.tv_nsec-=1000000000;
+  }
+  return result;
+}
+
 FDE* getFDEForPC(ElfInfo* elf,addr_t pc)
 {
   assert(elf->callFrameInfo.fdes);
-  //elf->callFrameInfo.fdes are sorted by lowpc, so we can do a binary search
+  //elf->callFrameInfo.fdes are sorted by lowpc, so we can do a binary
+  //search for the last one starting at or before pc
   size_t low=0;
   size_t high=elf->callFrameInfo.numFDEs;
-  while(high-low>0)
+  while(low<high)
   {
-    size_t middle=low+(size_t)floor((float)(high-low)/2.0f);
+    size_t middle=low+(high-low)/2;
     if(elf->callFrameInfo.fdes[middle].lowpc > pc)
     {
-      high=middle-1;
-    }
-    else if(elf->callFrameInfo.fdes[middle].highpc < pc)
-    {
-      low=middle+1;
+      high=middle;
     }
     else
     {
-      //we've found it!
-      return &elf->callFrameInfo.fdes[middle];
+      low=middle+1;
     }
   }
-  if(elf->callFrameInfo.fdes[low].lowpc <= pc && elf->callFrameInfo.fdes[low].highpc >= pc)
+  if(0==low)
+  {
+    return NULL;
+  }
+  FDE* fde=&elf->callFrameInfo.fdes[low-1];
+  if(pc<fde->highpc)
   {
-    return &elf->callFrameInfo.fdes[low];
+    return fde;
   }
   return NULL;
 }
@@ -180,20 +208,20 @@ void setRegValueFromDwarfRegNum(struct user_regs_struct* regs,int num,long int n
     REG_10(*regs)=newValue;
     break;
   case 11:
-    REG_10(*regs)=newValue;
+    REG_11(*regs)=newValue;
     break;
   case 12:
-    REG_10(*regs)=newValue;
+    REG_12(*regs)=newValue;
     break;
   case 13:
-    REG_10(*regs)=newValue;
+    REG_13(*regs)=newValue;
     break;
   case 14:
-    REG_10(*regs)=newValue;
+    REG_14(*regs)=newValue;
     break;
   case 15:
-    REG_10(*regs)=newValue;
-    break;;
+    REG_15(*regs)=newValue;
+    break;
   default:
     //If this is hit, probably more need to be implemented
     fprintf(stderr,"unknown register number %i, cannot set reg val\n",num);
@@ -285,13 +313,13 @@ long int getRegValueFromDwarfRegNum(struct user_regs_struct regs,int num)
 //this function is not actually used at present, as we use libunwind.
 //since this is not actually used, it may not work
 struct user_regs_struct restoreRegsFromRegisterRules(struct user_regs_struct currentRegs,
-                                                     Dictionary* rulesDict)
+                                                     RuleSet* rules)
 {
   struct user_regs_struct regs=currentRegs;
   PoReg cfaReg;
   memset(&cfaReg,0,sizeof(PoReg));
   cfaReg.type=ERT_CFA;
-  PoRegRule* cfaRule=dictGet(rulesDict,strForReg(cfaReg,0));
+  PoRegRule* cfaRule=ruleSetGet(rules,cfaReg);
   if(!cfaRule)
   {
     death("no way to compute cfa\n");
@@ -303,9 +331,11 @@ struct user_regs_struct restoreRegsFromRegisterRules(struct user_regs_struct cur
   for(int i=0;i<=NUM_REGS;i++)
   {
     //printf("restoring reg %i\n",i);
-    char buf[32];
-    sprintf(buf,"r%i",i);
-    PoRegRule* rule=dictGet(rulesDict,buf);
+    PoReg reg;
+    memset(&reg,0,sizeof(PoReg));
+    reg.type=ERT_BASIC;
+    reg.u.index=i;
+    PoRegRule* rule=ruleSetGet(rules,reg);
     if(!rule)
     {
       char* regName=getArchRegNameFromDwarfRegNum(i);
@@ -347,10 +377,10 @@ struct user_regs_struct restoreRegsFromRegisterRules(struct user_regs_struct cur
 unw_addr_space_t unwindAddrSpace;
 void* unwindUPTHandle;
 unw_cursor_t unwindCursor;
-void startLibUnwind(int pid)
+void startLibUnwind(pid_t tid)
 {
   unwindAddrSpace=unw_create_addr_space(&_UPT_accessors,__LITTLE_ENDIAN);
-  unwindUPTHandle=_UPT_create(pid);
+  unwindUPTHandle=_UPT_create(tid);
   if(!unwindUPTHandle)
   {
     death("failed to initialize UPT in libunwind\n");
@@ -376,11 +406,11 @@ typedef struct
 //ordering may be counter-intuitive, but makes sense because if we
 //find a safety conflict in something up the stack, it invalidates
 //everything further down the stack too
-DList* findActivationFrames(ElfInfo* elf,int pid)
+//pid is the target process and tid the (stopped) thread of it whose
+//stack we want
+DList* findActivationFrames(ElfInfo* elf,int pid,pid_t tid)
 {
   DList* activationFramesHead=NULL;
-  startLibUnwind(pid);
-  unw_word_t ip;
   GElf_Shdr shdr;
   //todo: should support multiple text sections for applying
   //patches to already patched executables
@@ -391,47 +421,85 @@ DList* findActivationFrames(ElfInfo* elf,int pid)
   addr_t lowpc=shdr.sh_addr;
   addr_t highpc=lowpc+shdr.sh_size;
   
-  while (unw_step(&unwindCursor) > 0)
+  addr_t* stackPcs=NULL;
+  int numStackPcs=0;
+  struct user_regs_struct regs;
+  getThreadRegs(tid,&regs);
+  //our own unwinder works from a single copy of the stack, only go to
+  //libunwind (which reads the stack a word at a time) if it couldn't
+  //make sense of it
+  if(!unwindTargetStack(elf,pid,&regs,&stackPcs,&numStackPcs))
   {
-    unw_get_reg(&unwindCursor, UNW_REG_IP, &ip);
-    if(lowpc<=ip && ip<=highpc)
+    logprintf(ELL_INFO_V2,ELS_SAFETY,"Falling back to libunwind to find activation frames of thread %i\n",tid);
+    startLibUnwind(tid);
+    unw_word_t ip;
+    int allocatedStackPcs=0;
+    while (unw_step(&unwindCursor) > 0)
     {
-      //we found an activation frame that's in the text section for our program
-      //(i.e. as opposed to in libc or something)
-      //now we try to find its symbol.
-      idx_t symIdx=findSymbolContainingAddress(elf,ip,STT_FUNC,SHN_UNDEF);
-      if(STN_UNDEF!=symIdx)
+      unw_get_reg(&unwindCursor, UNW_REG_IP, &ip);
+      if(numStackPcs>=allocatedStackPcs)
       {
-        logprintf(ELL_INFO_V1,ELS_SAFETY,"Found activation frame at 0x%x\n",ip);
-        DList* li=zmalloc(sizeof(DList));
-        li->value=zmalloc(sizeof(ActivationFrame));
-        ((ActivationFrame*)li->value)->pc=ip;
-        ((ActivationFrame*)li->value)->symIdx=symIdx;
-        //push the frame (which will be further up the stack) onto the front
-        //of the list. This gives us a list ordered from old to new
-        //this is because rejecting an older frame will reject all newer ones
-        dlistPush(&activationFramesHead,NULL,li);
+        allocatedStackPcs=(max(allocatedStackPcs*2,32));
+        stackPcs=realloc(stackPcs,sizeof(addr_t)*allocatedStackPcs);
+        MALLOC_CHECK(stackPcs);
       }
-      //of if is STB_UNDEF, might be _start or something we don't care about
+      stackPcs[numStackPcs++]=ip;
     }
+    endLibUnwind();
   }
-  endLibUnwind();
+
+  addr_t* pcs=zmalloc(sizeof(addr_t)*(numStackPcs+1));
+  int numPcs=0;
+  for(int i=0;i<numStackPcs;i++)
+  {
+    if(lowpc<=stackPcs[i] && stackPcs[i]<=highpc)
+    {
+      //we found an activation frame that's in the text section for our program
+      //(i.e. as opposed to in libc or something)
+      pcs[numPcs++]=stackPcs[i];
+    }
+  }
+  free(stackPcs);
+  //now we try to find their symbols, all at once
+  idx_t* syms=zmalloc(sizeof(idx_t)*(numPcs+1));
+  findSymbolsContainingAddresses(elf,pcs,numPcs,STT_FUNC,syms);
+  for(int i=0;i<numPcs;i++)
+  {
+    if(STN_UNDEF!=syms[i])
+    {
+      logprintf(ELL_INFO_V1,ELS_SAFETY,"Found activation frame at 0x%x\n",pcs[i]);
+      DList* li=zmalloc(sizeof(DList));
+      li->value=zmalloc(sizeof(ActivationFrame));
+      ((ActivationFrame*)li->value)->pc=pcs[i];
+      ((ActivationFrame*)li->value)->symIdx=syms[i];
+      //push the frame (which will be further up the stack) onto the front
+      //of the list. This gives us a list ordered from old to new
+      //this is because rejecting an older frame will reject all newer ones
+      dlistPush(&activationFramesHead,NULL,li);
+    }
+    //of if is STB_UNDEF, might be _start or something we don't care about
+  }
+  free(pcs);
+  free(syms);
   return activationFramesHead;
 }
 
-//find a location in the target where nothing that's being patched is being used.
-addr_t findSafeBreakpointForPatch(ElfInfo* targetBin,ElfInfo* patch,int pid,
-                                  bool avoidCurrentFrame)
+//reindex the functions the patch marks as unsafe into symbol indices in
+//targetBin. This only needs the patch object once, so the result can be
+//computed when the patch is prepared (or stored in a plan file) and reused
+//every time we look for a safe breakpoint.
+//returns a zmalloc'd array, number of entries in numUnsafeFunctionsOut
+idx_t* getUnsafeFunctionsInTarget(ElfInfo* targetBin,ElfInfo* patch,
+                                  int* numUnsafeFunctionsOut)
 {
-  DList* activationFrames=findActivationFrames(targetBin,pid);
   Elf_Data* unsafeFunctionsData=getDataByERS(patch,ERS_UNSAFE_FUNCTIONS);
   if(!unsafeFunctionsData)
   {
     death("Patch object does not contain any unsafe functions data. This should not be\n");
   }
-  size_t numUnsafeFunctions=unsafeFunctionsData->d_size/sizeof(idx_t);
+  int numUnsafeFunctions=unsafeFunctionsData->d_size/sizeof(idx_t);
   //have to go through and reindex them all
-  idx_t* unsafeFunctions=zmalloc(numUnsafeFunctions*sizeof(idx_t));
+  idx_t* unsafeFunctions=zmalloc((max(numUnsafeFunctions,1))*sizeof(idx_t));
   for(int i=0;i<numUnsafeFunctions;i++)
   {
     idx_t symIdxPatch=((idx_t*)unsafeFunctionsData->d_buf)[i];
@@ -442,37 +510,134 @@ addr_t findSafeBreakpointForPatch(ElfInfo* targetBin,ElfInfo* patch,int pid,
     }
     unsafeFunctions[i]=symIdxTarget;
   }
-  DList* deepestGoodFrameLi=NULL;
-  DList* li=activationFrames;
-  for(;li;li=li->next)
+  *numUnsafeFunctionsOut=numUnsafeFunctions;
+  return unsafeFunctions;
+}
+
+UnsafeFunctionSet* createUnsafeFunctionSet(idx_t* unsafeFunctions,int numUnsafeFunctions)
+{
+  UnsafeFunctionSet* set=zmalloc(sizeof(UnsafeFunctionSet));
+  for(int i=0;i<numUnsafeFunctions;i++)
+  {
+    set->numSymbols=(max(set->numSymbols,unsafeFunctions[i]+1));
+  }
+  set->bits=zmalloc((max((set->numSymbols+7)/8,1)));
+  for(int i=0;i<numUnsafeFunctions;i++)
+  {
+    set->bits[unsafeFunctions[i]/8]|=1<<(unsafeFunctions[i]%8);
+  }
+  return set;
+}
+
+void deleteUnsafeFunctionSet(UnsafeFunctionSet* set)
+{
+  if(set)
+  {
+    free(set->bits);
+    free(set);
+  }
+}
+
+bool isUnsafeFunction(idx_t symIdx,UnsafeFunctionSet* unsafeFunctions)
+{
+  return symIdx<unsafeFunctions->numSymbols &&
+    (unsafeFunctions->bits[symIdx/8] & (1<<(symIdx%8)));
+}
+
+static bool hasUnsafeFrame(DList* activationFrames,UnsafeFunctionSet* unsafeFunctions)
+{
+  for(DList* li=activationFrames;li;li=li->next)
   {
     ActivationFrame* frame=li->value;
-    idx_t symIdx=frame->symIdx;
-    bool unsafe=false;
-    for(int i=0;i<numUnsafeFunctions;i++)
+    if(isUnsafeFunction(frame->symIdx,unsafeFunctions))
     {
-      if(symIdx==unsafeFunctions[i])
-      {
-        unsafe=true;
-        break;
-      }
+      return true;
     }
-    if(unsafe)
+  }
+  return false;
+}
+
+//the activation frames of every thread of the target, worked out once
+//and shared by everything that looks at the stacks while the target
+//is stopped
+typedef struct
+{
+  int numThreads;
+  pid_t* tids;
+  DList** frames;//one list per thread, as returned by findActivationFrames
+} TargetStacks;
+
+//the target must be stopped
+static TargetStacks findAllActivationFrames(ElfInfo* targetBin,int pid)
+{
+  TargetStacks stacks;
+  stacks.numThreads=getTargetThreads(&stacks.tids);
+  stacks.frames=zmalloc((max(stacks.numThreads,1))*sizeof(DList*));
+  for(int i=0;i<stacks.numThreads;i++)
+  {
+    stacks.frames[i]=findActivationFrames(targetBin,pid,stacks.tids[i]);
+  }
+  return stacks;
+}
+
+static void freeTargetStacks(TargetStacks* stacks)
+{
+  for(int i=0;i<stacks->numThreads;i++)
+  {
+    deleteDList(stacks->frames[i],free);
+  }
+  free(stacks->frames);
+  free(stacks->tids);
+}
+
+static bool stacksAreSafe(TargetStacks* stacks,UnsafeFunctionSet* unsafeFunctions)
+{
+  for(int i=0;i<stacks->numThreads;i++)
+  {
+    if(hasUnsafeFrame(stacks->frames[i],unsafeFunctions))
     {
-      logprintf(ELL_INFO_V1,ELS_SAFETY,"Activation frame at 0x%x (%s) failed safety check\n",frame->pc,getFunctionNameAtPC(targetBin,frame->pc));
-      if(li->prev)
-      {
-        li->prev->next=NULL;
-      }
-      deleteDList(li,free);
-      li=NULL;
+      logprintf(ELL_INFO_V1,ELS_SAFETY,"Thread %i is in a function being patched\n",stacks->tids[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool targetIsInSafeState(ElfInfo* targetBin,UnsafeFunctionSet* unsafeFunctions,int pid)
+{
+  TargetStacks stacks=findAllActivationFrames(targetBin,pid);
+  bool safe=stacksAreSafe(&stacks,unsafeFunctions);
+  freeTargetStacks(&stacks);
+  return safe;
+}
+
+//findSafeBreakpointForPatch on stacks already found. They're left as
+//they are
+static addr_t findSafeBreakpointInStacks(ElfInfo* targetBin,UnsafeFunctionSet* unsafeFunctions,
+                                         int pid,TargetStacks* stacks,bool avoidCurrentFrame)
+{
+  int chosenThread=0;
+  for(int i=0;i<stacks->numThreads;i++)
+  {
+    if(hasUnsafeFrame(stacks->frames[i],unsafeFunctions))
+    {
+      chosenThread=i;
       break;
     }
-    else
+  }
+  logprintf(ELL_INFO_V2,ELS_SAFETY,"Choosing breakpoint from the stack of thread %i\n",stacks->numThreads?stacks->tids[chosenThread]:pid);
+  DList* activationFrames=stacks->numThreads?stacks->frames[chosenThread]:NULL;
+  DList* deepestGoodFrameLi=NULL;
+  for(DList* li=activationFrames;li;li=li->next)
+  {
+    ActivationFrame* frame=li->value;
+    if(isUnsafeFunction(frame->symIdx,unsafeFunctions))
     {
-      deepestGoodFrameLi=li;
-      logprintf(ELL_INFO_V1,ELS_SAFETY,"Activation frame at 0x%x (%s) passed safety check\n",((ActivationFrame*)deepestGoodFrameLi->value)->pc,getFunctionNameAtPC(targetBin,frame->pc));
+      logprintf(ELL_INFO_V1,ELS_SAFETY,"Activation frame at 0x%x (%s) failed safety check\n",frame->pc,getFunctionNameAtPC(targetBin,frame->pc));
+      break;
     }
+    deepestGoodFrameLi=li;
+    logprintf(ELL_INFO_V1,ELS_SAFETY,"Activation frame at 0x%x (%s) passed safety check\n",frame->pc,getFunctionNameAtPC(targetBin,frame->pc));
   }
   if(!deepestGoodFrameLi)
   {
@@ -489,49 +654,282 @@ addr_t findSafeBreakpointForPatch(ElfInfo* targetBin,ElfInfo* patch,int pid,
   return ((ActivationFrame*)deepestGoodFrameLi->value)->pc;
 }
 
+//find a location in the target where nothing that's being patched is being used.
+//unsafeFunctions is made from the symbol indices in targetBin returned by
+//getUnsafeFunctionsInTarget. Every thread of the target is looked at,
+//the breakpoint is chosen from the stack of the first thread that is
+//in an unsafe function (or the main thread if none are)
+addr_t findSafeBreakpointForPatch(ElfInfo* targetBin,UnsafeFunctionSet* unsafeFunctions,
+                                  int pid,bool avoidCurrentFrame)
+{
+  TargetStacks stacks=findAllActivationFrames(targetBin,pid);
+  addr_t pc=findSafeBreakpointInStacks(targetBin,unsafeFunctions,pid,&stacks,avoidCurrentFrame);
+  freeTargetStacks(&stacks);
+  return pc;
+}
 
-void bringTargetToSafeState(ElfInfo* targetBin,ElfInfo* patch,int pid)
+
+void setSafePointSampling(int numSamples,int windowMs)
+{
+  numSafePointSamples=numSamples;
+  safePointSampleWindowMs=windowMs;
+}
+
+//let the target run for safePointSampleWindowMs, stopping it
+//numSafePointSamples times along the way to look at its stacks. Each
+//time, for every thread in an unsafe function, we note where the
+//outermost unsafe call returns to: the PC at which that thread becomes
+//safe. Returns the PC seen most often (0 if none were) and an estimate
+//of how long until it's reached in predictedMsOut. If a sample finds
+//every thread safe we stop there with the target stopped and set
+//*safeOut
+static addr_t sampleSafePoints(ElfInfo* targetBin,UnsafeFunctionSet* unsafeFunctions,
+                               int pid,bool* safeOut,double* predictedMsOut)
+{
+  *safeOut=false;
+  *predictedMsOut=0;
+  int numCounts=0;
+  int allocatedCounts=0;
+  SafePointCount* counts=NULL;
+  double intervalSeconds=safePointSampleWindowMs/(1e3*numSafePointSamples);
+  for(int i=0;i<numSafePointSamples && !*safeOut;i++)
+  {
+    continueAllThreads();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    struct timespec sampleTime=timespecAfter(&now,intervalSeconds);
+    pid_t tid;
+    //there are no breakpoints yet, so this just sleeps
+    waitForTarget(&sampleTime,&tid);
+    stopAllThreads();
+
+    TargetStacks stacks=findAllActivationFrames(targetBin,pid);
+    bool safe=true;
+    for(int j=0;j<stacks.numThreads;j++)
+    {
+      for(DList* li=stacks.frames[j];li;li=li->next)
+      {
+        ActivationFrame* frame=li->value;
+        if(!isUnsafeFunction(frame->symIdx,unsafeFunctions))
+        {
+          continue;
+        }
+        safe=false;
+        if(li->prev)
+        {
+          addr_t pc=((ActivationFrame*)li->prev->value)->pc;
+          int k=0;
+          for(;k<numCounts && counts[k].pc!=pc;k++);
+          if(k==numCounts)
+          {
+            if(numCounts>=allocatedCounts)
+            {
+              allocatedCounts=(max(allocatedCounts*2,8));
+              counts=realloc(counts,allocatedCounts*sizeof(SafePointCount));
+              MALLOC_CHECK(counts);
+            }
+            counts[numCounts].pc=pc;
+            counts[numCounts].count=0;
+            numCounts++;
+          }
+          counts[k].count++;
+        }
+        //frames are ordered old to new, so this was the outermost one
+        break;
+      }
+    }
+    freeTargetStacks(&stacks);
+    if(safe)
+    {
+      logprintf(ELL_INFO_V2,ELS_SAFETY,"Stack sample %i found the target in a safe state\n",i);
+      *safeOut=true;
+    }
+  }
+
+  addr_t best=0;
+  int bestCount=0;
+  for(int i=0;i<numCounts;i++)
+  {
+    logprintf(ELL_INFO_V2,ELS_SAFETY,"Safe point 0x%x (%s) seen in %i of %i stack samples\n",
+              counts[i].pc,getFunctionNameAtPC(targetBin,counts[i].pc),
+              counts[i].count,numSafePointSamples);
+    if(counts[i].count>bestCount)
+    {
+      best=counts[i].pc;
+      bestCount=counts[i].count;
+    }
+  }
+  if(best)
+  {
+    //if the unsafe call returning to best was seen in bestCount of the
+    //samples, we expect to reach it about once every
+    //numSafePointSamples/bestCount sample intervals
+    *predictedMsOut=intervalSeconds*1e3*numSafePointSamples/bestCount;
+    logprintf(ELL_INFO_V1,ELS_SAFETY,"Predicting safe point 0x%x will be reached in %.3fms\n",
+              best,*predictedMsOut);
+  }
+  free(counts);
+  return best;
+}
+
+//set breakpoints everywhere a thread of the (stopped) target may first
+//find the target in a safe state: the safe breakpoint from
+//findSafeBreakpointForPatch and the return addresses of the unsafe
+//activation frames. A frame returning into another unsafe function
+//can't make things safe, so no breakpoint is set for it. If the
+//target is in a long-running loop below the safe breakpoint, we still
+//stop as soon as the unsafe calls return. predictedPC (if not 0) is a
+//safe point found by sampleSafePoints, also given a breakpoint.
+//stacks are those of the target as it is now.
+//returns the zmalloc'd breakpoint locations, the number in numLocsOut
+static addr_t* setSafePointBreakpoints(ElfInfo* targetBin,UnsafeFunctionSet* unsafeFunctions,
+                                       int pid,TargetStacks* stacks,bool avoidCurrentFrame,
+                                       addr_t predictedPC,int* numLocsOut)
+{
+  int numLocs=0;
+  int allocatedLocs=8;
+  addr_t* locs=zmalloc(allocatedLocs*sizeof(addr_t));
+  locs[numLocs++]=findSafeBreakpointInStacks(targetBin,unsafeFunctions,
+                                             pid,stacks,avoidCurrentFrame);
+  if(predictedPC && predictedPC!=locs[0])
+  {
+    locs[numLocs++]=predictedPC;
+  }
+  for(int i=0;i<stacks->numThreads;i++)
+  {
+    for(DList* li=stacks->frames[i];li;li=li->next)
+    {
+      //frames are ordered from old to new, so the one before is the caller
+      if(!li->prev)
+      {
+        continue;
+      }
+      ActivationFrame* frame=li->value;
+      ActivationFrame* caller=li->prev->value;
+      if(!isUnsafeFunction(frame->symIdx,unsafeFunctions) ||
+         isUnsafeFunction(caller->symIdx,unsafeFunctions))
+      {
+        continue;
+      }
+      bool duplicate=false;
+      for(int j=0;j<numLocs && !duplicate;j++)
+      {
+        duplicate=(locs[j]==caller->pc);
+      }
+      if(duplicate)
+      {
+        continue;
+      }
+      if(numLocs>=allocatedLocs)
+      {
+        allocatedLocs=(max(allocatedLocs*2,8));
+        locs=realloc(locs,allocatedLocs*sizeof(addr_t));
+        MALLOC_CHECK(locs);
+      }
+      locs[numLocs++]=caller->pc;
+    }
+  }
+
+  beginTargetWriteBatch();
+  for(int i=0;i<numLocs;i++)
+  {
+    logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Setting breakpoint to apply patch at 0x%x\n",
+              locs[i]);
+    setBreakpoint(locs[i]);
+  }
+  commitTargetWriteBatch();
+  *numLocsOut=numLocs;
+  return locs;
+}
+
+void bringTargetToSafeState(ElfInfo* targetBin,UnsafeFunctionSet* unsafeFunctions,int pid)
 {
   bool avoidCurrentFrame = true;
-  addr_t safeBreakpointSpot=findSafeBreakpointForPatch(targetBin,patch,pid, avoidCurrentFrame);
-  logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Setting breakpoint to apply patch at 0x%x\n",
-            safeBreakpointSpot);
-  setBreakpoint(safeBreakpointSpot);
-  continuePtrace();
+  addr_t predictedPC=0;
+  double predictedMs=0;
+  if(numSafePointSamples>0)
+  {
+    bool safe;
+    predictedPC=sampleSafePoints(targetBin,unsafeFunctions,pid,&safe,&predictedMs);
+    if(safe)
+    {
+      return;
+    }
+  }
+  int numBreakpoints;
+  TargetStacks stacks=findAllActivationFrames(targetBin,pid);
+  addr_t* breakpoints=setSafePointBreakpoints(targetBin,unsafeFunctions,
+                                              pid,&stacks,avoidCurrentFrame,predictedPC,
+                                              &numBreakpoints);
+  freeTargetStacks(&stacks);
+  continueAllThreads();
   logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Continuing until we reach safe spot to patch. . .\n");
-  bool breakpointReached=false;
-  int numIterations = config.maxWaitForPatching*1e6/WAIT_FOR_SAFE_PATCHING_USLEEP;
-  for(int i=0;i<numIterations;i++)
+  //wait for events rather than polling: a thread reaching a
+  //breakpoint, the time to relax the current frame restriction, and
+  //the deadline for giving up altogether
+  struct timespec start,relaxTime,deadline;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  relaxTime=timespecAfter(&start,MAX_WAIT_SECONDS_BEFORE_TRY_CURRENT_FRAME);
+  deadline=timespecAfter(&start,config.maxWaitForPatching);
+  setTargetWaitTimer(&relaxTime);
+  while(true)
   {
-    if(avoidCurrentFrame &&
-       i * WAIT_FOR_SAFE_PATCHING_USLEEP > (MAX_WAIT_SECONDS_BEFORE_TRY_CURRENT_FRAME*1e6))
+    pid_t trappedTid=0;
+    E_TARGET_WAIT_RESULT result=waitForTarget(&deadline,&trappedTid);
+    if(ETW_TIMEOUT==result)
+    {
+      death("Program does not seem to be reaching safe state, aborting patching\n");
+    }
+    else if(ETW_TIMER==result)
     {
+      if(!avoidCurrentFrame)
+      {
+        continue;
+      }
       logprintf(ELL_INFO_V2, ELS_PATCHAPPLY,
                 "Program still waiting for breakpoint, relaxing restriction on current function\n");
-      kill(pid,SIGSTOP);
-      waitpid(pid, NULL, WUNTRACED);
-      removeBreakpoint(safeBreakpointSpot);
       avoidCurrentFrame = false;
-      safeBreakpointSpot = findSafeBreakpointForPatch(targetBin, patch, pid, avoidCurrentFrame);
-      setBreakpoint(safeBreakpointSpot);
-      continuePtrace();
     }
-    logprintf(ELL_INFO_V3,ELS_PATCHAPPLY,"Iterating waiting for breakpoint to be hit\n");
-    if(0!=waitpid(-1,NULL,WNOHANG))
+    else
+    {
+      logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Thread %i reached breakpoint\n",trappedTid);
+    }
+    stopAllThreads();
+    removeBreakpoints(breakpoints,numBreakpoints);
+    free(breakpoints);
+    //the thread that hit the breakpoint may be safe, but the others may
+    //not be. The same unwinding does for both checking that and
+    //choosing the breakpoints again
+    stacks=findAllActivationFrames(targetBin,pid);
+    if(ETW_TRAP==result && stacksAreSafe(&stacks,unsafeFunctions))
     {
-      logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Reached breakpoint\n");
-      breakpointReached=true;
+      freeTargetStacks(&stacks);
       break;
     }
-    usleep(WAIT_FOR_SAFE_PATCHING_USLEEP);
+    if(ETW_TRAP==result)
+    {
+      logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"A thread is still in a function being patched, waiting again\n");
+    }
+    //the stacks have changed, so choose the breakpoints again
+    breakpoints=setSafePointBreakpoints(targetBin,unsafeFunctions,
+                                        pid,&stacks,avoidCurrentFrame,predictedPC,
+                                        &numBreakpoints);
+    freeTargetStacks(&stacks);
+    continueAllThreads();
   }
-  if(breakpointReached)
+  setTargetWaitTimer(NULL);
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  double observedMs=(end.tv_sec-start.tv_sec)*1e3+(end.tv_nsec-start.tv_nsec)/1e6;
+  if(predictedPC)
   {
-    removeBreakpoint(safeBreakpointSpot);
+    logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"Target reached a safe state after %.3fms (predicted %.3fms)\n",
+              observedMs,predictedMs);
   }
   else
   {
-    death("Program does not seem to be reaching safe state, aborting patching\n");
+    logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"Target reached a safe state after %.3fms\n",
+              observedMs);
   }
 }
 
@@ -583,13 +981,14 @@ void printBacktrace(ElfInfo* elf,int pid)
       continue;
     }
     printf("%i. %s\n",i,getFunctionNameAtPC(elf,fde->lowpc));
-    Dictionary* rulesDict=dictDuplicate(elf->cie->initialRules,NULL);
-    evaluateInstructionsToRules(fde->instructions,fde->numInstructions,rulesDict,regs.eip);    
+    RuleSet* rules=ruleSetCreate();
+    CFITable* table=getCFITable(fde);
+    getCFIRowRules(table,findCFIRow(table,regs.eip),rules);
     printf("\t{eax=0x%x,ecx=0x%x,edx=0x%x,ebx=0x%x,esp=0x%x,\n\tebp=0x%x,esi=0x%x,edi=0x%x,eip=0x%x}\n",(uint)regs.eax,(uint)regs.ecx,(uint)regs.edx,(uint)regs.ebx,(uint)regs.esp,(uint)regs.ebp,(uint)regs.esi,(uint)regs.edi,(uint)regs.eip);
     printf("\tunwinding and applying register restore rules:\n");
-    printRules(rulesDict,"\t");
-    regs=restoreRegsFromRegisterRules(regs,rulesDict);
-    dictDelete(rulesDict,NULL);
+    printRules(rules,"\t");
+    regs=restoreRegsFromRegisterRules(regs,rules);
+    ruleSetDelete(rules);
   }
   */
 }
@@ -55,11 +55,46 @@
 
 #ifndef safety_h
 #define safety_h
+#include <sys/user.h>
+#include "elfparse.h"
 
 void printBacktrace(ElfInfo* elf,int pid);
 
+//returns NULL if no FDE of elf covers pc
+struct FDE* getFDEForPC(ElfInfo* elf,addr_t pc);
+
+//conversion between dwarf register numbers and x86 registers
+long int getRegValueFromDwarfRegNum(struct user_regs_struct regs,int num);
+void setRegValueFromDwarfRegNum(struct user_regs_struct* regs,int num,long int newValue);
+
+//reindex the patch's unsafe functions into symbol indices in targetBin
+//returns a zmalloc'd array
+idx_t* getUnsafeFunctionsInTarget(ElfInfo* targetBin,ElfInfo* patch,
+                                  int* numUnsafeFunctionsOut);
+
+//the unsafe functions as a bitmap over symbol indices in the target, so
+//that checking an activation frame takes constant time
+typedef struct
+{
+  byte* bits;
+  idx_t numSymbols;//no symbol at or above this is unsafe
+} UnsafeFunctionSet;
+
+UnsafeFunctionSet* createUnsafeFunctionSet(idx_t* unsafeFunctions,int numUnsafeFunctions);
+void deleteUnsafeFunctionSet(UnsafeFunctionSet* set);
+bool isUnsafeFunction(idx_t symIdx,UnsafeFunctionSet* unsafeFunctions);
+
 //find a location in the target where nothing that's being patched is being used.
-addr_t findSafeBreakpointForPatch(ElfInfo* targetBin,ElfInfo* patch,int pid, bool avoidCurrentFrame);
+addr_t findSafeBreakpointForPatch(ElfInfo* targetBin,UnsafeFunctionSet* unsafeFunctions,
+                                  int pid,bool avoidCurrentFrame);
+
+//whether no thread of the (stopped) target is in any of unsafeFunctions
+bool targetIsInSafeState(ElfInfo* targetBin,UnsafeFunctionSet* unsafeFunctions,int pid);
+
+//before setting breakpoints, take numSamples samples of the target's
+//stacks over windowMs milliseconds and also break at the safe point
+//seen most often. 0 samples (the default) turns this off
+void setSafePointSampling(int numSamples,int windowMs);
 
-void bringTargetToSafeState(ElfInfo* targetBin,ElfInfo* patch,int pid);
+void bringTargetToSafeState(ElfInfo* targetBin,UnsafeFunctionSet* unsafeFunctions,int pid);
 #endif
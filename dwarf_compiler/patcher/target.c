@@ -53,6 +53,7 @@
   Description:  low-level functions for modifying an in-memory target
 */
 
+#define _GNU_SOURCE //for ppoll
 #include "target.h"
 #include <sys/ptrace.h>
 #include <stdlib.h>
@@ -66,19 +67,69 @@
 #include <unistd.h>
 #include "../util/logging.h"
 #include "../util/map.h"
+#include "../constants.h"
+#include "transport.h"
+#include "writebuffer.h"
+#include "agent.h"
+#include "channel.h"
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
 
 
 int pid;
+
+//every thread of the target is traced, not just the one whose id is
+//pid. The thread whose id is pid is always threads[0]
+typedef struct
+{
+  pid_t tid;
+  bool running;
+  bool trapped;//stopped by a SIGTRAP, which may be one of our breakpoints
+  int pendingSignal;//signal the thread stopped for that it should get
+                    //when it's resumed
+} TargetThread;
+TargetThread* threads=NULL;
+int numThreads=0;
+int allocatedThreads=0;
+//whether we could use PTRACE_SEIZE. Otherwise threads are attached
+//with PTRACE_ATTACH and stopped with SIGSTOP
+bool threadsSeized=false;
+
+//file descriptors waitForTarget polls. SIGCHLD is blocked while we're
+//attached and delivered through signalFd instead, which wakes us when
+//a thread stops. pidFd (where the kernel has pidfd_open) becomes
+//readable when the target exits
+int signalFd=-1;
+int timerFd=-1;
+int pidFd=-1;
+sigset_t oldSigmask;
 addr_t mallocAddress=0;
 addr_t targetTextStart=0;
 
 typedef struct
 {
-  byte origCode[4];
+  byte origCode;
 } BreakpointRestoreInfo;
 //maps addresses to BreakpointRestoreInfo
 Map* breakpointRestoreInfo=NULL;
 
+//while a write batch is open, writes to the target are staged here
+//rather than made immediately
+WriteBuffer* writeBatch=NULL;
+int writeBatchDepth=0;
+
+E_TARGET_VERIFY_MODE verifyMode=ETV_CHECKSUM;
+
+void setTargetVerifyMode(E_TARGET_VERIFY_MODE mode)
+{
+  verifyMode=mode;
+}
+
 void setMallocAddress(addr_t addr)
 {
   mallocAddress=addr;
@@ -89,32 +140,444 @@ void setTargetTextStart(addr_t addr)
   targetTextStart=addr;
 }
 
+static double elapsedMs(struct timespec* start,struct timespec* end)
+{
+  return (end->tv_sec-start->tv_sec)*1e3+(end->tv_nsec-start->tv_nsec)/1e6;
+}
+
+static TargetThread* findThread(pid_t tid)
+{
+  for(int i=0;i<numThreads;i++)
+  {
+    if(threads[i].tid==tid)
+    {
+      return &threads[i];
+    }
+  }
+  return NULL;
+}
+
+static void removeThread(pid_t tid)
+{
+  TargetThread* thread=findThread(tid);
+  if(thread)
+  {
+    //keep the main thread first
+    memmove(thread,thread+1,(threads+numThreads-thread-1)*sizeof(TargetThread));
+    numThreads--;
+  }
+}
+
+static TargetThread* addThread(pid_t tid)
+{
+  if(numThreads>=allocatedThreads)
+  {
+    allocatedThreads=(max(allocatedThreads*2,8));
+    threads=realloc(threads,allocatedThreads*sizeof(TargetThread));
+    MALLOC_CHECK(threads);
+  }
+  TargetThread* thread=&threads[numThreads++];
+  thread->tid=tid;
+  thread->running=true;
+  thread->trapped=false;
+  thread->pendingSignal=0;
+  return thread;
+}
+
+static bool waitForThreadStop(TargetThread* thread);
+
+//attach to tid. A seized thread is left running, an attached one is
+//waited for until it stops. Returns false if the thread has gone away
+static bool attachThread(pid_t tid)
+{
+  if(ptrace(threadsSeized?PTRACE_SEIZE:PTRACE_ATTACH,tid,NULL,NULL)<0)
+  {
+    if(ESRCH==errno)
+    {
+      return false;
+    }
+    death("ptrace failed to attach to thread %i of the target with errno %d\n",tid,errno);
+  }
+  TargetThread* thread=addThread(tid);
+  if(!threadsSeized && !waitForThreadStop(thread))
+  {
+    removeThread(tid);
+    return false;
+  }
+  return true;
+}
+
+//attach to every thread in /proc/pid/task we aren't attached to yet.
+//Returns the number of threads newly attached to
+static int attachNewThreads()
+{
+  char buf[64];
+  snprintf(buf,64,"/proc/%i/task",pid);
+  DIR* dir=opendir(buf);
+  if(!dir)
+  {
+    death("Could not open %s to find the threads of the target\n",buf);
+  }
+  int numAttached=0;
+  struct dirent* entry;
+  while((entry=readdir(dir)))
+  {
+    pid_t tid=atoi(entry->d_name);
+    if(tid<=0 || findThread(tid))
+    {
+      continue;
+    }
+    if(attachThread(tid))
+    {
+      numAttached++;
+    }
+  }
+  closedir(dir);
+  return numAttached;
+}
+
+//wait for a thread we've asked to stop (with PTRACE_INTERRUPT or
+//SIGSTOP) to do so. Returns false if it exited instead
+static bool waitForThreadStop(TargetThread* thread)
+{
+  int status;
+  while(true)
+  {
+    if(waitpid(thread->tid,&status,__WALL)<0)
+    {
+      if(EINTR==errno)
+      {
+        continue;
+      }
+      return false;
+    }
+    if(WIFEXITED(status) || WIFSIGNALED(status))
+    {
+      return false;
+    }
+    if(!WIFSTOPPED(status))
+    {
+      continue;
+    }
+    int sig=WSTOPSIG(status);
+    bool isEventStop=(status>>16)!=0;
+    thread->running=false;
+    if(isEventStop || SIGSTOP==sig)
+    {
+      return true;
+    }
+    //it stopped at a breakpoint or for a signal of its own before our
+    //stop got to it. Ours is still pending, and if it were left there
+    //it would be reported the next time the thread was resumed, looking
+    //like whatever we were waiting for then. Note why it stopped and
+    //let it go on to take our stop, which it does before running any
+    //more of its own code
+    if(SIGTRAP==sig)
+    {
+      thread->trapped=true;
+    }
+    else if(!thread->pendingSignal)
+    {
+      //it gets the signal when we resume it
+      thread->pendingSignal=sig;
+    }
+    if(ptrace(PTRACE_CONT,thread->tid,NULL,NULL)<0)
+    {
+      //it was stopped, and still is if it hasn't gone away
+      return ESRCH!=errno;
+    }
+    thread->running=true;
+  }
+}
+
+void stopAllThreads()
+{
+  struct timespec start,end;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  //ask every thread to stop before waiting on any of them so that
+  //they all stop at as nearly the same time as we can manage
+  for(int i=0;i<numThreads;i++)
+  {
+    if(!threads[i].running)
+    {
+      continue;
+    }
+    if(threadsSeized)
+    {
+      ptrace(PTRACE_INTERRUPT,threads[i].tid,NULL,NULL);
+    }
+    else
+    {
+      syscall(SYS_tgkill,pid,threads[i].tid,SIGSTOP);
+    }
+  }
+  double slowestMs=0;
+  for(int i=0;i<numThreads;)
+  {
+    if(!threads[i].running)
+    {
+      i++;
+      continue;
+    }
+    if(!waitForThreadStop(&threads[i]))
+    {
+      logprintf(ELL_INFO_V2,ELS_HOTPATCH,"Thread %i exited while being stopped\n",threads[i].tid);
+      removeThread(threads[i].tid);
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    double ms=elapsedMs(&start,&end);
+    slowestMs=(max(slowestMs,ms));
+    logprintf(ELL_INFO_V2,ELS_HOTPATCH,"Thread %i stopped after %.3fms\n",threads[i].tid,ms);
+    i++;
+  }
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Stopped %i threads of the target in %.3fms\n",numThreads,slowestMs);
+}
+
+static void startTargetWait()
+{
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask,SIGCHLD);
+  sigprocmask(SIG_BLOCK,&mask,&oldSigmask);
+  signalFd=signalfd(-1,&mask,SFD_NONBLOCK|SFD_CLOEXEC);
+  if(signalFd<0)
+  {
+    death("Could not create a signalfd to wait on the target (errno %d)\n",errno);
+  }
+  timerFd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+  if(timerFd<0)
+  {
+    death("Could not create a timerfd to wait on the target (errno %d)\n",errno);
+  }
+#ifdef SYS_pidfd_open
+  pidFd=syscall(SYS_pidfd_open,pid,0);
+#endif
+}
+
+static void endTargetWait()
+{
+  if(signalFd>=0)
+  {
+    close(signalFd);
+  }
+  if(timerFd>=0)
+  {
+    close(timerFd);
+  }
+  if(pidFd>=0)
+  {
+    close(pidFd);
+  }
+  signalFd=timerFd=pidFd=-1;
+  sigprocmask(SIG_SETMASK,&oldSigmask,NULL);
+}
+
 void startPtrace(int pid_)
 {
   pid=pid_;
-  if(ptrace(PTRACE_ATTACH,pid,NULL,NULL)<0)
+  numThreads=0;
+  startTargetTransport(pid);
+  //PTRACE_SEIZE lets us attach to everything first and then stop it
+  //all at once. Older kernels don't have it
+  threadsSeized=ptrace(PTRACE_SEIZE,pid,NULL,NULL)>=0;
+  if(!threadsSeized)
   {
-    fprintf(stderr,"ptrace failed to attach to process with errno %d\n", errno);
-    death(NULL);
+    if(ptrace(PTRACE_ATTACH,pid,NULL,NULL)<0)
+    {
+      fprintf(stderr,"ptrace failed to attach to process with errno %d\n", errno);
+      death(NULL);
+    }
+    //this line included on recommendation of phrack
+    //http://phrack.org/issues.html?issue=59&id=8#article
+    waitpid(pid , NULL , WUNTRACED);
+    addThread(pid)->running=false;
+  }
+  else
+  {
+    addThread(pid);
+  }
+  startTargetWait();
+  attachNewThreads();
+  stopAllThreads();
+  //threads started while we were attaching weren't in the list yet
+  while(attachNewThreads())
+  {
+    stopAllThreads();
+  }
+  if(!numThreads || threads[0].tid!=pid)
+  {
+    death("The main thread of the target exited while being attached to\n");
+  }
+  printf("started ptrace\n");
+}
+
+int getTargetThreads(pid_t** tidsOut)
+{
+  *tidsOut=zmalloc((max(numThreads,1))*sizeof(pid_t));
+  for(int i=0;i<numThreads;i++)
+  {
+    (*tidsOut)[i]=threads[i].tid;
+  }
+  return numThreads;
+}
+
+void continueAllThreads()
+{
+  flushTargetWriteBatch();
+  for(int i=0;i<numThreads;i++)
+  {
+    if(threads[i].running)
+    {
+      continue;
+    }
+    if(ptrace(PTRACE_CONT,threads[i].tid,NULL,(void*)(long)threads[i].pendingSignal)<0)
+    {
+      logprintf(ELL_WARN,ELS_HOTPATCH,"Failed to continue thread %i (errno %d)\n",threads[i].tid,errno);
+      continue;
+    }
+    threads[i].pendingSignal=0;
+    threads[i].trapped=false;
+    threads[i].running=true;
+  }
+}
+
+pid_t pollTargetTrap()
+{
+  while(true)
+  {
+    int status;
+    pid_t tid=waitpid(-1,&status,WNOHANG|__WALL);
+    if(tid<=0)
+    {
+      return 0;
+    }
+    TargetThread* thread=findThread(tid);
+    if(!thread)
+    {
+      continue;
+    }
+    if(WIFEXITED(status) || WIFSIGNALED(status))
+    {
+      if(tid==pid)
+      {
+        death("The target exited while we were waiting for it\n");
+      }
+      removeThread(tid);
+      continue;
+    }
+    if(!WIFSTOPPED(status))
+    {
+      continue;
+    }
+    int sig=WSTOPSIG(status);
+    bool isEventStop=(status>>16)!=0;
+    thread->running=false;
+    if(SIGTRAP==sig && !isEventStop)
+    {
+      thread->trapped=true;
+      return tid;
+    }
+    //a left over stop from stopAllThreads, or a signal meant for the
+    //target, let it carry on
+    int deliver=(isEventStop || SIGSTOP==sig)?0:sig;
+    if(ptrace(PTRACE_CONT,tid,NULL,(void*)(long)deliver)>=0)
+    {
+      thread->running=true;
+    }
+  }
+}
+
+void setTargetWaitTimer(struct timespec* when)
+{
+  struct itimerspec spec;
+  memset(&spec,0,sizeof(spec));
+  if(when)
+  {
+    spec.it_value=*when;
+  }
+  //a zero it_value disarms the timer
+  if(timerfd_settime(timerFd,TFD_TIMER_ABSTIME,&spec,NULL)<0)
+  {
+    death("Could not set the target wait timer (errno %d)\n",errno);
+  }
+}
+
+E_TARGET_WAIT_RESULT waitForTarget(struct timespec* deadline,pid_t* tidOut)
+{
+  while(true)
+  {
+    //SIGCHLDs coalesce, so always look for everything that's happened
+    //before going to sleep
+    pid_t tid=pollTargetTrap();
+    if(tid)
+    {
+      *tidOut=tid;
+      return ETW_TRAP;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    if(elapsedMs(deadline,&now)>=0)
+    {
+      return ETW_TIMEOUT;
+    }
+    struct timespec remaining;
+    remaining.tv_sec=deadline->tv_sec-now.tv_sec;
+    remaining.tv_nsec=deadline->tv_nsec-now.tv_nsec;
+    if(remaining.tv_nsec<0)
+    {
+      remaining.tv_sec--;
+      remaining.tv_nsec+=1000000000;
+    }
+    struct pollfd fds[3]={{signalFd,POLLIN,0},{timerFd,POLLIN,0},{pidFd,POLLIN,0}};
+    int numFds=pidFd>=0?3:2;
+    if(ppoll(fds,numFds,&remaining,NULL)<0 && EINTR!=errno)
+    {
+      death("Failed to wait on the target (errno %d)\n",errno);
+    }
+    if(fds[0].revents & POLLIN)
+    {
+      struct signalfd_siginfo info;
+      while(read(signalFd,&info,sizeof(info))==sizeof(info))
+      {
+        //just draining, pollTargetTrap finds out what happened
+      }
+    }
+    if(fds[1].revents & POLLIN)
+    {
+      uint64_t expirations;
+      if(read(timerFd,&expirations,sizeof(expirations))==sizeof(expirations))
+      {
+        return ETW_TIMER;
+      }
+    }
+    //if the target exited, pollTargetTrap will find out about it next
+    //time around
   }
-  //kill(pid,SIGSTOP);
-  /*if(ptrace(PTRACE_CONT,pid,NULL,SIGSTOP)<0)
+}
+
+void getThreadRegs(pid_t tid,struct user_regs_struct* regs)
+{
+  if(ptrace(PTRACE_GETREGS,tid,NULL,regs) < 0)
   {
-    //just make sure the process is running
-    perror("failed to continue process\n");
+    perror("ptrace getregs failed\n");
     death(NULL);
-    }*/
+  }
+}
 
-  //this line included on recommendation of phrack
-  //http://phrack.org/issues.html?issue=59&id=8#article
-  //I'm not entirely positive why
-  //todo: figure this out
-  waitpid(pid , NULL , WUNTRACED);
-  printf("started ptrace\n");
+void setThreadRegs(pid_t tid,struct user_regs_struct* regs)
+{
+  if(ptrace(PTRACE_SETREGS,tid,NULL,regs)<0)
+  {
+    perror("ptrace setregs failed\n");
+    death(NULL);
+  }
 }
 
 void continuePtrace()
 {
+  //the target must see everything we've written before it runs
+  flushTargetWriteBatch();
   if((ptrace(PTRACE_CONT , pid , NULL , NULL)) < 0)
   {
     perror("ptrace cont failed");
@@ -127,17 +590,88 @@ void continuePtrace()
   //todo: figure out its purpose and if it's necessary
   //int s;
 	//while (!WIFSTOPPED(s)) waitpid(pid , &s , WNOHANG);
+  threads[0].trapped=false;
+  threads[0].running=true;
+}
 
+bool runTargetCall()
+{
+  //the trap at the end of the call isn't one of our breakpoints. The
+  //caller puts back the registers the thread had, so it goes back to
+  //whatever it was before
+  bool trapped=threads[0].trapped;
+  continuePtrace();
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC,&deadline);
+  deadline.tv_sec+=TARGET_CALL_TIMEOUT_MS/1000;
+  deadline.tv_nsec+=(TARGET_CALL_TIMEOUT_MS%1000)*1000000L;
+  if(deadline.tv_nsec>=1000000000)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec-=1000000000;
+  }
+  bool finished=false;
+  while(true)
+  {
+    pid_t tid;
+    E_TARGET_WAIT_RESULT result=waitForTarget(&deadline,&tid);
+    if(ETW_TRAP==result && tid==pid)
+    {
+      finished=true;
+      break;
+    }
+    if(ETW_TIMEOUT==result)
+    {
+      if(threadsSeized)
+      {
+        ptrace(PTRACE_INTERRUPT,pid,NULL,NULL);
+      }
+      else
+      {
+        syscall(SYS_tgkill,pid,pid,SIGSTOP);
+      }
+      if(!waitForThreadStop(&threads[0]))
+      {
+        death("The target exited while running code we put in it\n");
+      }
+      //it may have got there while we were stopping it
+      finished=threads[0].trapped;
+      break;
+    }
+    //any other thread is stopped, and the wait timer isn't ours
+  }
+  threads[0].trapped=trapped;
+  if(!finished)
+  {
+    logprintf(ELL_WARN,ELS_HOTPATCH,"The main thread of the target did not finish running the code we put in it within %ims. Another (stopped) thread may hold a lock it needs\n",TARGET_CALL_TIMEOUT_MS);
+  }
+  return finished;
 }
 
 void endPtrace(bool stopProcess)
 {
-  
+  if(writeBatch)
+  {
+    //make sure nothing is left unwritten
+    writeBatchDepth=1;
+    commitTargetWriteBatch();
+  }
+  //other threads first, the process may go with the main thread
+  for(int i=numThreads-1;i>0;i--)
+  {
+    if(ptrace(PTRACE_DETACH,threads[i].tid,NULL,(void*)(long)threads[i].pendingSignal)<0)
+    {
+      logprintf(ELL_WARN,ELS_HOTPATCH,"ptrace failed to detach from thread %i\n",threads[i].tid);
+    }
+  }
   if(ptrace(PTRACE_DETACH,pid,NULL,NULL)<0)
   {
     fprintf(stderr,"ptrace failed to detach\n");
     death(NULL);
   }
+  numThreads=0;
+  endTargetWait();
+  endTargetTransport();
   if(stopProcess)
   {
     kill(pid,SIGSTOP);
@@ -153,147 +687,138 @@ void endPtrace(bool stopProcess)
 void modifyTarget(addr_t addr,word_t value)
 {
   logprintf(ELL_INFO_V2,ELS_HOTPATCH,"Trying to poke data at 0x%x with value 0x%x\n",(word_t)addr,(word_t)value);
-  if(ptrace(PTRACE_POKEDATA,pid,addr,value)<0)
+  if(writeBatch)
+  {
+    writeBufferAdd(writeBatch,addr,(byte*)&value,sizeof(word_t));
+    return;
+  }
+  if(!writeTargetMemory(addr,(byte*)&value,sizeof(word_t)))
   {
     logprintf(ELL_ERR,ELS_HOTPATCH,"Failed to poke data at 0x%x with value 0x%x\n",(word_t)addr,(word_t)value);
-    perror("ptrace POKEDATA failed in modifyTarget\n");
-    death(NULL);
+    death("modifyTarget failed to write to the target\n");
   }
-  //test to make sure the write went through
-  if(1)
+  //a single word isn't worth a readback unless we're being paranoid
+  if(ETV_PARANOID==verifyMode)
   {
-    word_t val=ptrace(PTRACE_PEEKDATA,pid,addr);
-    if(errno)
-    {
-      logprintf(ELL_ERR, ELS_HOTPATCH, "Failed to peek data at 0x%x. Errno %d\n", (word_t)addr, errno);
-      perror("ptrace PEEKDATA failed\n");
-      death(NULL);
-    }
-    if(val!=value)
-    {
-      death("modifyTarget failed, failed to validate result of write\n");
-    }
-    else
-    {
-      logprintf(ELL_INFO_V4,ELS_HOTPATCH,"modifyTarget validated write\n");
-    }
+    TargetIOVec vec={addr,(byte*)&value,sizeof(word_t)};
+    verifyTargetv(&vec,1,verifyMode);
   }
 }
 
-//todo: look more into this. ptrace
-//man page says it's required but in practice doesn't seem to be
-#define require_ptrace_alignment
-
 //copies numBytes from data to addr in target
+//alignment is taken care of by the transport
 void memcpyToTarget(addr_t addr,byte* data,int numBytes)
 {
-  #ifdef require_ptrace_alignment
-  //ptrace requires all addresses to be word-aligned
-  addr_t misalignment=addr%PTRACE_WORD_SIZE;
-  if(misalignment)
-  {
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"misalignment is %i, addr is 0x%x\n",misalignment,addr);
-    byte firstWord[PTRACE_WORD_SIZE];
-    assert(PTRACE_WORD_SIZE==sizeof(word_t));
-    //we'll be copying back a few bytes that already existed
-    memcpyFromTarget(firstWord,addr-misalignment,PTRACE_WORD_SIZE);
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"copied bytes {0x%x,0x%x,0x%x,0%x} from 0x%x\n",(uint)firstWord[0],(uint)firstWord[1],(uint)firstWord[2],(uint)firstWord[3],(uint)(addr-misalignment));
-    int bytesInWd=min(PTRACE_WORD_SIZE-misalignment,numBytes);
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"copying in %i patch bytes in first wd\n",bytesInWd);
-    memcpy(&firstWord[misalignment],data,bytesInWd);
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"now copying bytes {0x%x,0x%x,0x%x,0x%x} to 0x%x\n",(uint)firstWord[0],(uint)firstWord[1],(uint)firstWord[2],(uint)firstWord[3],addr-misalignment);
-    word_t wd;
-    memcpy(&wd,firstWord,sizeof(word_t));
-    modifyTarget(addr-misalignment,wd);
-    data+=bytesInWd;
-    numBytes-=bytesInWd;
-    addr+=bytesInWd;
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"addr is now 0x%x\n",addr);
-    if(0==numBytes)
-    {
-      return;
-    }
-    //now we're all set to carry on copying normally from an aligned address
-  }
-
-  assert(0==addr%PTRACE_WORD_SIZE);
-  #endif
-
-  
-  for(int i=0;i<numBytes;i+=PTRACE_WORD_SIZE)
+  logprintf(ELL_INFO_V4,ELS_HOTPATCH,"memcpyToTarget: putting %i bytes at 0x%zx\n",numBytes,addr);
+  if(writeBatch)
   {
-    if(i+PTRACE_WORD_SIZE<=numBytes)
-    {
-      word_t val;
-      memcpy(&val,data+i,sizeof(word_t));
-      modifyTarget(addr+i,val);
-    }
-    else
-    {
-      assert(sizeof(word_t)==PTRACE_WORD_SIZE);
-      word_t tmp=0;
-      memcpyFromTarget((byte*)&tmp,addr+i,sizeof(word_t));
-      memcpy(&tmp,data+i,numBytes-i);
-      modifyTarget(addr+i,tmp);
-    }
+    writeBufferAdd(writeBatch,addr,data,numBytes);
+    return;
+  }
+  if(!writeTargetMemory(addr,data,numBytes))
+  {
+    death("Failed to write %i bytes to the target at 0x%zx (errno %d)\n",numBytes,addr,errno);
   }
+  TargetIOVec vec={addr,data,numBytes};
+  verifyTargetv(&vec,1,verifyMode);
+  logprintf(ELL_INFO_V4,ELS_HOTPATCH,"memcpyToTarget: used %s transport\n",transportName(getLastTransportUsed()));
 }
 
 //like memcpyFromTarget except doesn't kill katana
-//if ptrace fails
+//if the read fails
 //returns true if it succeseds
 bool memcpyFromTargetNoDeath(byte* data,long addr,int numBytes)
 {
   logprintf(ELL_INFO_V4,ELS_HOTPATCH,"memcpyFromTarget: getting %i bytes from 0x%x\n",numBytes,(uint)addr);
-  for(int i=0;i<numBytes;i+=4)
+  bool readOk=readTargetMemory(data,addr,numBytes);
+  if(writeBatch)
   {
-    uint val=ptrace(PTRACE_PEEKDATA,pid,addr+i);
-    if(errno)
-    {
-      //Do not log as error because this function is NoDeath
-      logprintf(ELL_INFO_V1, ELS_HOTPATCH, "Failed to peek data at 0x%llx. Errno %d\n", (word_t)(addr  + i), errno);
-      return false;
-    }
-    if(i+PTRACE_WORD_SIZE<=numBytes)
-    {
-      memcpy(data+i,&val,PTRACE_WORD_SIZE);
-    }
-    else
-    {
-      logprintf(ELL_INFO_V4,ELS_HOTPATCH,"memcpyFromTarget: wasn't aligned\n");
-      //at the end and wasn't aligned
-      memcpy(data+i,&val,numBytes-i);
-    }
+    //reads must see writes that haven't been committed yet. The staged
+    //writes may cover memory that can't be read yet
+    bool covered=writeBufferOverlay(writeBatch,data,addr,numBytes);
+    readOk=readOk || covered;
+  }
+  if(!readOk)
+  {
+    //Do not log as error because this function is NoDeath
+    logprintf(ELL_INFO_V1, ELS_HOTPATCH, "Failed to read %i bytes at 0x%llx. Errno %d\n", numBytes, (word_t)addr, errno);
+    return false;
   }
   return true;
 }
 
+void beginTargetWriteBatch()
+{
+  if(!writeBatch)
+  {
+    writeBatch=writeBufferCreate();
+  }
+  writeBatchDepth++;
+}
+
+void flushTargetWriteBatch()
+{
+  if(writeBatch)
+  {
+    writeBufferCommit(writeBatch,verifyMode);
+  }
+}
+
+void commitTargetWriteBatch()
+{
+  assert(writeBatch && writeBatchDepth>0);
+  writeBatchDepth--;
+  if(writeBatchDepth)
+  {
+    //an enclosing batch will commit
+    return;
+  }
+  //stop staging before committing so that anything the commit
+  //does goes straight to the target
+  WriteBuffer* wb=writeBatch;
+  writeBatch=NULL;
+  //large writes to writable memory are cheaper through the channel, if
+  //there is one
+  stageWritesInTargetChannel(wb);
+  writeBufferCommit(wb,verifyMode);
+  finishTargetChannelCopies(verifyMode);
+  logWriteBufferStats(wb);
+  writeBufferDelete(wb);
+}
+
+WriteBuffer* suspendTargetWriteBatch()
+{
+  assert(writeBatch);
+  WriteBuffer* wb=writeBatch;
+  writeBatch=NULL;
+  writeBatchDepth=0;
+  return wb;
+}
+
+void resumeTargetWriteBatch(WriteBuffer* wb)
+{
+  assert(!writeBatch);
+  writeBatch=wb;
+  writeBatchDepth=1;
+}
+
 //copies numBytes to data from addr in target
 void memcpyFromTarget(byte* data,long addr,int numBytes)
 {
   if(!memcpyFromTargetNoDeath(data,addr,numBytes))
   {
-    perror("ptrace PEEKDATA failed");
-    death(NULL);
+    death("Failed to read %i bytes from the target at 0x%lx\n",numBytes,addr);
   }      
 }
 
 void getTargetRegs(struct user_regs_struct* regs)
 {
-  if(ptrace(PTRACE_GETREGS,pid,NULL,regs) < 0)
-  {
-    perror("ptrace getregs failed\n");
-    death(NULL);
-  }
+  getThreadRegs(pid,regs);
 }
 
 void setTargetRegs(struct user_regs_struct* regs)
 {
-  if(ptrace(PTRACE_SETREGS,pid,NULL,regs)<0)
-  {
-    perror("ptrace setregs failed\n");
-    death(NULL);
-  }
+  setThreadRegs(pid,regs);
 }
 
 //allocate a region of memory in the target using malloc
@@ -303,6 +828,15 @@ void setTargetRegs(struct user_regs_struct* regs)
 //http://www.hick.org/code/skape/papers/needle.txt
 addr_t mallocTarget(word_t len)
 {
+  if(targetAgentRunning())
+  {
+    word_t retval=getAgentResult(queueAgentCommand(EAC_MALLOC,len,0,0));
+    if((void*)retval==NULL)
+    {
+      death("malloc in target of size %i failed\n",len);
+    }
+    return retval;
+  }
   struct user_regs_struct oldRegs,newRegs;
   getTargetRegs(&oldRegs);
   newRegs=oldRegs;
@@ -382,9 +916,15 @@ addr_t mallocTarget(word_t len)
   setTargetRegs(&newRegs);
   
   
-  //and run the code
-  continuePtrace();
-  wait(NULL);
+  //and run the code. The other threads are stopped, and if one of them
+  //holds a malloc lock the call will never return, so we back out
+  if(!runTargetCall())
+  {
+    memcpyToTarget(modifyTextLocation,oldText,CODE_LEN);
+    setTargetRegs(&oldRegs);
+    flushTargetWriteBatch();
+    death("malloc in target of size %i did not return\n",len);
+  }
   getTargetRegs(&newRegs);//get the return value from the syscall
   word_t retval=REG_AX(newRegs);
   if((void*)retval==NULL)
@@ -407,6 +947,17 @@ addr_t mallocTarget(word_t len)
 addr_t mmapTarget(word_t size,int prot,addr_t desiredAddress)
 {
   printf("requesting mmap of page of size %zi\n",size);
+  if(targetAgentRunning())
+  {
+    word_t retval=getAgentResult(queueAgentCommand(EAC_MMAP,desiredAddress,size,prot));
+    //the raw syscall returns -errno on failure
+    if(retval>(word_t)-4096)
+    {
+      fprintf(stderr,"mmap in target failed\n");
+      death(NULL);
+    }
+    return retval;
+  }
   //map code influenced by code from livepatch
   //http://ukai.jp/Software/livepatch
 
@@ -483,8 +1034,13 @@ addr_t mmapTarget(word_t size,int prot,addr_t desiredAddress)
   setTargetRegs(&newRegs);
   
   //and run the code
-  continuePtrace();
-  wait(NULL);
+  if(!runTargetCall())
+  {
+    memcpyToTarget(REG_IP(oldRegs),oldText,4);
+    setTargetRegs(&oldRegs);
+    flushTargetWriteBatch();
+    death("mmap in target did not return\n");
+  }
   getTargetRegs(&newRegs);//get the return value from the syscall
   word_t retval=REG_AX(newRegs);
   if((void*)retval==MAP_FAILED)
@@ -504,6 +1060,112 @@ addr_t mmapTarget(word_t size,int prot,addr_t desiredAddress)
 }
 
 
+word_t syscallTarget(word_t number,word_t* args,int numArgs,char* str)
+{
+  assert(numArgs<=6);
+  if(targetAgentRunning())
+  {
+    //syscalls aren't made through the agent, as it may be the agent
+    //being unmapped. Run what's queued first so things happen in order
+    runTargetAgent();
+  }
+  #ifdef KATANA_X86_ARCH
+  byte code[]={0xcd,0x80,0xcc,0x00};//int 0x80, int3
+  #elif defined(KATANA_X86_64_ARCH)
+  byte code[]={0x0f,0x05,0xcc,0x00};//syscall, int3
+  #else
+  #error Unknown architecture
+  #endif
+  struct user_regs_struct oldRegs,newRegs;
+  getTargetRegs(&oldRegs);
+  newRegs=oldRegs;
+  //the code and the string temporarily replace text, which is always
+  //mapped. The start of text is preferred as the current pc might be
+  //too close to the end of its mapping to fit the string
+  addr_t location=targetTextStart?targetTextStart:REG_IP(oldRegs);
+  int len=sizeof(code)+(str?strlen(str)+1:0);
+  byte* oldText=zmalloc(len);
+  byte* newText=zmalloc(len);
+  memcpy(newText,code,sizeof(code));
+  word_t regArgs[6]={0};
+  memcpy(regArgs,args,numArgs*sizeof(word_t));
+  if(str)
+  {
+    strcpy((char*)newText+sizeof(code),str);
+    regArgs[0]=location+sizeof(code);
+  }
+  memcpyFromTarget(oldText,location,len);
+  memcpyToTarget(location,newText,len);
+  REG_IP(newRegs)=location;
+  REG_AX(newRegs)=number;
+#ifdef KATANA_X86_ARCH
+  REG_BX(newRegs)=regArgs[0];
+  REG_CX(newRegs)=regArgs[1];
+  REG_DX(newRegs)=regArgs[2];
+  REG_SI(newRegs)=regArgs[3];
+  REG_DI(newRegs)=regArgs[4];
+  REG_BP(newRegs)=regArgs[5];
+  newRegs.orig_eax=-1;
+#else
+  REG_DI(newRegs)=regArgs[0];
+  REG_SI(newRegs)=regArgs[1];
+  REG_DX(newRegs)=regArgs[2];
+  REG_10(newRegs)=regArgs[3];
+  REG_8(newRegs)=regArgs[4];
+  REG_9(newRegs)=regArgs[5];
+  //if the target was stopped in a system call, don't let the kernel
+  //restart it instead of ours
+  newRegs.orig_rax=-1;
+#endif
+  setTargetRegs(&newRegs);
+  bool returned=runTargetCall();
+  getTargetRegs(&newRegs);
+  word_t retval=returned?REG_AX(newRegs):(word_t)-ETIMEDOUT;
+  memcpyToTarget(location,oldText,len);
+  setTargetRegs(&oldRegs);
+  free(oldText);
+  free(newText);
+  return retval;
+}
+
+//the target maps with a raw syscall, so the offset is in pages on x86
+#ifdef KATANA_X86_ARCH
+#define TARGET_SYS_MMAP SYS_mmap2
+#else
+#define TARGET_SYS_MMAP SYS_mmap
+#endif
+
+word_t mmapTargetFd(int fd,bool writable,addr_t addr,word_t size,int prot,int flags,word_t offset)
+{
+  //the target opens the file through our /proc entry, so it doesn't
+  //matter whether it could get at it any other way
+  char path[64];
+  snprintf(path,sizeof(path),"/proc/%i/fd/%i",getpid(),fd);
+  word_t openArgs[]={0,writable?O_RDWR:O_RDONLY};
+  word_t targetFd=syscallTarget(SYS_open,openArgs,2,path);
+  if(targetFd>(word_t)-4096)
+  {
+    return targetFd;
+  }
+#ifdef KATANA_X86_ARCH
+  offset/=sysconf(_SC_PAGE_SIZE);
+#endif
+  word_t mmapArgs[]={addr,size,prot,flags,targetFd,offset};
+  word_t result=syscallTarget(TARGET_SYS_MMAP,mmapArgs,6,NULL);
+  word_t closeArgs[]={targetFd};
+  syscallTarget(SYS_close,closeArgs,1,NULL);
+  return result;
+}
+
+void munmapTarget(addr_t addr,word_t size)
+{
+  word_t args[]={addr,size};
+  if(syscallTarget(SYS_munmap,args,2,NULL))
+  {
+    logprintf(ELL_WARN,ELS_HOTPATCH,"munmap of 0x%zx bytes at 0x%zx in the target failed\n",size,addr);
+  }
+}
+
 //compare a string to a string located
 //at a certain address in the target
 //return true if the strings match up to strlen(str) characters
@@ -527,36 +1189,64 @@ void setBreakpoint(addr_t loc)
     assert(sizeof(addr_t)==sizeof(size_t));
     breakpointRestoreInfo=size_tMapCreate(100);//todo: get rid of arbitrary size 100
   }
+  if(mapExists(breakpointRestoreInfo,&loc))
+  {
+    death("A breakpoint is already set at 0x%x\n",loc);
+  }
   BreakpointRestoreInfo* restore=zmalloc(sizeof(BreakpointRestoreInfo));
-  memcpyFromTarget(restore->origCode,loc,4);
+  memcpyFromTarget(&restore->origCode,loc,1);
   addr_t* key=zmalloc(sizeof(addr_t));
   *key=loc;
   mapInsert(breakpointRestoreInfo,key,restore);
-  byte code[]={0xcc,0x90,0x90,0x90};//int3 followed by nops to make it
-                                    //word-aligned (todo: perhaps not
-                                    //necessary, I think
-                                    //memcpyToTarget already makes
-                                    //things word-aligned)
-  memcpyToTarget(loc,code,4);//todo: 8 not 4 for 64 bit
+  //only the int3 itself is written so that breakpoints on neighbouring
+  //instructions don't overwrite each other
+  byte code=0xcc;
+  memcpyToTarget(loc,&code,1);
 }
 
-void removeBreakpoint(addr_t loc)
+void removeBreakpoints(addr_t* locs,int numLocs)
 {
   assert(breakpointRestoreInfo);
-  BreakpointRestoreInfo* restore=mapGet(breakpointRestoreInfo,&loc);
-  if(!restore)
+  beginTargetWriteBatch();
+  for(int i=0;i<numLocs;i++)
   {
-    death("No breakpoint was set at address 0x%x, cannot remove it\n",loc);
+    BreakpointRestoreInfo* restore=mapGet(breakpointRestoreInfo,&locs[i]);
+    if(!restore)
+    {
+      death("No breakpoint was set at address 0x%x, cannot remove it\n",locs[i]);
+    }
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Restoring breakpoint, copying 0x%x to 0x%x\n",restore->origCode,(uint)locs[i]);
+    memcpyToTarget(locs[i],&restore->origCode,1);
+    mapRemove(breakpointRestoreInfo,&locs[i],free,free);
   }
-  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Restoring breakpoint, copying 0x{%x,%x,%x,%x} to 0x%x\n",restore->origCode[0],restore->origCode[1],restore->origCode[2],restore->origCode[3],(uint)loc);
-  memcpyToTarget(loc,restore->origCode,4);//todo: diff for 64-bit
-  struct user_regs_struct regs;
-  getTargetRegs(&regs);
-  if(REG_IP(regs)==loc+1)
+  commitTargetWriteBatch();
+  //any of the threads may have hit one of them. One that didn't trap
+  //may still be just after one, having jumped there or been stopped
+  //there before the breakpoint was set, and must be left alone
+  for(int i=0;i<numThreads;i++)
   {
-    //we just hit this breakpoint, move pack the pc so we can execute the instruction normally
-    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Restoring program counter to 0x%x\n",(uint)loc);
-    REG_IP(regs)=loc;
-    setTargetRegs(&regs);
+    if(threads[i].running || !threads[i].trapped)
+    {
+      continue;
+    }
+    struct user_regs_struct regs;
+    getThreadRegs(threads[i].tid,&regs);
+    for(int j=0;j<numLocs;j++)
+    {
+      if(REG_IP(regs)==locs[j]+1)
+      {
+        //we just hit this breakpoint, move pack the pc so we can execute the instruction normally
+        logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Restoring program counter of thread %i to 0x%x\n",threads[i].tid,(uint)locs[j]);
+        REG_IP(regs)=locs[j];
+        setThreadRegs(threads[i].tid,&regs);
+        threads[i].trapped=false;
+        break;
+      }
+    }
   }
 }
+
+void removeBreakpoint(addr_t loc)
+{
+  removeBreakpoints(&loc,1);
+}
@@ -65,34 +65,103 @@
 #undef __USE_MISC
 #endif
 #include <sys/syscall.h>
+#include <time.h>
 #include "../types.h"
 #include "../arch.h"
+#include "writebuffer.h"
 //#include <sys/user.h>
 
-//this must be called before any other functions in this file
+//this must be called before any other functions in this file.
+//Attaches to and stops every thread of the target
 void startPtrace(int pid);
+//stop every thread of the target that's running, all at as nearly the
+//same moment as we can
+void stopAllThreads();
+//resume every stopped thread of the target
+void continueAllThreads();
+//check (without blocking) whether a thread of the target has stopped
+//at a breakpoint. Returns its id if so, 0 otherwise. Any other stops
+//are dealt with and the thread allowed to continue
+pid_t pollTargetTrap();
+typedef enum
+{
+  ETW_TRAP,//a thread stopped at a breakpoint
+  ETW_TIMER,//the timer set with setTargetWaitTimer went off
+  ETW_TIMEOUT//the deadline passed
+} E_TARGET_WAIT_RESULT;
+//sleep until a thread of the target stops at a breakpoint (its id is
+//put in *tidOut), the wait timer goes off, or the deadline passes.
+//Times are CLOCK_MONOTONIC. Wakes as soon as any of these happen,
+//there's no polling interval
+E_TARGET_WAIT_RESULT waitForTarget(struct timespec* deadline,pid_t* tidOut);
+//the wait timer goes off once at the given time, NULL cancels it
+void setTargetWaitTimer(struct timespec* when);
+//ids of the threads of the target we're attached to, the main thread
+//first. Returns the number of threads, *tidsOut should be freed
+int getTargetThreads(pid_t** tidsOut);
 
+//how writes to the target are checked. Defaults to ETV_CHECKSUM
+void setTargetVerifyMode(E_TARGET_VERIFY_MODE mode);
+
+//resumes only the main thread, e.g. to run code we put in the target
 void continuePtrace();
+//resume only the main thread, from wherever its registers have been
+//set to, and wait for it to trap. Returns false if it doesn't within
+//TARGET_CALL_TIMEOUT_MS, in which case it has been stopped again
+//wherever it had got to
+bool runTargetCall();
 void endPtrace(bool stopProcess);
 void modifyTarget(addr_t addr,word_t value);
 //copies numBytes from data to addr in target
-//todo: does addr have to be aligned
+//addr need not be aligned. The data is moved by the fastest
+//transport available (see transport.h)
 void memcpyToTarget(addr_t addr,byte* data,int numBytes);
 //copies numBytes to data from addr in target
-//todo: does addr have to be aligned
+//addr need not be aligned
 void memcpyFromTarget(byte* data,long addr,int numBytes);
 
 //like memcpyFromTarget except doesn't kill katana
-//if ptrace fails
+//if the read fails
 //returns true if it succeseds
 bool memcpyFromTargetNoDeath(byte* data,long addr,int numBytes);
 
+//between these calls, writes to the target (memcpyToTarget,
+//modifyTarget) are staged rather than made immediately, and are then
+//committed together in as few transfers as possible. Reads see staged
+//writes. Batches may be nested, only the outermost commit writes. The
+//batch is also flushed whenever the target is allowed to run
+void beginTargetWriteBatch();
+void commitTargetWriteBatch();
+//write out anything staged without ending the batch
+void flushTargetWriteBatch();
+//stop staging writes but keep what has been staged so far, so that it
+//can be committed later (for example once the target has been
+//stopped). resumeTargetWriteBatch starts staging into wb again, as if
+//beginTargetWriteBatch had been called once
+WriteBuffer* suspendTargetWriteBatch();
+void resumeTargetWriteBatch(WriteBuffer* wb);
+
+//the registers of the main thread
 void getTargetRegs(struct user_regs_struct* regs);
 void setTargetRegs(struct user_regs_struct* regs);
+void getThreadRegs(pid_t tid,struct user_regs_struct* regs);
+void setThreadRegs(pid_t tid,struct user_regs_struct* regs);
 //allocate a region of memory in the target
 //return the address (in the target) of the region
 //or NULL if the operation failed
 addr_t mmapTarget(word_t size,int prot,addr_t desiredAddress);
+//unmap a region mapped with mmapTarget
+void munmapTarget(addr_t addr,word_t size);
+//make a system call in the (stopped) target and return what it
+//returned, a negative errno on failure (-ETIMEDOUT if it didn't
+//return in time, see runTargetCall). If str is not NULL it is
+//copied into the target for the duration of the call and its address
+//is passed in place of args[0]
+word_t syscallTarget(word_t number,word_t* args,int numArgs,char* str);
+//map size bytes at offset into the file we have open as fd into the
+//(stopped) target, with the arguments of mmap. Returns the address or
+//a negative errno
+word_t mmapTargetFd(int fd,bool writable,addr_t addr,word_t size,int prot,int flags,word_t offset);
 
 //must be called before any calls to mallocTarget
 void setMallocAddress(addr_t addr);
@@ -108,4 +177,7 @@ bool strnmatchTarget(char* str,addr_t strInTarget);
 
 void setBreakpoint(addr_t loc);
 void removeBreakpoint(addr_t loc);
+//restores all the breakpoints at locs in a single write batch. Any
+//stopped thread that has just hit one of them is moved back to it
+void removeBreakpoints(addr_t* locs,int numLocs);
 #endif
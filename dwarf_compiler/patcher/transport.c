@@ -0,0 +1,528 @@
+/*
+  File: transport.c
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: pluggable transports for moving bulk data to and from the
+               memory of a target process
+*/
+
+#define _GNU_SOURCE //for process_vm_readv/process_vm_writev and pread64/pwrite64
+#include "transport.h"
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include "../arch.h"
+#include "../util/logging.h"
+#include "../util/hash.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//a transport transfers as much of vecs as it can, in order, and
+//returns the number of bytes it managed
+typedef size_t (*TransportFunc)(TargetIOVec* vecs,int cnt);
+
+typedef struct
+{
+  char* name;
+  TransportFunc readv;
+  TransportFunc writev;
+  bool enabled;
+  //statistics
+  int calls;
+  int fallbacks;//how many times this transport left work for the next one
+  size_t bytesRead;
+  size_t bytesWritten;
+} Transport;
+
+static int transportPid=0;
+static int procMemFd=-1;
+static E_TARGET_TRANSPORT lastTransport=ETT_NONE;
+
+static size_t processVMTransfer(TargetIOVec* vecs,int cnt,bool write);
+static size_t processVMRead(TargetIOVec* vecs,int cnt);
+static size_t processVMWrite(TargetIOVec* vecs,int cnt);
+static size_t procMemRead(TargetIOVec* vecs,int cnt);
+static size_t procMemWrite(TargetIOVec* vecs,int cnt);
+static size_t ptraceRead(TargetIOVec* vecs,int cnt);
+static size_t ptraceWrite(TargetIOVec* vecs,int cnt);
+
+//indexed by E_TARGET_TRANSPORT
+static Transport transports[ETT_CNT]={
+  {"none",NULL,NULL,false},
+  {"process_vm",processVMRead,processVMWrite,true},
+  {"/proc/pid/mem",procMemRead,procMemWrite,true},
+  {"ptrace",ptraceRead,ptraceWrite,true}
+};
+
+int getTargetTransportPid()
+{
+  return transportPid;
+}
+
+void startTargetTransport(int pid)
+{
+  if(pid==transportPid)
+  {
+    return;
+  }
+  if(transportPid)
+  {
+    endTargetTransport();
+  }
+  transportPid=pid;
+  char path[64];
+  snprintf(path,sizeof(path),"/proc/%i/mem",pid);
+  procMemFd=open(path,O_RDWR);
+  if(procMemFd<0)
+  {
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Could not open %s (errno %d), it will not be used to access the target\n",path,errno);
+  }
+}
+
+void endTargetTransport()
+{
+  if(!transportPid)
+  {
+    return;
+  }
+  logTransportStats();
+  if(procMemFd>=0)
+  {
+    close(procMemFd);
+    procMemFd=-1;
+  }
+  transportPid=0;
+  lastTransport=ETT_NONE;
+  for(int i=0;i<ETT_CNT;i++)
+  {
+    transports[i].calls=transports[i].fallbacks=0;
+    transports[i].bytesRead=transports[i].bytesWritten=0;
+  }
+}
+
+static size_t processVMTransfer(TargetIOVec* vecs,int cnt,bool write)
+{
+  static struct iovec local[IOV_MAX];
+  static struct iovec remote[IOV_MAX];
+  size_t total=0;
+  for(int i=0;i<cnt;)
+  {
+    int n=min(cnt-i,IOV_MAX);
+    size_t expected=0;
+    for(int j=0;j<n;j++)
+    {
+      local[j].iov_base=vecs[i+j].data;
+      local[j].iov_len=vecs[i+j].len;
+      remote[j].iov_base=(void*)vecs[i+j].addr;
+      remote[j].iov_len=vecs[i+j].len;
+      expected+=vecs[i+j].len;
+    }
+    ssize_t result;
+    if(write)
+    {
+      result=process_vm_writev(transportPid,local,n,remote,n,0);
+    }
+    else
+    {
+      result=process_vm_readv(transportPid,local,n,remote,n,0);
+    }
+    if(result<0)
+    {
+      if(ENOSYS==errno || EPERM==errno)
+      {
+        logprintf(ELL_INFO_V1,ELS_HOTPATCH,"process_vm transport unavailable (errno %d), disabling it\n",errno);
+        transports[ETT_PROCESS_VM].enabled=false;
+      }
+      //EFAULT is expected for pages it can't touch, such as read-only text
+      return total;
+    }
+    total+=result;
+    if(result<expected)
+    {
+      return total;
+    }
+    i+=n;
+  }
+  return total;
+}
+
+static size_t processVMRead(TargetIOVec* vecs,int cnt)
+{
+  return processVMTransfer(vecs,cnt,false);
+}
+
+static size_t processVMWrite(TargetIOVec* vecs,int cnt)
+{
+  return processVMTransfer(vecs,cnt,true);
+}
+
+static size_t procMemTransfer(TargetIOVec* vecs,int cnt,bool write)
+{
+  if(procMemFd<0)
+  {
+    return 0;
+  }
+  size_t total=0;
+  for(int i=0;i<cnt;i++)
+  {
+    size_t done=0;
+    while(done<vecs[i].len)
+    {
+      ssize_t result;
+      off64_t offset=(off64_t)(vecs[i].addr+done);
+      if(write)
+      {
+        result=pwrite64(procMemFd,vecs[i].data+done,vecs[i].len-done,offset);
+      }
+      else
+      {
+        result=pread64(procMemFd,vecs[i].data+done,vecs[i].len-done,offset);
+      }
+      if(result<0 && EINTR==errno)
+      {
+        continue;
+      }
+      if(result<=0)
+      {
+        return total+done;
+      }
+      done+=result;
+    }
+    total+=done;
+  }
+  return total;
+}
+
+static size_t procMemRead(TargetIOVec* vecs,int cnt)
+{
+  return procMemTransfer(vecs,cnt,false);
+}
+
+static size_t procMemWrite(TargetIOVec* vecs,int cnt)
+{
+  return procMemTransfer(vecs,cnt,true);
+}
+
+//ptrace works on whole aligned words, so the parts of a word
+//not covered by a vec are read and preserved
+static size_t ptraceRead(TargetIOVec* vecs,int cnt)
+{
+  size_t total=0;
+  for(int i=0;i<cnt;i++)
+  {
+    size_t done=0;
+    while(done<vecs[i].len)
+    {
+      addr_t addr=vecs[i].addr+done;
+      addr_t misalignment=addr%PTRACE_WORD_SIZE;
+      errno=0;
+      word_t val=ptrace(PTRACE_PEEKDATA,transportPid,addr-misalignment,NULL);
+      if(errno)
+      {
+        return total+done;
+      }
+      size_t n=min(PTRACE_WORD_SIZE-misalignment,vecs[i].len-done);
+      memcpy(vecs[i].data+done,(byte*)&val+misalignment,n);
+      done+=n;
+    }
+    total+=done;
+  }
+  return total;
+}
+
+static size_t ptraceWrite(TargetIOVec* vecs,int cnt)
+{
+  size_t total=0;
+  for(int i=0;i<cnt;i++)
+  {
+    size_t done=0;
+    while(done<vecs[i].len)
+    {
+      addr_t addr=vecs[i].addr+done;
+      addr_t misalignment=addr%PTRACE_WORD_SIZE;
+      size_t n=min(PTRACE_WORD_SIZE-misalignment,vecs[i].len-done);
+      word_t val=0;
+      if(n<PTRACE_WORD_SIZE)
+      {
+        //we'll be copying back a few bytes that already existed
+        errno=0;
+        val=ptrace(PTRACE_PEEKDATA,transportPid,addr-misalignment,NULL);
+        if(errno)
+        {
+          return total+done;
+        }
+      }
+      memcpy((byte*)&val+misalignment,vecs[i].data+done,n);
+      if(ptrace(PTRACE_POKEDATA,transportPid,addr-misalignment,val)<0)
+      {
+        return total+done;
+      }
+      done+=n;
+    }
+    total+=done;
+  }
+  return total;
+}
+
+static size_t transfer(TargetIOVec* vecs,int cnt,bool write)
+{
+  if(!transportPid)
+  {
+    death("target transport used before startTargetTransport\n");
+  }
+  size_t total=0;
+  size_t remaining=0;
+  for(int i=0;i<cnt;i++)
+  {
+    remaining+=vecs[i].len;
+  }
+  //position we have gotten to within vecs
+  int vecIdx=0;
+  size_t offset=0;
+  while(vecIdx<cnt)
+  {
+    if(offset==vecs[vecIdx].len)
+    {
+      vecIdx++;
+      offset=0;
+      continue;
+    }
+    //the current vec may have been partially transferred already, so
+    //temporarily trim it
+    TargetIOVec saved=vecs[vecIdx];
+    vecs[vecIdx].addr+=offset;
+    vecs[vecIdx].data+=offset;
+    vecs[vecIdx].len-=offset;
+    size_t done=0;
+    E_TARGET_TRANSPORT t;
+    for(t=ETT_PROCESS_VM;t<ETT_CNT;t++)
+    {
+      if(!transports[t].enabled)
+      {
+        continue;
+      }
+      transports[t].calls++;
+      if(write)
+      {
+        done=transports[t].writev(vecs+vecIdx,cnt-vecIdx);
+        transports[t].bytesWritten+=done;
+      }
+      else
+      {
+        done=transports[t].readv(vecs+vecIdx,cnt-vecIdx);
+        transports[t].bytesRead+=done;
+      }
+      if(done<remaining)
+      {
+        transports[t].fallbacks++;
+      }
+      if(done)
+      {
+        break;
+      }
+    }
+    vecs[vecIdx]=saved;
+    if(!done)
+    {
+      logprintf(ELL_INFO_V1,ELS_HOTPATCH,"No transport could %s %zu bytes at 0x%zx (errno %d)\n",write?"write":"read",remaining,saved.addr+offset,errno);
+      return total;
+    }
+    lastTransport=t;
+    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"%s %zu bytes at 0x%zx via %s\n",write?"wrote":"read",done,saved.addr+offset,transports[t].name);
+    total+=done;
+    remaining-=done;
+    //advance our position past what was transferred
+    done+=offset;
+    while(vecIdx<cnt && done>=vecs[vecIdx].len)
+    {
+      done-=vecs[vecIdx].len;
+      vecIdx++;
+    }
+    offset=done;
+  }
+  return total;
+}
+
+size_t readTargetv(TargetIOVec* vecs,int cnt)
+{
+  return transfer(vecs,cnt,false);
+}
+
+size_t writeTargetv(TargetIOVec* vecs,int cnt)
+{
+  return transfer(vecs,cnt,true);
+}
+
+bool readTargetMemory(byte* data,addr_t addr,size_t len)
+{
+  TargetIOVec vec={addr,data,len};
+  return readTargetv(&vec,1)==len;
+}
+
+bool writeTargetMemory(addr_t addr,byte* data,size_t len)
+{
+  TargetIOVec vec={addr,data,len};
+  return writeTargetv(&vec,1)==len;
+}
+
+static void reportVerifyMismatch(TargetIOVec* expected,int cnt,byte* actual)
+{
+  for(int i=0;i<cnt;i++)
+  {
+    for(size_t j=0;j<expected[i].len;j++)
+    {
+      if(expected[i].data[j]!=actual[j])
+      {
+        death("Write to target failed to validate: byte at 0x%zx should be 0x%x but is 0x%x\n",expected[i].addr+j,(uint)expected[i].data[j],(uint)actual[j]);
+      }
+    }
+    actual+=expected[i].len;
+  }
+  death("Write to target failed to validate\n");
+}
+
+void verifyTargetv(TargetIOVec* vecs,int cnt,E_TARGET_VERIFY_MODE mode)
+{
+  if(ETV_OFF==mode || !cnt)
+  {
+    return;
+  }
+  size_t totalLen=0;
+  for(int i=0;i<cnt;i++)
+  {
+    totalLen+=vecs[i].len;
+  }
+  byte* actual=zmalloc(totalLen);
+  if(ETV_PARANOID==mode)
+  {
+    byte* pos=actual;
+    for(int i=0;i<cnt;i++)
+    {
+      //one word at a time, each compared as soon as it's read
+      for(size_t j=0;j<vecs[i].len;)
+      {
+        addr_t addr=vecs[i].addr+j;
+        size_t len=min(PTRACE_WORD_SIZE-addr%PTRACE_WORD_SIZE,vecs[i].len-j);
+        if(!readTargetMemory(pos+j,addr,len))
+        {
+          death("Unable to read back write to the target at 0x%zx\n",addr);
+        }
+        if(memcmp(pos+j,vecs[i].data+j,len))
+        {
+          reportVerifyMismatch(&vecs[i],1,pos);
+        }
+        j+=len;
+      }
+      pos+=vecs[i].len;
+    }
+  }
+  else
+  {
+    TargetIOVec* readVecs=zmalloc(sizeof(TargetIOVec)*cnt);
+    uint64_t expectedHash=HASH_BYTES_SEED;
+    byte* pos=actual;
+    for(int i=0;i<cnt;i++)
+    {
+      readVecs[i].addr=vecs[i].addr;
+      readVecs[i].data=pos;
+      readVecs[i].len=vecs[i].len;
+      pos+=vecs[i].len;
+      expectedHash=hashBytes(vecs[i].data,vecs[i].len,expectedHash);
+    }
+    size_t read=readTargetv(readVecs,cnt);
+    free(readVecs);
+    if(read!=totalLen)
+    {
+      death("Unable to read back writes to the target (%zu of %zu bytes read)\n",read,totalLen);
+    }
+    if(hashBytes(actual,totalLen,HASH_BYTES_SEED)!=expectedHash)
+    {
+      reportVerifyMismatch(vecs,cnt,actual);
+    }
+  }
+  logprintf(ELL_INFO_V4,ELS_HOTPATCH,"verified %zu bytes written to the target\n",totalLen);
+  free(actual);
+}
+
+E_TARGET_TRANSPORT getLastTransportUsed()
+{
+  return lastTransport;
+}
+
+char* transportName(E_TARGET_TRANSPORT transport)
+{
+  assert(transport>=0 && transport<ETT_CNT);
+  return transports[transport].name;
+}
+
+void setTransportEnabled(E_TARGET_TRANSPORT transport,bool enabled)
+{
+  if(ETT_NONE==transport || ETT_PTRACE==transport || transport>=ETT_CNT)
+  {
+    death("transport %i cannot be enabled or disabled\n",transport);
+  }
+  transports[transport].enabled=enabled;
+}
+
+void logTransportStats()
+{
+  for(int i=ETT_PROCESS_VM;i<ETT_CNT;i++)
+  {
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"transport %s: %i calls, %i fallbacks, %zu bytes read, %zu bytes written\n",transports[i].name,transports[i].calls,transports[i].fallbacks,transports[i].bytesRead,transports[i].bytesWritten);
+  }
+}
@@ -0,0 +1,132 @@
+/*
+  File: transport.h
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: pluggable transports for moving bulk data to and from the
+               memory of a target process
+*/
+
+#ifndef transport_h
+#define transport_h
+#include "../types.h"
+#include "../util/util.h"
+
+//the ways we know of to get at the memory of a target. They are tried
+//in this order, the later ones being progressively slower
+typedef enum
+{
+  ETT_NONE=0,
+  ETT_PROCESS_VM,//scatter/gather process_vm_readv/process_vm_writev
+  ETT_PROC_MEM,//pread/pwrite on /proc/pid/mem. Slower than
+               //process_vm_* but can write to read-only pages (such
+               //as text) because the kernel forces the access
+  ETT_PTRACE,//PTRACE_PEEKDATA/PTRACE_POKEDATA, one word at a
+             //time. Requires the target to be attached and stopped
+  ETT_CNT
+} E_TARGET_TRANSPORT;
+
+//how much checking is done that writes actually landed
+typedef enum
+{
+  ETV_OFF=0,//trust the transport
+  ETV_CHECKSUM,//read everything written back in one transfer and
+               //compare checksums
+  ETV_PARANOID,//read back and compare each word individually
+  ETV_CNT
+} E_TARGET_VERIFY_MODE;
+
+//one piece of a scatter/gather transfer
+typedef struct
+{
+  addr_t addr;//address in the target
+  byte* data;//local buffer
+  size_t len;
+} TargetIOVec;
+
+//must be called before any other function in this file. Does not
+//require the target to be ptrace-attached, although the ptrace
+//transport will of course not be usable until it is. Calling it again
+//for the same pid does nothing
+void startTargetTransport(int pid);
+void endTargetTransport();
+//the process the transport was started for, 0 if it hasn't been
+int getTargetTransportPid();
+
+//transfer the given pieces in order, falling back to the next
+//transport for whatever a transport was unable to transfer. Returns
+//the number of bytes transferred, counted from the start of the first
+//vec. A count short of the total means that the byte at that position
+//could not be transferred by any transport
+size_t readTargetv(TargetIOVec* vecs,int cnt);
+size_t writeTargetv(TargetIOVec* vecs,int cnt);
+
+//convenience wrappers for a single contiguous region
+//return true if all bytes were transferred
+bool readTargetMemory(byte* data,addr_t addr,size_t len);
+bool writeTargetMemory(addr_t addr,byte* data,size_t len);
+
+//check that the target holds the contents of vecs, which should have
+//just been written. Dies with a description of the first differing
+//byte if it doesn't
+void verifyTargetv(TargetIOVec* vecs,int cnt,E_TARGET_VERIFY_MODE mode);
+
+//the transport which performed the last piece of the most recent
+//transfer
+E_TARGET_TRANSPORT getLastTransportUsed();
+char* transportName(E_TARGET_TRANSPORT transport);
+
+//allows a transport to be turned off (or back on). ETT_PTRACE cannot be
+//disabled as it is the transport of last resort
+void setTransportEnabled(E_TARGET_TRANSPORT transport,bool enabled);
+
+//log how many calls and bytes each transport has handled
+void logTransportStats();
+#endif
@@ -0,0 +1,470 @@
+/*
+  File: unwind.c
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Walks the stacks of the target using its own call frame information
+*/
+
+#include "unwind.h"
+#include "target.h"
+#include "pmap.h"
+#include "safety.h"
+#include "elfparse.h"
+#include "elfutil.h"
+#include "fderead.h"
+#include "dwarfvm.h"
+#include "constants.h"
+#include "util/logging.h"
+#include <unistd.h>
+
+#ifdef KATANA_X86_64_ARCH
+//DWARF numbers rax through r15 and then the return address column
+#define UNWIND_NUM_REGS 17
+#define UNWIND_SP_REG 7
+#elif defined(KATANA_X86_ARCH)
+//DWARF numbers eax through edi and then the return address column
+#define UNWIND_NUM_REGS 9
+#define UNWIND_SP_REG 4
+#else
+#error "Unsupported architecture"
+#endif
+
+//an object mapped into the target whose CFI we may unwind through
+typedef struct
+{
+  char* name;//NULL for the target binary itself
+  addr_t low;//executable range in the target
+  addr_t high;
+  ElfInfo* elf;//opened (and its CFI read) the first time it's needed
+  bool ownsElf;
+  bool loadFailed;
+  addr_t bias;//subtract from an address in the target to get the
+              //address the CFI uses
+} UnwindObject;
+
+typedef struct
+{
+  addr_t low;
+  word_t len;
+  byte* data;
+  word_t allocated;
+} StackSnapshot;
+
+typedef struct
+{
+  word_t values[UNWIND_NUM_REGS];
+  bool valid[UNWIND_NUM_REGS];
+} UnwindRegs;
+
+static int unwindPid=-1;
+static MappedRegion* unwindRegions;
+static int numUnwindRegions;
+static UnwindObject* unwindObjects;
+static int numUnwindObjects;
+static StackSnapshot snapshot;
+
+void endUnwind()
+{
+  for(int i=0;i<numUnwindObjects;i++)
+  {
+    if(unwindObjects[i].ownsElf && unwindObjects[i].elf)
+    {
+      endELF(unwindObjects[i].elf);
+    }
+    free(unwindObjects[i].name);
+  }
+  free(unwindObjects);
+  unwindObjects=NULL;
+  numUnwindObjects=0;
+  free(unwindRegions);
+  unwindRegions=NULL;
+  numUnwindRegions=0;
+  free(snapshot.data);
+  memset(&snapshot,0,sizeof(snapshot));
+  unwindPid=-1;
+}
+
+//the address the first loadable segment of elf expects to be loaded at
+static bool getFirstLoadAddress(ElfInfo* elf,addr_t* addrOut)
+{
+  size_t numPhdrs;
+  if(elf_getphdrnum(elf->e,&numPhdrs))
+  {
+    return false;
+  }
+  for(size_t i=0;i<numPhdrs;i++)
+  {
+    GElf_Phdr phdr;
+    if(gelf_getphdr(elf->e,i,&phdr) && PT_LOAD==phdr.p_type)
+    {
+      *addrOut=phdr.p_vaddr & ~((addr_t)sysconf(_SC_PAGESIZE)-1);
+      return true;
+    }
+  }
+  return false;
+}
+
+//read the .eh_frame of elf if it hasn't been read yet
+static bool loadUnwindCFI(ElfInfo* elf)
+{
+  if(elf->callFrameInfo.fdes)
+  {
+    return true;
+  }
+  if(!getSectionByName(elf,".eh_frame"))
+  {
+    return false;
+  }
+  Map* fdeMap=readDebugFrame(elf,true);
+  if(!fdeMap)
+  {
+    return false;
+  }
+  mapDelete(fdeMap,NULL,free);
+  return true;
+}
+
+static void addUnwindObject(char* name,addr_t low,addr_t high,ElfInfo* elf)
+{
+  unwindObjects=realloc(unwindObjects,(numUnwindObjects+1)*sizeof(UnwindObject));
+  MALLOC_CHECK(unwindObjects);
+  UnwindObject* obj=&unwindObjects[numUnwindObjects++];
+  memset(obj,0,sizeof(UnwindObject));
+  obj->name=name?strdup(name):NULL;
+  obj->low=low;
+  obj->high=high;
+  obj->elf=elf;
+}
+
+//read the memory map of the target and note every file mapped into
+//it. The target binary itself is described by elf rather than being
+//reopened
+static bool readUnwindMap(ElfInfo* elf,int pid)
+{
+  endUnwind();
+  numUnwindRegions=getMemoryMap(pid,&unwindRegions);
+  if(numUnwindRegions<0)
+  {
+    unwindRegions=NULL;
+    numUnwindRegions=0;
+    return false;
+  }
+  unwindPid=pid;
+  GElf_Ehdr ehdr;
+  if(gelf_getehdr(elf->e,&ehdr) && ET_EXEC==ehdr.e_type)
+  {
+    //a non position independent target is where it says it is, so
+    //use its executable segments directly
+    size_t numPhdrs=0;
+    elf_getphdrnum(elf->e,&numPhdrs);
+    for(size_t i=0;i<numPhdrs;i++)
+    {
+      GElf_Phdr phdr;
+      if(gelf_getphdr(elf->e,i,&phdr) && PT_LOAD==phdr.p_type && (phdr.p_flags & PF_X))
+      {
+        addUnwindObject(NULL,phdr.p_vaddr,phdr.p_vaddr+phdr.p_memsz,elf);
+      }
+    }
+  }
+  //consecutive regions with the same name are all the same object
+  for(int i=0;i<numUnwindRegions;)
+  {
+    MappedRegion* region=&unwindRegions[i];
+    addr_t high=region->high;
+    int j=i+1;
+    for(;j<numUnwindRegions && !strcmp(unwindRegions[j].name,region->name);j++)
+    {
+      high=unwindRegions[j].high;
+    }
+    if('/'==region->name[0])
+    {
+      addUnwindObject(region->name,region->low,high,NULL);
+    }
+    i=j;
+  }
+  return true;
+}
+
+static UnwindObject* getUnwindObjectForPC(addr_t pc)
+{
+  //objects for the target binary come first, so they win over the
+  //map entry for the same file
+  for(int i=0;i<numUnwindObjects;i++)
+  {
+    UnwindObject* obj=&unwindObjects[i];
+    if(pc<obj->low || pc>=obj->high)
+    {
+      continue;
+    }
+    if(obj->loadFailed)
+    {
+      return NULL;
+    }
+    if(!obj->elf)
+    {
+      obj->elf=openELFFile(obj->name);
+      obj->ownsElf=true;
+      //libraries are loaded wherever there was room, the first
+      //mapping of the file is where its first segment ended up
+      addr_t firstLoad;
+      if(obj->elf && getFirstLoadAddress(obj->elf,&firstLoad))
+      {
+        obj->bias=obj->low-firstLoad;
+      }
+    }
+    if(!obj->elf || !loadUnwindCFI(obj->elf))
+    {
+      logprintf(ELL_INFO_V2,ELS_SAFETY,"No call frame information for %s, cannot unwind through it\n",obj->name?obj->name:"the target");
+      obj->loadFailed=true;
+      return NULL;
+    }
+    return obj;
+  }
+  return NULL;
+}
+
+static MappedRegion* getRegionForAddress(addr_t addr)
+{
+  for(int i=0;i<numUnwindRegions;i++)
+  {
+    if(unwindRegions[i].low<=addr && addr<unwindRegions[i].high)
+    {
+      return &unwindRegions[i];
+    }
+  }
+  return NULL;
+}
+
+//copy the in-use part of the stack containing sp out of the target
+static bool takeStackSnapshot(addr_t sp)
+{
+  MappedRegion* region=getRegionForAddress(sp);
+  if(!region)
+  {
+    return false;
+  }
+  word_t len=(min(region->high-sp,UNWIND_MAX_STACK_SNAPSHOT));
+  if(len>snapshot.allocated)
+  {
+    free(snapshot.data);
+    snapshot.data=zmalloc(len);
+    snapshot.allocated=len;
+  }
+  snapshot.low=sp;
+  snapshot.len=len;
+  return memcpyFromTargetNoDeath(snapshot.data,sp,len);
+}
+
+static bool readStackWord(addr_t addr,word_t* valueOut)
+{
+  if(addr>=snapshot.low && addr+sizeof(word_t)<=snapshot.low+snapshot.len)
+  {
+    memcpy(valueOut,snapshot.data+(addr-snapshot.low),sizeof(word_t));
+    return true;
+  }
+  //a frame saved something outside the part of the stack we copied
+  return memcpyFromTargetNoDeath((byte*)valueOut,addr,sizeof(word_t));
+}
+
+//compute the registers of the caller of the frame in regs executing
+//at pc. Returns false if we couldn't
+static bool unwindFrame(UnwindObject* obj,addr_t pc,bool isInnermost,
+                        UnwindRegs* regs,UnwindRegs* callerRegs,
+                        addr_t* cfaOut,int* raRegOut)
+{
+  //a return address may be just past the end of the calling
+  //function if the call was the last thing in it
+  addr_t lookupPC=pc-obj->bias-(isInnermost?0:1);
+  FDE* fde=getFDEForPC(obj->elf,lookupPC);
+  if(!fde)
+  {
+    return false;
+  }
+  CFITable* table=getCFITable(fde);
+  CFIRow* row=findCFIRow(table,lookupPC);
+  if(!row)
+  {
+    return false;
+  }
+  PoReg cfaReg;
+  memset(&cfaReg,0,sizeof(PoReg));
+  cfaReg.type=ERT_CFA;
+  PoRegRule* cfaRule=getCFIRowRule(table,row,cfaReg);
+  if(!cfaRule || ERRT_CFA!=cfaRule->type || ERT_BASIC!=cfaRule->regRH.type ||
+     cfaRule->regRH.u.index<0 || cfaRule->regRH.u.index>=UNWIND_NUM_REGS ||
+     !regs->valid[cfaRule->regRH.u.index])
+  {
+    return false;
+  }
+  addr_t cfa=regs->values[cfaRule->regRH.u.index]+cfaRule->offset;
+
+  //registers without a rule keep their value
+  *callerRegs=*regs;
+  for(int i=0;i<row->numRules;i++)
+  {
+    PoRegRule* rule=&table->rules[row->firstRule+i];
+    if(ERT_BASIC!=rule->regLH.type)
+    {
+      continue;
+    }
+    int reg=rule->regLH.u.index;
+    if(reg<0 || reg>=UNWIND_NUM_REGS)
+    {
+      //not a register we track (e.g. a vector register)
+      continue;
+    }
+    switch(rule->type)
+    {
+    case ERRT_UNDEF:
+      callerRegs->valid[reg]=false;
+      break;
+    case ERRT_OFFSET:
+      if(!readStackWord(cfa+rule->offset,&callerRegs->values[reg]))
+      {
+        return false;
+      }
+      callerRegs->valid[reg]=true;
+      break;
+    case ERRT_REGISTER:
+      {
+        int rh=rule->regRH.u.index;
+        if(ERT_BASIC!=rule->regRH.type || rh<0 || rh>=UNWIND_NUM_REGS)
+        {
+          return false;
+        }
+        callerRegs->values[reg]=regs->values[rh];
+        callerRegs->valid[reg]=regs->valid[rh];
+      }
+      break;
+    default:
+      //expressions and the like
+      return false;
+    }
+  }
+  //the caller's stack pointer is the cfa on x86
+  callerRegs->values[UNWIND_SP_REG]=cfa;
+  callerRegs->valid[UNWIND_SP_REG]=true;
+  *cfaOut=cfa;
+  *raRegOut=fde->cie->returnAddrRuleNum;
+  return true;
+}
+
+bool unwindTargetStack(ElfInfo* elf,int pid,struct user_regs_struct* userRegs,
+                       addr_t** pcsOut,int* numPcsOut)
+{
+  *pcsOut=NULL;
+  *numPcsOut=0;
+  addr_t sp=REG_SP(*userRegs);
+  if(pid!=unwindPid || !getRegionForAddress(sp))
+  {
+    //first walk, or a stack we haven't seen (a new thread perhaps)
+    if(!readUnwindMap(elf,pid))
+    {
+      return false;
+    }
+  }
+  if(!takeStackSnapshot(sp))
+  {
+    return false;
+  }
+
+  UnwindRegs regs;
+  memset(&regs,0,sizeof(regs));
+  for(int i=0;i<UNWIND_NUM_REGS-1;i++)
+  {
+    regs.values[i]=getRegValueFromDwarfRegNum(*userRegs,i);
+    regs.valid[i]=true;
+  }
+  addr_t pc=REG_IP(*userRegs);
+  addr_t lastCfa=0;
+  int allocatedPcs=0;
+  for(int depth=0;depth<UNWIND_MAX_FRAMES;depth++)
+  {
+    UnwindObject* obj=getUnwindObjectForPC(pc);
+    if(!obj)
+    {
+      break;
+    }
+    UnwindRegs callerRegs;
+    addr_t cfa;
+    int raReg;
+    if(!unwindFrame(obj,pc,0==depth,&regs,&callerRegs,&cfa,&raReg))
+    {
+      break;
+    }
+    if(raReg<0 || raReg>=UNWIND_NUM_REGS || (depth && cfa<=lastCfa))
+    {
+      //the stack must unwind towards higher addresses or we're going
+      //around in circles
+      break;
+    }
+    if(!callerRegs.valid[raReg] || !callerRegs.values[raReg])
+    {
+      //no return address, this is the outermost frame
+      return true;
+    }
+    pc=callerRegs.values[raReg];
+    if(*numPcsOut>=allocatedPcs)
+    {
+      allocatedPcs=(max(allocatedPcs*2,32));
+      *pcsOut=realloc(*pcsOut,allocatedPcs*sizeof(addr_t));
+      MALLOC_CHECK(*pcsOut);
+    }
+    (*pcsOut)[(*numPcsOut)++]=pc;
+    regs=callerRegs;
+    lastCfa=cfa;
+  }
+  logprintf(ELL_INFO_V2,ELS_SAFETY,"Could not unwind past pc 0x%zx with call frame information\n",pc);
+  free(*pcsOut);
+  *pcsOut=NULL;
+  *numPcsOut=0;
+  return false;
+}
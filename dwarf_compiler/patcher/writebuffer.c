@@ -0,0 +1,365 @@
+/*
+  File: writebuffer.c
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: staging area for writes to the target so that they can be
+               combined and committed in as few transfers as possible
+*/
+
+#include "writebuffer.h"
+#include "transport.h"
+#include "../util/logging.h"
+#include <assert.h>
+
+WriteBuffer* writeBufferCreate()
+{
+  WriteBuffer* wb=zmalloc(sizeof(WriteBuffer));
+  wb->allocated=64;
+  wb->writes=zmalloc(sizeof(PendingWrite)*wb->allocated);
+  return wb;
+}
+
+static void clearPendingWrites(WriteBuffer* wb)
+{
+  for(int i=0;i<wb->numWrites;i++)
+  {
+    free(wb->writes[i].data);
+  }
+  wb->numWrites=0;
+}
+
+void writeBufferDelete(WriteBuffer* wb)
+{
+  clearPendingWrites(wb);
+  free(wb->writes);
+  free(wb);
+}
+
+//the index of the first write ending after addr, numWrites if there
+//is none. The writes are sorted and don't overlap, so this is the only
+//place one overlapping addr could be
+static int findWriteEndingAfter(WriteBuffer* wb,addr_t addr)
+{
+  int lo=0,hi=wb->numWrites;
+  while(lo<hi)
+  {
+    int mid=lo+(hi-lo)/2;
+    if(wb->writes[mid].addr+wb->writes[mid].len<=addr)
+    {
+      lo=mid+1;
+    }
+    else
+    {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+void writeBufferAdd(WriteBuffer* wb,addr_t addr,byte* data,size_t len)
+{
+  if(!len)
+  {
+    return;
+  }
+  wb->writesQueued++;
+  wb->bytesQueued+=len;
+  //every write it overlaps or abuts is merged with it into one
+  int first=findWriteEndingAfter(wb,addr?addr-1:0);
+  int last=first;
+  while(last<wb->numWrites && wb->writes[last].addr<=addr+len)
+  {
+    last++;
+  }
+  if(first==last)
+  {
+    if(wb->numWrites==wb->allocated)
+    {
+      wb->allocated*=2;
+      wb->writes=realloc(wb->writes,sizeof(PendingWrite)*wb->allocated);
+      MALLOC_CHECK(wb->writes);
+    }
+    memmove(&wb->writes[first+1],&wb->writes[first],sizeof(PendingWrite)*(wb->numWrites-first));
+    wb->numWrites++;
+    PendingWrite* w=&wb->writes[first];
+    w->addr=addr;
+    w->len=len;
+    w->data=zmalloc(len);
+    memcpy(w->data,data,len);
+    return;
+  }
+  PendingWrite* w=&wb->writes[first];
+  addr_t lo=min(addr,w->addr);
+  addr_t hi=max(addr+len,wb->writes[last-1].addr+wb->writes[last-1].len);
+  if(lo<w->addr)
+  {
+    byte* merged=zmalloc(hi-lo);
+    memcpy(merged+(w->addr-lo),w->data,w->len);
+    free(w->data);
+    w->data=merged;
+  }
+  else if(hi-lo>w->len)
+  {
+    w->data=realloc(w->data,hi-lo);
+    MALLOC_CHECK(w->data);
+  }
+  for(int i=first+1;i<last;i++)
+  {
+    memcpy(w->data+(wb->writes[i].addr-lo),wb->writes[i].data,wb->writes[i].len);
+    free(wb->writes[i].data);
+  }
+  //laid down last so that it wins
+  memcpy(w->data+(addr-lo),data,len);
+  w->addr=lo;
+  w->len=hi-lo;
+  memmove(&wb->writes[first+1],&wb->writes[last],sizeof(PendingWrite)*(wb->numWrites-last));
+  wb->numWrites-=last-first-1;
+}
+
+bool writeBufferEmpty(WriteBuffer* wb)
+{
+  return 0==wb->numWrites;
+}
+
+bool writeBufferOverlay(WriteBuffer* wb,byte* data,addr_t addr,size_t len)
+{
+  if(!len)
+  {
+    return true;
+  }
+  size_t numCovered=0;
+  for(int i=findWriteEndingAfter(wb,addr);i<wb->numWrites && wb->writes[i].addr<addr+len;i++)
+  {
+    PendingWrite* w=&wb->writes[i];
+    addr_t lo=max(addr,w->addr);
+    addr_t hi=min(addr+len,w->addr+w->len);
+    memcpy(data+(lo-addr),w->data+(lo-w->addr),hi-lo);
+    numCovered+=hi-lo;
+  }
+  return numCovered==len;
+}
+
+//data is taken over rather than copied
+static void appendPendingWrite(PendingWrite** writes,int* numWrites,int* allocated,
+                               addr_t addr,byte* data,size_t len)
+{
+  if(*numWrites==*allocated)
+  {
+    *allocated=(max(*allocated*2,8));
+    *writes=realloc(*writes,sizeof(PendingWrite)*(*allocated));
+    MALLOC_CHECK(*writes);
+  }
+  PendingWrite* w=&(*writes)[(*numWrites)++];
+  w->addr=addr;
+  w->data=data;
+  w->len=len;
+}
+
+void writeBufferElide(WriteBuffer* wb,addr_t addr,byte* data,size_t len)
+{
+  PendingWrite* kept=NULL;
+  int numKept=0;
+  int allocatedKept=0;
+  for(int i=0;i<wb->numWrites;i++)
+  {
+    PendingWrite* w=&wb->writes[i];
+    if(w->addr+w->len<=addr || w->addr>=addr+len)
+    {
+      appendPendingWrite(&kept,&numKept,&allocatedKept,w->addr,w->data,w->len);
+      w->data=NULL;
+      continue;
+    }
+    //keep each run of bytes that's outside the range or differs
+    size_t runStart=0;
+    bool inRun=false;
+    for(size_t j=0;j<=w->len;j++)
+    {
+      addr_t a=w->addr+j;
+      bool keep=j<w->len && (a<addr || a>=addr+len || w->data[j]!=data[a-addr]);
+      if(keep && !inRun)
+      {
+        runStart=j;
+        inRun=true;
+      }
+      else if(!keep && inRun)
+      {
+        byte* run=zmalloc(j-runStart);
+        memcpy(run,w->data+runStart,j-runStart);
+        appendPendingWrite(&kept,&numKept,&allocatedKept,w->addr+runStart,run,j-runStart);
+        inRun=false;
+      }
+      if(!keep && j<w->len)
+      {
+        wb->bytesElided++;
+      }
+    }
+  }
+  clearPendingWrites(wb);
+  free(wb->writes);
+  wb->writes=kept;
+  wb->numWrites=numKept;
+  wb->allocated=allocatedKept;
+  if(!wb->writes)
+  {
+    wb->allocated=64;
+    wb->writes=zmalloc(sizeof(PendingWrite)*wb->allocated);
+  }
+}
+
+void writeBufferCommit(WriteBuffer* wb,E_TARGET_VERIFY_MODE verifyMode)
+{
+  if(!wb->numWrites)
+  {
+    return;
+  }
+  int numRanges=wb->numWrites;
+  PendingWrite* ranges=wb->writes;
+
+  //read what's there already in one go. It's fine if some of it can't
+  //be read, we just won't be able to skip writing it
+  TargetIOVec* vecs=zmalloc(sizeof(TargetIOVec)*numRanges);
+  byte** oldData=zmalloc(sizeof(byte*)*numRanges);
+  size_t* oldValidLen=zmalloc(sizeof(size_t)*numRanges);
+  for(int i=0;i<numRanges;i++)
+  {
+    oldData[i]=zmalloc(ranges[i].len);
+    vecs[i].addr=ranges[i].addr;
+    vecs[i].data=oldData[i];
+    vecs[i].len=ranges[i].len;
+  }
+  size_t oldLen=readTargetv(vecs,numRanges);
+  for(int i=0;i<numRanges;i++)
+  {
+    oldValidLen[i]=min(oldLen,ranges[i].len);
+    oldLen-=oldValidLen[i];
+  }
+
+  //now break each range into the runs of words that actually change
+  int numVecs=0;
+  int allocatedVecs=numRanges;
+  size_t bytesToWrite=0;
+  for(int i=0;i<numRanges;i++)
+  {
+    PendingWrite* range=&ranges[i];
+    bool inRun=false;
+    addr_t chunkStart=range->addr;
+    addr_t rangeEnd=range->addr+range->len;
+    while(chunkStart<rangeEnd)
+    {
+      //chunks are aligned words except possibly at either end
+      addr_t chunkEnd=chunkStart-chunkStart%sizeof(word_t)+sizeof(word_t);
+      chunkEnd=min(chunkEnd,rangeEnd);
+      size_t offset=chunkStart-range->addr;
+      size_t len=chunkEnd-chunkStart;
+      bool unchanged=offset+len<=oldValidLen[i] &&
+        !memcmp(range->data+offset,oldData[i]+offset,len);
+      if(unchanged)
+      {
+        wb->bytesElided+=len;
+        inRun=false;
+      }
+      else if(inRun)
+      {
+        vecs[numVecs-1].len+=len;
+        bytesToWrite+=len;
+      }
+      else
+      {
+        if(numVecs==allocatedVecs)
+        {
+          allocatedVecs*=2;
+          vecs=realloc(vecs,sizeof(TargetIOVec)*allocatedVecs);
+          MALLOC_CHECK(vecs);
+        }
+        vecs[numVecs].addr=chunkStart;
+        vecs[numVecs].data=range->data+offset;
+        vecs[numVecs].len=len;
+        numVecs++;
+        bytesToWrite+=len;
+        inRun=true;
+      }
+      chunkStart=chunkEnd;
+    }
+  }
+
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"Committing %i ranges of pending writes in %i transfers (%zu bytes)\n",numRanges,numVecs,bytesToWrite);
+  size_t written=writeTargetv(vecs,numVecs);
+  if(written!=bytesToWrite)
+  {
+    //find which piece failed for the error message
+    int failedIdx=0;
+    size_t failedOffset=written;
+    while(failedIdx<numVecs && failedOffset>=vecs[failedIdx].len)
+    {
+      failedOffset-=vecs[failedIdx].len;
+      failedIdx++;
+    }
+    assert(failedIdx<numVecs);
+    death("Failed to commit writes to target at 0x%zx (%zu of %zu bytes written)\n",vecs[failedIdx].addr+failedOffset,written,bytesToWrite);
+  }
+  verifyTargetv(vecs,numVecs,verifyMode);
+  wb->bytesWritten+=written;
+  wb->transfers+=numVecs;
+
+  for(int i=0;i<numRanges;i++)
+  {
+    free(oldData[i]);
+  }
+  free(oldData);
+  free(oldValidLen);
+  free(vecs);
+  clearPendingWrites(wb);
+}
+
+void logWriteBufferStats(WriteBuffer* wb)
+{
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"write buffer: %i writes (%zu bytes) queued, %zu bytes written in %i pieces, %zu unchanged bytes skipped\n",wb->writesQueued,wb->bytesQueued,wb->bytesWritten,wb->transfers,wb->bytesElided);
+}
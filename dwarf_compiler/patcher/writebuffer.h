@@ -0,0 +1,111 @@
+/*
+  File: writebuffer.h
+  Author: the Katana contributors
+  Copyright (C): 2026 the Katana contributors
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: staging area for writes to the target so that they can be
+               combined and committed in as few transfers as possible
+*/
+
+#ifndef writebuffer_h
+#define writebuffer_h
+#include "../types.h"
+#include "../util/util.h"
+#include "transport.h"
+
+typedef struct
+{
+  addr_t addr;
+  byte* data;
+  size_t len;
+} PendingWrite;
+
+//writes are kept sorted by address. Each one added is merged with
+//those it overlaps or abuts, the new bytes winning, so the writes never
+//overlap and any address is covered by at most one of them
+typedef struct
+{
+  PendingWrite* writes;
+  int numWrites;
+  int allocated;
+  //statistics, accumulated over all commits
+  int writesQueued;
+  int transfers;//number of ranges actually handed to the transport
+  size_t bytesQueued;
+  size_t bytesWritten;
+  size_t bytesElided;//bytes not written because they already held the right value
+} WriteBuffer;
+
+WriteBuffer* writeBufferCreate();
+void writeBufferDelete(WriteBuffer* wb);
+
+//stage a write of len bytes of data to addr. data is copied
+void writeBufferAdd(WriteBuffer* wb,addr_t addr,byte* data,size_t len);
+
+//apply any pending writes in [addr,addr+len) to data, which should
+//hold what is currently in the target at that range (or garbage if it
+//couldn't be read). Returns true if the pending writes cover the
+//entire range
+bool writeBufferOverlay(WriteBuffer* wb,byte* data,addr_t addr,size_t len);
+
+//drop the parts of the pending writes in [addr,addr+len) which would
+//write the same bytes as are in data, because the target is known to
+//already hold data there
+void writeBufferElide(WriteBuffer* wb,addr_t addr,byte* data,size_t len);
+
+//drop the words of the pending writes whose new value is the same as
+//what the target already holds, and write the rest in a single transfer, which is then
+//checked according to verifyMode. The buffer is empty
+//afterwards. Dies if the target cannot be written
+void writeBufferCommit(WriteBuffer* wb,E_TARGET_VERIFY_MODE verifyMode);
+
+bool writeBufferEmpty(WriteBuffer* wb);
+void logWriteBufferStats(WriteBuffer* wb);
+#endif
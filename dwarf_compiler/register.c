@@ -379,19 +379,216 @@ void printRule(FILE* file,PoRegRule rule,int regnum)
   }
 }
 
-void printRules(FILE* file,Dictionary* rulesDict,char* tabstr)
+void printRules(FILE* file,RuleSet* rules,char* tabstr)
 {
-  PoRegRule** rules=(PoRegRule**)dictValues(rulesDict);
-  for(int i=0;rules[i];i++)
+  int pos=0;
+  PoRegRule* rule;
+  for(int i=0;(rule=ruleSetNext(rules,&pos));i++)
   {
-    if(rules[i]->type!=ERRT_UNDEF)
+    if(rule->type!=ERRT_UNDEF)
     {
       fprintf(file,"%s",tabstr);
-      printRule(file,*rules[i],i);
+      printRule(file,*rule,i);
     }
   }
 }
 
+RuleSet* ruleSetCreate()
+{
+  return zmalloc(sizeof(RuleSet));
+}
+
+void ruleSetDelete(RuleSet* rs)
+{
+  if(!rs)
+  {
+    return;
+  }
+  free(rs->others);
+  free(rs);
+}
+
+void ruleSetClear(RuleSet* rs)
+{
+  memset(&rs->cfa,0,sizeof(PoRegRule));
+  memset(rs->basic,0,sizeof(rs->basic));
+  rs->numOthers=0;
+}
+
+void ruleSetCopy(RuleSet* dest,RuleSet* src)
+{
+  if(dest==src)
+  {
+    return;
+  }
+  dest->cfa=src->cfa;
+  memcpy(dest->basic,src->basic,sizeof(dest->basic));
+  if(dest->allocatedOthers<src->numOthers)
+  {
+    dest->others=realloc(dest->others,src->numOthers*sizeof(PoRegRule));
+    MALLOC_CHECK(dest->others);
+    dest->allocatedOthers=src->numOthers;
+  }
+  if(src->numOthers)
+  {
+    memcpy(dest->others,src->others,src->numOthers*sizeof(PoRegRule));
+  }
+  dest->numOthers=src->numOthers;
+}
+
+int comparePoRegs(PoReg* a,PoReg* b)
+{
+  if(a->type!=b->type)
+  {
+    return a->type<b->type?-1:1;
+  }
+  if(ERT_CURR_TARG_NEW==a->type || ERT_CURR_TARG_OLD==a->type)
+  {
+    if(a->size!=b->size)
+    {
+      return a->size<b->size?-1:1;
+    }
+  }
+  if(a->u.offset!=b->u.offset)
+  {
+    return a->u.offset<b->u.offset?-1:1;
+  }
+  return 0;
+}
+
+//returns the slot in the flat part of the set for reg, or NULL if reg
+//lives in rs->others
+static PoRegRule* directRuleSlot(RuleSet* rs,PoReg* reg)
+{
+  if(ERT_CFA==reg->type)
+  {
+    return &rs->cfa;
+  }
+  if(ERT_BASIC==reg->type && reg->u.index>=0 && reg->u.index<RULESET_NUM_BASIC_REGS)
+  {
+    return &rs->basic[reg->u.index];
+  }
+  return NULL;
+}
+
+//binary search rs->others for reg. Returns the index of its rule if
+//found, otherwise returns -1 and stores where it would be inserted in
+//insertPosOut
+static int findOtherRule(RuleSet* rs,PoReg* reg,int* insertPosOut)
+{
+  int lower=0;
+  int upper=rs->numOthers;
+  //the common case is rules being added in increasing register order,
+  //e.g. transformer fields by offset, so check the end first
+  if(upper>0 && comparePoRegs(&rs->others[upper-1].regLH,reg)<0)
+  {
+    lower=upper;
+  }
+  while(lower<upper)
+  {
+    int mid=lower+(upper-lower)/2;
+    int cmp=comparePoRegs(&rs->others[mid].regLH,reg);
+    if(0==cmp)
+    {
+      return mid;
+    }
+    if(cmp<0)
+    {
+      lower=mid+1;
+    }
+    else
+    {
+      upper=mid;
+    }
+  }
+  if(insertPosOut)
+  {
+    *insertPosOut=lower;
+  }
+  return -1;
+}
+
+PoRegRule* ruleSetGet(RuleSet* rs,PoReg reg)
+{
+  PoRegRule* slot=directRuleSlot(rs,&reg);
+  if(slot)
+  {
+    return ERT_NONE==slot->regLH.type?NULL:slot;
+  }
+  int idx=findOtherRule(rs,&reg,NULL);
+  return idx<0?NULL:&rs->others[idx];
+}
+
+PoRegRule* ruleSetGetOrAdd(RuleSet* rs,PoReg reg)
+{
+  assert(reg.type!=ERT_NONE);
+  PoRegRule* slot=directRuleSlot(rs,&reg);
+  if(!slot)
+  {
+    int pos=0;
+    int idx=findOtherRule(rs,&reg,&pos);
+    if(idx>=0)
+    {
+      return &rs->others[idx];
+    }
+    if(rs->numOthers>=rs->allocatedOthers)
+    {
+      rs->allocatedOthers=(max(rs->allocatedOthers*2,8));
+      rs->others=realloc(rs->others,rs->allocatedOthers*sizeof(PoRegRule));
+      MALLOC_CHECK(rs->others);
+    }
+    memmove(&rs->others[pos+1],&rs->others[pos],
+            (rs->numOthers-pos)*sizeof(PoRegRule));
+    rs->numOthers++;
+    slot=&rs->others[pos];
+    memset(slot,0,sizeof(PoRegRule));
+  }
+  if(ERT_NONE==slot->regLH.type)
+  {
+    memset(slot,0,sizeof(PoRegRule));
+    slot->regLH=reg;
+  }
+  return slot;
+}
+
+void ruleSetRemove(RuleSet* rs,PoReg reg)
+{
+  PoRegRule* slot=directRuleSlot(rs,&reg);
+  if(slot)
+  {
+    memset(slot,0,sizeof(PoRegRule));
+    return;
+  }
+  int idx=findOtherRule(rs,&reg,NULL);
+  if(idx>=0)
+  {
+    memmove(&rs->others[idx],&rs->others[idx+1],
+            (rs->numOthers-idx-1)*sizeof(PoRegRule));
+    rs->numOthers--;
+  }
+}
+
+PoRegRule* ruleSetNext(RuleSet* rs,int* pos)
+{
+  //position 0 is the cfa, then the basic array, then the others
+  while(*pos<1+RULESET_NUM_BASIC_REGS)
+  {
+    PoRegRule* rule=0==*pos?&rs->cfa:&rs->basic[*pos-1];
+    (*pos)++;
+    if(rule->regLH.type!=ERT_NONE)
+    {
+      return rule;
+    }
+  }
+  int idx=*pos-1-RULESET_NUM_BASIC_REGS;
+  if(idx<rs->numOthers)
+  {
+    (*pos)++;
+    return &rs->others[idx];
+  }
+  return NULL;
+}
+
 PoRegRule* duplicatePoRegRule(PoRegRule* rule)
 {
   PoRegRule* new=zmalloc(sizeof(PoRegRule));
@@ -109,6 +109,10 @@ char* strForReg(PoReg reg,int printFlags);
 //printFlags should be OR'd DwarfInstructionPrintFlag
 void printReg(FILE* f,PoReg reg,int printFlags);
 
+//a total order on registers. Two registers compare equal exactly
+//when strForReg would give the same string for them
+int comparePoRegs(PoReg* a,PoReg* b);
+
 
 
 typedef enum
@@ -132,8 +136,44 @@ typedef struct
   idx_t index;//only valid if type is ERRT_RECURSE_FIXUP or ERRT_RECURSE_FIXUP_POINTER
 } PoRegRule;
 
-//rules are of type PoRegRule
-void printRules(FILE* file,Dictionary* rulesDict,char* tabstr);
+//DWARF numbers every register the unwinder cares about below this,
+//so rules for them can live in a flat array indexed by register number
+#define RULESET_NUM_BASIC_REGS 64
+
+//the set of rules in effect at some location, one per register.
+//Rules for the CFA and for ERT_BASIC registers are looked up directly
+//by register number. Patch object registers (and any unusually
+//numbered basic ones) are kept in a small array sorted by register so
+//that a lookup is a binary search. A slot whose regLH.type is
+//ERT_NONE holds no rule.
+typedef struct
+{
+  PoRegRule cfa;
+  PoRegRule basic[RULESET_NUM_BASIC_REGS];
+  PoRegRule* others;
+  int numOthers;
+  int allocatedOthers;
+} RuleSet;
+
+RuleSet* ruleSetCreate();
+void ruleSetDelete(RuleSet* rs);
+//remove every rule, keeping the storage around for reuse
+void ruleSetClear(RuleSet* rs);
+//make dest hold exactly the rules in src
+void ruleSetCopy(RuleSet* dest,RuleSet* src);
+//returns NULL if there is no rule for reg
+PoRegRule* ruleSetGet(RuleSet* rs,PoReg reg);
+//returns the rule for reg, adding an ERRT_UNDEF one if there was
+//none. The pointer is only good until the next rule is added
+PoRegRule* ruleSetGetOrAdd(RuleSet* rs,PoReg reg);
+//does nothing if there is no rule for reg
+void ruleSetRemove(RuleSet* rs,PoReg reg);
+//iterate over the rules in the set. *pos should start at 0. Returns
+//NULL when there are no more rules. The CFA rule (if any) comes
+//first, then basic registers in register order
+PoRegRule* ruleSetNext(RuleSet* rs,int* pos);
+
+void printRules(FILE* file,RuleSet* rules,char* tabstr);
 
 
 typedef struct
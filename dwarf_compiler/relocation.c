@@ -179,6 +179,7 @@ void setRelocationEntryAtOffset(RelocInfo* reloc,Elf_Scn* relocScn,addr_t offset
   assert(SHT_REL==shdr.sh_type || SHT_RELA==shdr.sh_type);
   Elf_Data* data=elf_getdata(relocScn,NULL);
   assert(shdr.sh_size>offset);
+  invalidateRelocIndex(reloc->e);
   ElfXX_Rel rel;
   ElfXX_Rela rela;
   if(SHT_REL==shdr.sh_type)
@@ -344,157 +345,324 @@ void applyRelocations(List* relocs,ELF_STORAGE_TYPE type)
 }
 
 
-//get relocation items that live in the given relocScn
-//that are for  in-memory addresses between lowAddr and highAddr inclusive
-//list value type is RelocInfo
-List* getRelocationItemsInRange(ElfInfo* e,Elf_Scn* relocScn,addr_t lowAddr,addr_t highAddr)
+//a relocation entry as held in a RelocIndex
+typedef struct
 {
-  assert(e);
-  if(!relocScn)
+  RelocInfo reloc;//must be first, we hand out pointers to it
+  idx_t relocScnIdx;//the SHT_REL or SHT_RELA section the entry lives in
+  int entryIdx;//which entry of that section it is
+  bool addendComputed;//REL addends are computed when first needed
+} IndexedReloc;
+
+//the relocations of one SHT_REL or SHT_RELA section
+typedef struct
+{
+  idx_t relocScnIdx;
+  //kept to notice the section changing under us
+  Elf_Data* data;
+  void* d_buf;
+  size_t d_size;
+  IndexedReloc** byOffset;//sorted by r_offset
+  int numRelocs;
+} RelocScnIndex;
+
+//every relocation in an ElfInfo, read once and then looked up by
+//symbol or by offset. Rebuilt if relocation sections are added or
+//resized. Anything modifying relocation entries in place must call
+//invalidateRelocIndex
+struct RelocIndex
+{
+  int numScnsInElf;
+  RelocScnIndex* scns;
+  int numScns;
+  IndexedReloc* relocs;//in section and then entry order
+  int numRelocs;
+  //relocations against symbol s are bySym[symSliceStart[s]] up to
+  //bySym[symSliceStart[s+1]], in section and then entry order
+  RelocInfo** bySym;
+  int* symSliceStart;
+  idx_t numSyms;
+};
+
+static int countSections(ElfInfo* e)
+{
+  int count=0;
+  for(Elf_Scn* scn=elf_nextscn(e->e,NULL);scn;scn=elf_nextscn(e->e,scn))
   {
-    return NULL;
+    count++;
   }
+  return count;
+}
 
-  RelocInfo* reloc=NULL;
-  List* relocsHead=NULL;
-  List* relocsTail=NULL;
-  GElf_Shdr shdr;
-  if(!gelf_getshdr(relocScn,&shdr))
+static int cmpIndexedRelocsByOffset(const void* a,const void* b)
+{
+  const IndexedReloc* ra=*(IndexedReloc* const*)a;
+  const IndexedReloc* rb=*(IndexedReloc* const*)b;
+  if(ra->reloc.r_offset!=rb->reloc.r_offset)
   {
-    death("in getRelocationItemsInRange, could not get shdr for reloc section\n");
+    return ra->reloc.r_offset<rb->reloc.r_offset?-1:1;
   }
-  assert(SHT_REL==shdr.sh_type || SHT_RELA==shdr.sh_type);
-  Elf_Data* data=elf_getdata(relocScn,NULL);
-  int scnIdx=shdr.sh_info;//section relocation applies to
-  GElf_Rel rel;
-  GElf_Rela rela;
-  for(int i=0;i<data->d_size/shdr.sh_entsize;i++)
+  return ra->entryIdx-rb->entryIdx;
+}
+
+static RelocIndex* buildRelocIndex(ElfInfo* e)
+{
+  RelocIndex* index=zmalloc(sizeof(RelocIndex));
+  index->numScnsInElf=countSections(e);
+  //first find out how much there is
+  for(Elf_Scn* scn=elf_nextscn(e->e,NULL);scn;scn=elf_nextscn(e->e,scn))
   {
-    if(!reloc)
+    GElf_Shdr shdr;
+    if(!gelf_getshdr(scn,&shdr))
+    {death("gelf_getshdr failed building relocation index\n");}
+    if(SHT_REL==shdr.sh_type || SHT_RELA==shdr.sh_type)
     {
-      reloc=zmalloc(sizeof(RelocInfo));
-      reloc->e=e;
-      reloc->scnIdx=scnIdx;
+      Elf_Data* data=elf_getdata(scn,NULL);
+      index->numScns++;
+      index->numRelocs+=data->d_size/shdr.sh_entsize;
     }
-    if(SHT_REL==shdr.sh_type)
-    {
-      gelf_getrel(data,i,&rel);
-      if(rel.r_offset < lowAddr || rel.r_offset > highAddr)
-      {
-        continue;
-      }
-      reloc->r_offset=rel.r_offset;
-      reloc->relocType=ELF64_R_TYPE(rel.r_info);//elf64 because it's GElf
-      reloc->symIdx=ELF64_R_SYM(rel.r_info);//elf64 because it's GElf
-      reloc->r_addend=computeAddend(e,reloc->relocType,reloc->symIdx,reloc->r_offset,reloc->scnIdx);
+  }
+  index->scns=zmalloc(sizeof(RelocScnIndex)*(max(index->numScns,1)));
+  index->relocs=zmalloc(sizeof(IndexedReloc)*(max(index->numRelocs,1)));
 
+  int scnCnt=0;
+  int relocCnt=0;
+  for(Elf_Scn* scn=elf_nextscn(e->e,NULL);scn;scn=elf_nextscn(e->e,scn))
+  {
+    GElf_Shdr shdr;
+    gelf_getshdr(scn,&shdr);
+    if(SHT_REL!=shdr.sh_type && SHT_RELA!=shdr.sh_type)
+    {
+      continue;
     }
-    else //RELA
+    Elf_Data* data=elf_getdata(scn,NULL);
+    RelocScnIndex* scnIndex=&index->scns[scnCnt++];
+    scnIndex->relocScnIdx=elf_ndxscn(scn);
+    scnIndex->data=data;
+    scnIndex->d_buf=data->d_buf;
+    scnIndex->d_size=data->d_size;
+    scnIndex->numRelocs=data->d_size/shdr.sh_entsize;
+    scnIndex->byOffset=zmalloc(sizeof(IndexedReloc*)*(max(scnIndex->numRelocs,1)));
+    for(int j=0;j<scnIndex->numRelocs;j++)
     {
-      gelf_getrela(data,i,&rela);
-      if(rela.r_offset < lowAddr || rela.r_offset > highAddr)
+      IndexedReloc* ir=&index->relocs[relocCnt++];
+      ir->relocScnIdx=scnIndex->relocScnIdx;
+      ir->entryIdx=j;
+      ir->reloc.e=e;
+      ir->reloc.scnIdx=shdr.sh_info;//section relocation applies to
+      if(SHT_REL==shdr.sh_type)
       {
-        continue;
+        GElf_Rel rel;
+        gelf_getrel(data,j,&rel);
+        ir->reloc.r_offset=rel.r_offset;
+        ir->reloc.relocType=ELF64_R_TYPE(rel.r_info);//elf64 because it's GElf
+        ir->reloc.symIdx=ELF64_R_SYM(rel.r_info);//elf64 because it's GElf
       }
-      reloc->r_offset=rela.r_offset;
-      reloc->r_addend=rela.r_addend;
-      reloc->relocType=ELF64_R_TYPE(rela.r_info);//elf64 because it's GElf
-      reloc->symIdx=ELF64_R_SYM(rela.r_info);//elf64 because it's GElf
-    }
-    List* li=zmalloc(sizeof(List));
-    li->value=reloc;
-    reloc=NULL;
-    if(relocsHead)
-    {
-      relocsTail->next=li;
+      else //RELA
+      {
+        GElf_Rela rela;
+        gelf_getrela(data,j,&rela);
+        ir->reloc.r_offset=rela.r_offset;
+        ir->reloc.r_addend=rela.r_addend;
+        ir->reloc.relocType=ELF64_R_TYPE(rela.r_info);//elf64 because it's GElf
+        ir->reloc.symIdx=ELF64_R_SYM(rela.r_info);//elf64 because it's GElf
+        ir->addendComputed=true;
+      }
+      index->numSyms=max(index->numSyms,ir->reloc.symIdx+1);
+      scnIndex->byOffset[j]=ir;
     }
-    else
+    qsort(scnIndex->byOffset,scnIndex->numRelocs,sizeof(IndexedReloc*),cmpIndexedRelocsByOffset);
+  }
+
+  //counting sort by symbol keeps section and entry order within a symbol
+  index->symSliceStart=zmalloc(sizeof(int)*(index->numSyms+1));
+  for(int i=0;i<index->numRelocs;i++)
+  {
+    index->symSliceStart[index->relocs[i].reloc.symIdx+1]++;
+  }
+  for(idx_t s=0;s<index->numSyms;s++)
+  {
+    index->symSliceStart[s+1]+=index->symSliceStart[s];
+  }
+  index->bySym=zmalloc(sizeof(RelocInfo*)*(max(index->numRelocs,1)));
+  int* fill=zmalloc(sizeof(int)*(index->numSyms+1));
+  memcpy(fill,index->symSliceStart,sizeof(int)*(index->numSyms+1));
+  for(int i=0;i<index->numRelocs;i++)
+  {
+    index->bySym[fill[index->relocs[i].reloc.symIdx]++]=&index->relocs[i].reloc;
+  }
+  free(fill);
+  logprintf(ELL_INFO_V2,ELS_RELOCATION,"indexed %i relocations in %i sections of %s\n",index->numRelocs,index->numScns,e->fname);
+  return index;
+}
+
+void invalidateRelocIndex(ElfInfo* e)
+{
+  RelocIndex* index=e->relocIndex;
+  if(!index)
+  {
+    return;
+  }
+  for(int i=0;i<index->numScns;i++)
+  {
+    free(index->scns[i].byOffset);
+  }
+  free(index->scns);
+  free(index->relocs);
+  free(index->bySym);
+  free(index->symSliceStart);
+  free(index);
+  e->relocIndex=NULL;
+}
+
+static bool relocIndexStillValid(ElfInfo* e,RelocIndex* index)
+{
+  if(countSections(e)!=index->numScnsInElf)
+  {
+    return false;
+  }
+  for(int i=0;i<index->numScns;i++)
+  {
+    RelocScnIndex* scnIndex=&index->scns[i];
+    Elf_Data* data=elf_getdata(elf_getscn(e->e,scnIndex->relocScnIdx),NULL);
+    if(data!=scnIndex->data || data->d_buf!=scnIndex->d_buf ||
+       data->d_size!=scnIndex->d_size)
     {
-      relocsHead=li;
+      return false;
     }
-    relocsTail=li;
   }
-  if(reloc)
+  return true;
+}
+
+static RelocIndex* getRelocIndex(ElfInfo* e)
+{
+  if(e->relocIndex && !relocIndexStillValid(e,e->relocIndex))
+  {
+    invalidateRelocIndex(e);
+  }
+  if(!e->relocIndex)
   {
-    free(reloc);//had an extra one allocated
+    e->relocIndex=buildRelocIndex(e);
   }
-  return relocsHead;
+  return e->relocIndex;
 }
 
-List* getRelocationItemsFor(ElfInfo* e,int symIdx)
+static RelocInfo* withAddend(RelocInfo* reloc)
 {
-  GElf_Sym sym;
-  getSymbol(e,symIdx,&sym);
-  logprintf(ELL_INFO_V2,ELS_RELOCATION,"getting relocation items for symbol %s\n",getString(e,sym.st_name));
-  RelocInfo* reloc=NULL;
-  List* relocsHead=NULL;
-  List* relocsTail=NULL;
-  for(Elf_Scn* scn=elf_nextscn (e->e,NULL);scn;scn=elf_nextscn(e->e,scn))
+  IndexedReloc* ir=(IndexedReloc*)reloc;
+  if(!ir->addendComputed)
   {
-    GElf_Shdr shdr;
-    if(!gelf_getshdr(scn,&shdr))
-    {death("gelf_getshdr failed in getRelocationItemsFor\n");}
-    int scnIdx=shdr.sh_info;
-    if(SHT_REL==shdr.sh_type || SHT_RELA==shdr.sh_type)
+    reloc->r_addend=computeAddend(reloc->e,reloc->relocType,reloc->symIdx,reloc->r_offset,reloc->scnIdx);
+    ir->addendComputed=true;
+  }
+  return reloc;
+}
+
+RelocInfo** getRelocationsForSymbol(ElfInfo* e,idx_t symIdx,int* numRelocsOut)
+{
+  RelocIndex* index=getRelocIndex(e);
+  if(symIdx>=index->numSyms)
+  {
+    *numRelocsOut=0;
+    return index->bySym;
+  }
+  int start=index->symSliceStart[symIdx];
+  *numRelocsOut=index->symSliceStart[symIdx+1]-start;
+  for(int i=0;i<*numRelocsOut;i++)
+  {
+    withAddend(index->bySym[start+i]);
+  }
+  return index->bySym+start;
+}
+
+//relocations from the section with index relocScnIdx with offsets
+//from lowAddr to highAddr inclusive
+static IndexedReloc** getIndexedRelocsInRange(ElfInfo* e,idx_t relocScnIdx,
+                                              addr_t lowAddr,addr_t highAddr,
+                                              int* numRelocsOut)
+{
+  RelocIndex* index=getRelocIndex(e);
+  *numRelocsOut=0;
+  for(int i=0;i<index->numScns;i++)
+  {
+    RelocScnIndex* scnIndex=&index->scns[i];
+    if(scnIndex->relocScnIdx!=relocScnIdx)
     {
-      //this is a relocations section
-      Elf_Data* data=elf_getdata(scn,NULL);
-      for(int j=0;j<data->d_size/shdr.sh_entsize;j++)
+      continue;
+    }
+    //find the first relocation at or above lowAddr
+    int low=0;
+    int high=scnIndex->numRelocs;
+    while(low<high)
+    {
+      int mid=low+(high-low)/2;
+      if(scnIndex->byOffset[mid]->reloc.r_offset<lowAddr)
       {
-        if(!reloc)
-        {
-          reloc=zmalloc(sizeof(RelocInfo));
-          reloc->e=e;
-        }
-        reloc->scnIdx=scnIdx;
-        if(SHT_REL==shdr.sh_type)
-        {
-          GElf_Rel rel;
-          gelf_getrel(data,j,&rel);
-          if(ELF64_R_SYM(rel.r_info)!=symIdx)
-          {
-            continue;
-          }
-          reloc->r_offset=rel.r_offset;
-          reloc->relocType=ELF64_R_TYPE(rel.r_info);//elf64 because it's GElf
-          reloc->symIdx=ELF64_R_SYM(rel.r_info);//elf64 because it's GElf
-	  reloc->r_addend=computeAddend(e,reloc->relocType,reloc->symIdx,reloc->r_offset,reloc->scnIdx);
-        }
-        else //SHT_RELA
-        {
-          GElf_Rela rela;
-          gelf_getrela(data,j,&rela);
-          if(ELF64_R_SYM(rela.r_info)!=symIdx)
-          {
-            continue;
-          }
-          reloc->r_offset=rela.r_offset;
-          reloc->relocType=ELF64_R_TYPE(rela.r_info);//elf64 because it's GElf
-          reloc->symIdx=ELF64_R_SYM(rela.r_info);//elf64 because it's GElf
-          reloc->r_addend=rela.r_addend;
-        }
-        List* li=zmalloc(sizeof(List));
-        li->value=reloc;
-        reloc=NULL;
-        if(relocsHead)
-        {
-          relocsTail->next=li;
-        }
-        else
-        {
-          relocsHead=li;
-        }
-        relocsTail=li;
+        low=mid+1;
+      }
+      else
+      {
+        high=mid;
       }
     }
+    int end=low;
+    while(end<scnIndex->numRelocs && scnIndex->byOffset[end]->reloc.r_offset<=highAddr)
+    {
+      end++;
+    }
+    *numRelocsOut=end-low;
+    return scnIndex->byOffset+low;
   }
-  if(reloc)
+  return NULL;
+}
+
+static List* copyRelocsToList(RelocInfo** relocs,int numRelocs)
+{
+  List* relocsHead=NULL;
+  List* relocsTail=NULL;
+  for(int i=0;i<numRelocs;i++)
   {
-    free(reloc);//had an extra one allocated
+    RelocInfo* reloc=zmalloc(sizeof(RelocInfo));
+    *reloc=*withAddend(relocs[i]);
+    List* li=zmalloc(sizeof(List));
+    li->value=reloc;
+    relocsHead=concatLists(relocsHead,relocsTail,li,li,&relocsTail);
   }
   return relocsHead;
 }
 
+//get relocation items that live in the given relocScn
+//that are for  in-memory addresses between lowAddr and highAddr inclusive
+//list value type is RelocInfo
+List* getRelocationItemsInRange(ElfInfo* e,Elf_Scn* relocScn,addr_t lowAddr,addr_t highAddr)
+{
+  assert(e);
+  if(!relocScn)
+  {
+    return NULL;
+  }
+  GElf_Shdr shdr;
+  if(!gelf_getshdr(relocScn,&shdr))
+  {
+    death("in getRelocationItemsInRange, could not get shdr for reloc section\n");
+  }
+  assert(SHT_REL==shdr.sh_type || SHT_RELA==shdr.sh_type);
+  int numRelocs;
+  IndexedReloc** relocs=getIndexedRelocsInRange(e,elf_ndxscn(relocScn),lowAddr,highAddr,&numRelocs);
+  //IndexedReloc starts with its RelocInfo
+  return copyRelocsToList((RelocInfo**)relocs,numRelocs);
+}
+
+List* getRelocationItemsFor(ElfInfo* e,int symIdx)
+{
+  GElf_Sym sym;
+  getSymbol(e,symIdx,&sym);
+  logprintf(ELL_INFO_V2,ELS_RELOCATION,"getting relocation items for symbol %s\n",getString(e,sym.st_name));
+  int numRelocs;
+  RelocInfo** relocs=getRelocationsForSymbol(e,symIdx,&numRelocs);
+  return copyRelocsToList(relocs,numRelocs);
+}
+
 
 //compute an addend for when we have REL instead of RELA
 //type is relocation type
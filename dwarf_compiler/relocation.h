@@ -84,6 +84,15 @@ typedef struct
 //list value type is RelocInfo
 List* getRelocationItemsFor(ElfInfo* e,int symIdx);
 
+//the relocations in e against symIdx, with their addends computed. The
+//array belongs to e's relocation index, don't free it. It is only good
+//until the relocations in e change
+RelocInfo** getRelocationsForSymbol(ElfInfo* e,idx_t symIdx,int* numRelocsOut);
+
+//must be called after modifying relocation entries of e in place.
+//Also frees the index when e is finished with
+void invalidateRelocIndex(ElfInfo* e);
+
 //get relocation items that live in the given relocScn
 //that are for  in-memory addresses between lowAddr and highAddr inclusive
 //list value type is RelocInfo
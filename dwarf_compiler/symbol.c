@@ -60,6 +60,8 @@
 #include <string.h>
 #include "patcher/versioning.h"
 #include "elfutil.h"
+#include "constants.h"
+#include "util/dictionary.h"
 
 void getSymbol(ElfInfo* e,int symIdx,GElf_Sym* outSym)
 {
@@ -99,15 +101,72 @@ char* unmangleSymbolName(char* name)
   return symbolNameUnmangled;
 }
 
-//find the symbol matching the given symbol
-//e is the binary we're looking in
-//ref is the elf object this symbol is in right now
-idx_t findSymbol(ElfInfo* e,GElf_Sym* sym,ElfInfo* ref,int flags)
+//all the symbols in a symbol table with a given name
+typedef struct
+{
+  idx_t* indices;//in ascending order
+  int num;
+  int allocated;
+} SymbolCandidates;
+
+//index of a symbol table by name, so that we don't have to traverse
+//the whole table for every lookup. Built the first time a table is
+//searched. Symbols appended to the table afterwards (as happens while
+//we're writing out a patch or a patched binary) are picked up on the
+//next lookup. Existing symbols are assumed never to be renamed.
+struct SymbolIndex
+{
+  Elf_Data* data;//the symbol table data indexed
+  int numIndexed;//number of symbols from data in the index so far
+  Dictionary* byName;//maps unmangled names to SymbolCandidates
+  SymbolCandidates sectionSyms;//section symbols match regardless of name
+};
+
+static void addSymbolCandidate(SymbolCandidates* candidates,idx_t idx)
+{
+  if(candidates->num>=candidates->allocated)
+  {
+    candidates->allocated=candidates->allocated?candidates->allocated*2:2;
+    candidates->indices=realloc(candidates->indices,candidates->allocated*sizeof(idx_t));
+    MALLOC_CHECK(candidates->indices);
+  }
+  candidates->indices[candidates->num++]=idx;
+}
+
+static void freeSymbolCandidates(void* candidates)
+{
+  free(((SymbolCandidates*)candidates)->indices);
+  free(candidates);
+}
+
+static void freeSymbolIndex(SymbolIndex* index)
+{
+  if(!index)
+  {
+    return;
+  }
+  dictDelete(index->byName,freeSymbolCandidates);
+  free(index->sectionSyms.indices);
+  free(index);
+}
+
+void freeSymbolIndices(ElfInfo* e)
+{
+  for(int i=0;i<2;i++)
+  {
+    freeSymbolIndex(e->symbolIndices[i]);
+    e->symbolIndices[i]=NULL;
+  }
+  invalidateAddressIndices(e);
+}
+
+//get the index for the symbol table or, if dynamic is true, the
+//dynamic symbol table of e, bringing it up to date first
+static SymbolIndex* getSymbolIndex(ElfInfo* e,bool dynamic)
 {
-  idx_t retval=STN_UNDEF;
   Elf_Data* symTabData=NULL;
   char* (*getstrfunc)(ElfInfo*,int)=NULL;
-  if(flags & ESFF_NEW_DYNAMIC)
+  if(dynamic)
   {
     symTabData=getDataByERS(e,ERS_DYNSYM);
     getstrfunc=&getDynString;
@@ -117,6 +176,162 @@ idx_t findSymbol(ElfInfo* e,GElf_Sym* sym,ElfInfo* ref,int flags)
     symTabData=getDataByERS(e,ERS_SYMTAB);
     getstrfunc=&getString;
   }
+  int numEntries=symTabData->d_size/sizeof(ElfXX_Sym);
+  SymbolIndex* index=e->symbolIndices[dynamic?1:0];
+  if(index && (index->data!=symTabData || index->numIndexed>numEntries))
+  {
+    //the table has been replaced out from under us
+    freeSymbolIndex(index);
+    index=NULL;
+  }
+  if(!index)
+  {
+    index=zmalloc(sizeof(SymbolIndex));
+    index->data=symTabData;
+    index->byName=dictCreate(max(numEntries,SYMBOL_INDEX_MIN_BUCKETS));
+    e->symbolIndices[dynamic?1:0]=index;
+  }
+  for(int i=index->numIndexed;i<numEntries;i++)
+  {
+    ElfXX_Sym sym;
+    //get the symbol in an unsafe manner because
+    //we may be getting it from a data buffer we're in the process of filling
+    memcpy(&sym,symTabData->d_buf+i*sizeof(ElfXX_Sym),sizeof(ElfXX_Sym));
+    char* symnameUnmangled=unmangleSymbolName((*getstrfunc)(e,sym.st_name));
+    SymbolCandidates* candidates=dictGet(index->byName,symnameUnmangled);
+    if(!candidates)
+    {
+      candidates=zmalloc(sizeof(SymbolCandidates));
+      dictInsert(index->byName,symnameUnmangled,candidates);
+    }
+    addSymbolCandidate(candidates,i);
+    free(symnameUnmangled);
+    if(STT_SECTION==ELFXX_ST_TYPE(sym.st_info))
+    {
+      addSymbolCandidate(&index->sectionSyms,i);
+    }
+  }
+  index->numIndexed=numEntries;
+  return index;
+}
+
+//length of a section name once the suffixes findSymbol ignores
+//(".symbolname" from -fdata-sections and -ffunction-sections, and the
+//patch section version if versionSuffix is non-NULL) are stripped
+static size_t normalizedScnNameLen(char* scnName,char* symbolNameDot,
+                                   char* versionSuffix)
+{
+  size_t len=strlen(scnName);
+  size_t suffixLen=strlen(symbolNameDot);
+  if(len>=suffixLen && !strcmp(scnName+len-suffixLen,symbolNameDot))
+  {
+    len-=suffixLen;
+  }
+  if(versionSuffix)
+  {
+    suffixLen=strlen(versionSuffix);
+    if(len>=suffixLen && !strncmp(scnName+len-suffixLen,versionSuffix,suffixLen))
+    {
+      len-=suffixLen;
+    }
+  }
+  return len;
+}
+
+static bool normalizedScnNameHasPrefix(char* scnName,size_t len,char* prefix)
+{
+  size_t prefixLen=strlen(prefix);
+  return len>=prefixLen && !strncmp(scnName,prefix,prefixLen);
+}
+
+//whether symbol i in symTabData of e is a match for sym from ref on
+//everything but its name
+static bool symbolMatches(ElfInfo* e,Elf_Data* symTabData,int i,GElf_Sym* sym,
+                          ElfInfo* ref,int flags,char* symbolNameDot,
+                          char* versionSuffix)
+{
+  ElfXX_Sym sym2;
+  memcpy(&sym2,symTabData->d_buf+i*sizeof(ElfXX_Sym),sizeof(ElfXX_Sym));
+  int bind=ELF64_ST_BIND(sym->st_info);
+  int type=ELF64_ST_TYPE(sym->st_info);
+  int bind2=ELFXX_ST_BIND(sym2.st_info);
+  int type2=ELFXX_ST_TYPE(sym2.st_info);
+  if(bind != bind2)
+  {
+    logprintf(ELL_INFO_V2,ELS_SYMBOL,"fails on bind\n");
+    return false;
+  }
+  if(type!= STT_NOTYPE && type2!=STT_NOTYPE && type != type2)
+  {
+    logprintf(ELL_INFO_V2,ELS_SYMBOL,"fails on type\n");
+    return false;
+  }
+
+  //don't match on size because the size of a variable may
+  //have changed
+
+  if(sym->st_other!=sym2.st_other)
+  {
+    logprintf(ELL_INFO_V2,ELS_SYMBOL,"fails on other\n");
+    return false;
+  }
+  //now the hard one to deal with: section index. This is especially
+  //important to deal with for section symbols though as there may be no other
+  //means of differentiating them
+  int shndxRef=sym->st_shndx;
+  int shndxNew=sym2.st_shndx;
+  //allowing undefined to be a wildcard because may be bringing
+  //in a symbol from a relocatable object
+  //also allowing imprecise matching on common,
+  //because symbols may be common in a .o file and then
+  //get put in a section in the fully linked binary
+  if(shndxRef==SHN_UNDEF || shndxNew==SHN_UNDEF ||
+     shndxRef==SHN_COMMON || shndxNew==SHN_COMMON)
+  {
+    return true;
+  }
+  Elf_Scn* scnRef=elf_getscn(ref->e,shndxRef);
+  assert(scnRef);
+  Elf_Scn* scnNew=elf_getscn(e->e,shndxNew);
+  assert(scnNew);
+  GElf_Shdr shdrRef;
+  GElf_Shdr shdrNew;
+  gelf_getshdr(scnRef,&shdrRef);
+  gelf_getshdr(scnNew,&shdrNew);
+  char* scnNameRef=getScnHdrString(ref,shdrRef.sh_name);
+  char* scnNameNew=getScnHdrString(e,shdrNew.sh_name);
+  //if -fdata-sections or -ffunction-sections is used then
+  //we might have issues with section names having the name of the
+  //var/function appended, and versioned sections may be allowed to
+  //match unversioned ones, so compare without these
+  size_t lenRef=normalizedScnNameLen(scnNameRef,symbolNameDot,versionSuffix);
+  size_t lenNew=normalizedScnNameLen(scnNameNew,symbolNameDot,versionSuffix);
+  //printf("old refers to section name %s and new refers to section name %s\n",scnNameRef,scnNameNew);
+  if(lenRef!=lenNew || strncmp(scnNameRef,scnNameNew,lenRef))
+  {
+    //we might still be saved by considering data and bss to be the same section
+    if(type == STT_SECTION ||
+       !(flags & ESFF_BSS_MATCH_DATA_OK) ||
+       !((normalizedScnNameHasPrefix(scnNameRef,lenRef,".data") &&
+          normalizedScnNameHasPrefix(scnNameNew,lenNew,".bss")) ||
+         (normalizedScnNameHasPrefix(scnNameRef,lenRef,".bss") &&
+          normalizedScnNameHasPrefix(scnNameNew,lenNew,".data"))))
+    {
+      logprintf(ELL_INFO_V2,ELS_SYMBOL,"symbol match fails on section name (%.*s vs %.*s)\n",(int)lenRef,scnNameRef,(int)lenNew,scnNameNew);
+      return false;
+    }
+  }
+  return true;
+}
+
+//find the symbol matching the given symbol
+//e is the binary we're looking in
+//ref is the elf object this symbol is in right now
+//if more than one symbol matches, the one latest in the table wins
+idx_t findSymbol(ElfInfo* e,GElf_Sym* sym,ElfInfo* ref,int flags)
+{
+  idx_t retval=STN_UNDEF;
+  SymbolIndex* index=getSymbolIndex(e,flags & ESFF_NEW_DYNAMIC);
   char* symbolName=getString(ref,sym->st_name);//todo not supporting ESFF_OLD_DYNAMIC yet
   char* symbolNameUnmangled=symbolName;
   if(flags & ESFF_MANGLED_OK)
@@ -126,148 +341,63 @@ idx_t findSymbol(ElfInfo* e,GElf_Sym* sym,ElfInfo* ref,int flags)
   char* symbolNameDot=zmalloc(strlen(symbolName)+2);//for --fdata-sections and --ffunction-sections
   strcpy(symbolNameDot,".");
   strcat(symbolNameDot,symbolName);
-  //traverse the symbol table to find the symbol we're looking for. Yes this is slow
-  //todo: build our own hash table since the .hash section seems incomplete
+  char* versionSuffix=NULL;
+  if(flags & ESFF_VERSIONED_SECTIONS_OK)
+  {
+    char* vers=getVersionStringOfPatchSections();
+    versionSuffix=zmalloc(strlen(vers)+2);
+    sprintf(versionSuffix,".%s",vers);
+  }
+
+  //symbols in e always have their names unmangled for comparison
   //start at 1 because never trying to match symbol 0
-   int bind=ELF64_ST_BIND(sym->st_info);
-   int type=ELF64_ST_TYPE(sym->st_info);
-  int numEntries=symTabData->d_size/sizeof(ElfXX_Sym);
-  for (int i = 1; i < numEntries; ++i)
+  SymbolCandidates* candidates=dictGet(index->byName,symbolNameUnmangled);
+  for(int j=candidates?candidates->num-1:-1;j>=0 && candidates->indices[j]>=1;j--)
   {
-    ElfXX_Sym sym2;
-    //get the symbol in an unsafe manner because
-    //we may be getting it from a data buffer we're in the process of filling
-    memcpy(&sym2,symTabData->d_buf+i*sizeof(ElfXX_Sym),sizeof(ElfXX_Sym));
-    char* symname=(*getstrfunc)(e, sym2.st_name);
-    int bind2=ELFXX_ST_BIND(sym2.st_info);
-    int type2=ELFXX_ST_TYPE(sym2.st_info);
-    char* symnameUnmangled=unmangleSymbolName(symname);
-    //todo: bug with symbols with names substrings of other names, need to properly unmangle symname
-    if( (STT_SECTION==type && STT_SECTION==type2) ||
-       (!symname && !symbolName) ||
-       (!symname && !strlen(symbolName)) ||
-       (!strlen(symname) && !symbolName) ||
-       (symname && symbolName && !strcmp(symnameUnmangled,symbolNameUnmangled)))
+    idx_t i=candidates->indices[j];
+    if(strlen(symbolName))
     {
-      free(symnameUnmangled);
-      if(symname && strlen(symname))
-      {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] matches %s, has name %s\n",i,symbolName,symname);
-      }
-      else
-      {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] both have no name. They might be the same section\n",i);
-      }
-      //ok, the right name, but are other things right too?
-     
-      
-      if(bind != bind2)
-      {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"fails on bind\n");
-        continue;
-      }
-      if(type!= STT_NOTYPE && type2!=STT_NOTYPE && type != type2)
-      {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"fails on type\n");
-        continue;
-      }
-
-      //don't match on size because the size of a variable may
-      //have changed
-      
-      if(sym->st_other!=sym2.st_other)
+      logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] matches %s\n",i,symbolName);
+    }
+    else
+    {
+      logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] both have no name. They might be the same section\n",i);
+    }
+    //ok, the right name, but are other things right too?
+    if(symbolMatches(e,index->data,i,sym,ref,flags,symbolNameDot,versionSuffix))
+    {
+      retval=i;
+      break;
+    }
+  }
+  //section symbols may match whatever their names
+  if(STT_SECTION==ELF64_ST_TYPE(sym->st_info))
+  {
+    for(int j=index->sectionSyms.num-1;j>=0;j--)
+    {
+      idx_t i=index->sectionSyms.indices[j];
+      if(i<1 || (STN_UNDEF!=retval && i<=retval))
       {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"fails on other\n");
-        continue;
+        break;
       }
-      //now the hard one to deal with: section index. This is especially
-      //important to deal with for section symbols though as there may be no other
-      //means of differentiating them
-      int shndxRef=sym->st_shndx;
-      int shndxNew=sym2.st_shndx;
-      //allowing undefined to be a wildcard because may be bringing
-      //in a symbol from a relocatable object
-      //also allowing imprecise matching on common,
-      //because symbols may be common in a .o file and then
-      //get put in a section in the fully linked binary
-      if(shndxRef!=SHN_UNDEF && shndxNew!=SHN_UNDEF &&
-         shndxRef!=SHN_COMMON && shndxNew!=SHN_COMMON)
+      if(symbolMatches(e,index->data,i,sym,ref,flags,symbolNameDot,versionSuffix))
       {
-        Elf_Scn* scnRef=elf_getscn(ref->e,shndxRef);
-        assert(scnRef);
-        Elf_Scn* scnNew=elf_getscn(e->e,shndxNew);
-        assert(scnNew);
-        GElf_Shdr shdrRef;
-        GElf_Shdr shdrNew;
-        gelf_getshdr(scnRef,&shdrRef);
-        gelf_getshdr(scnNew,&shdrNew);
-        char* scnNameRef=strdup(getScnHdrString(ref,shdrRef.sh_name));
-        char* scnNameNew=strdup(getScnHdrString(e,shdrNew.sh_name));
-        //if -fdata-sections or -ffunction-sections is used then
-        //we might have issues with section names having the name of the
-        //var/function appended, so we strip these
-        if(strEndsWith(scnNameRef,symbolNameDot))
-        {
-          scnNameRef[strlen(scnNameRef)-strlen(symbolNameDot)]='\0';
-        }
-        if(strEndsWith(scnNameNew,symbolNameDot))
-        {
-          scnNameNew[strlen(scnNameNew)-strlen(symbolNameDot)]='\0';
-        }
-
-        //also strip versioning from the section names if allowed
-        if(flags & ESFF_VERSIONED_SECTIONS_OK)
-        {
-          char* vers=getVersionStringOfPatchSections();
-          char* buf=zmalloc(strlen(vers)+2);
-          sprintf(buf,".%s",vers);
-          if(strEndsWith(scnNameRef,buf))
-          {
-            scnNameRef[strlen(scnNameRef)-strlen(buf)]='\0';
-          }
-          if(strEndsWith(scnNameNew,buf))
-          {
-            scnNameNew[strlen(scnNameNew)-strlen(buf)]='\0';
-          }
-          free(buf);
-
-        }
-        
-        //printf("old refers to section name %s and new refers to section name %s\n",scnNameRef,scnNameNew);
-        if((scnNameRef && !scnNameNew) || (!scnNameNew && scnNameNew) ||
-           (scnNameRef && scnNameNew && strcmp(scnNameRef,scnNameNew)))
-        {
-          //we might still be saved by considering data and bss to be the same section
-          if(type == STT_SECTION ||
-             (!(flags & ESFF_BSS_MATCH_DATA_OK) ||
-              !((!strncmp(scnNameRef,".data",strlen(".data")) &&
-                 !strncmp(scnNameNew,".bss",strlen(".bss"))) ||
-                (!strncmp(scnNameRef,".bss",strlen(".bss")) &&
-                 !strncmp(scnNameNew,".data",strlen(".data"))))))
-          {
-            logprintf(ELL_INFO_V2,ELS_SYMBOL,"symbol match fails on section name (%s vs %s)\n",scnNameRef,scnNameNew);
-            free(scnNameNew);
-            free(scnNameRef);
-            continue;
-          }
-        }
-        free(scnNameNew);
-        free(scnNameRef);
+        retval=i;
+        break;
       }
-      logprintf(ELL_INFO_V1,ELS_SYMBOL,"found symbol %s at index %i\n",symbolName,i);
-      retval=i;
-    }
-    else
-    {
-      free(symnameUnmangled);
     }
   }
-  
+  if(STN_UNDEF!=retval)
+  {
+    logprintf(ELL_INFO_V1,ELS_SYMBOL,"found symbol %s at index %i\n",symbolName,retval);
+  }
+
   if(symbolNameUnmangled!=symbolName)
   {
     free(symbolNameUnmangled);
   }
   free(symbolNameDot);
+  free(versionSuffix);
   return retval;
 }
 
@@ -374,78 +504,317 @@ int getSymtabIdx(ElfInfo* e,char* symbolName,int flags)
   return idx;
   */
 
-  Elf_Data* symTabData=NULL;
   char* (*getstrfunc)(ElfInfo*,int)=NULL;
   if(flags & ESFF_NEW_DYNAMIC)
   {
-    symTabData=getDataByERS(e,ERS_DYNSYM);
     getstrfunc=&getDynString;
   }
   else
   {
-    symTabData=getDataByERS(e,ERS_SYMTAB);
     getstrfunc=&getString;
   }
+  SymbolIndex* index=getSymbolIndex(e,flags & ESFF_NEW_DYNAMIC);
 
-  char* symbolNameUnmangled=symbolName;
-  if(flags & ESFF_MANGLED_OK)
+  //the index is by unmangled name, if mangled names aren't ok we also
+  //have to check for an exact match
+  char* symbolNameUnmangled=unmangleSymbolName(symbolName);
+  SymbolCandidates* candidates=dictGet(index->byName,symbolNameUnmangled);
+  free(symbolNameUnmangled);
+  for(int j=0;candidates && j<candidates->num;j++)
   {
-    symbolNameUnmangled=unmangleSymbolName(symbolName);
+    int i=candidates->indices[j];
+    if(i>=e->symTabCount)
+    {
+      break;
+    }
+    GElf_Sym sym;
+    gelf_getsym(index->data,i,&sym);
+    if((flags & ESFF_MANGLED_OK) ||
+       !strcmp((*getstrfunc)(e,sym.st_name),symbolName))
+    {
+      return i;
+    }
   }
+  logprintf(ELL_INFO_V1,ELS_SYMBOL,"Symbol '%s' not defined yet. This may or may not be a problem\n",symbolName);
+  return STN_UNDEF;
+}
 
+//index of the symbols of one type by the addresses they cover, so that
+//finding the symbol containing an address is a binary search rather
+//than a traversal of the whole symbol table. Where symbols overlap the
+//one earliest in the symbol table wins, as it would in a traversal.
+//The address space is cut into segments at every symbol boundary and
+//each segment records the symbol covering it. Symbols with size 0
+//only ever contain their own address and are kept separately.
+struct AddressIndex
+{
+  Elf_Data* data;//the symbol table data indexed
+  int symTabCount;//number of symbols indexed
+  addr_t* segmentStarts;//sorted, segment i is [segmentStarts[i],segmentStarts[i+1])
+  idx_t* segmentSyms;//STN_UNDEF for gaps between symbols
+  int numSegments;
+  addr_t* pointAddrs;//sorted addresses of size 0 symbols
+  idx_t* pointSyms;
+  int numPoints;
+};
 
+typedef struct
+{
+  addr_t low;
+  addr_t high;
+  idx_t symIdx;
+} AddressInterval;
 
-  bool found=false;
-  //traverse the symbol table to find the symbol we're looking for. Yes this is slow
-  //todo: build our own hash table since the .hash section seems incomplete
-  int i;
-  for (i = 0; i < e->symTabCount; ++i)
+static int cmpAddressIntervals(const void* a,const void* b)
+{
+  const AddressInterval* ia=a;
+  const AddressInterval* ib=b;
+  if(ia->low!=ib->low)
+  {
+    return ia->low<ib->low?-1:1;
+  }
+  if(ia->symIdx!=ib->symIdx)
+  {
+    return ia->symIdx<ib->symIdx?-1:1;
+  }
+  return 0;
+}
+
+static int cmpAddrs(const void* a,const void* b)
+{
+  addr_t aa=*(const addr_t*)a;
+  addr_t ab=*(const addr_t*)b;
+  return aa<ab?-1:(aa>ab?1:0);
+}
+
+//min-heap of the intervals open at a point in the sweep, ordered by
+//symbol index. Intervals which have closed are only removed once they
+//reach the top
+static void heapPushInterval(AddressInterval** heap,int* heapSize,AddressInterval* interval)
+{
+  int i=(*heapSize)++;
+  while(i>0 && heap[(i-1)/2]->symIdx>interval->symIdx)
+  {
+    heap[i]=heap[(i-1)/2];
+    i=(i-1)/2;
+  }
+  heap[i]=interval;
+}
+
+static void heapPopInterval(AddressInterval** heap,int* heapSize)
+{
+  AddressInterval* last=heap[--(*heapSize)];
+  int i=0;
+  while(true)
+  {
+    int child=2*i+1;
+    if(child>=*heapSize)
+    {
+      break;
+    }
+    if(child+1<*heapSize && heap[child+1]->symIdx<heap[child]->symIdx)
+    {
+      child++;
+    }
+    if(heap[child]->symIdx>=last->symIdx)
+    {
+      break;
+    }
+    heap[i]=heap[child];
+    i=child;
+  }
+  heap[i]=last;
+}
+
+static void freeAddressIndex(AddressIndex* index)
+{
+  if(!index)
+  {
+    return;
+  }
+  free(index->segmentStarts);
+  free(index->segmentSyms);
+  free(index->pointAddrs);
+  free(index->pointSyms);
+  free(index);
+}
+
+void invalidateAddressIndices(ElfInfo* e)
+{
+  for(int i=0;i<STT_NUM;i++)
+  {
+    freeAddressIndex(e->addressIndices[i]);
+    e->addressIndices[i]=NULL;
+  }
+}
+
+static AddressIndex* buildAddressIndex(ElfInfo* e,Elf_Data* symTabData,byte type)
+{
+  AddressIndex* index=zmalloc(sizeof(AddressIndex));
+  index->data=symTabData;
+  index->symTabCount=e->symTabCount;
+  int n=max(e->symTabCount,1);
+  AddressInterval* intervals=zmalloc(n*sizeof(AddressInterval));
+  AddressInterval* points=zmalloc(n*sizeof(AddressInterval));
+  int numIntervals=0;
+  int numPoints=0;
+  for(int i=1;i<e->symTabCount;i++)
   {
     GElf_Sym sym;
-    gelf_getsym(symTabData,i,&sym);
-    char* symname=(*getstrfunc)(e,sym.st_name);
-    char* symnameUnmangled=symname;
-    if(flags & ESFF_MANGLED_OK)
+    if(!gelf_getsym(symTabData,i,&sym))
+    {death("gelf_getsym failed\n");}
+    if(ELFXX_ST_TYPE(sym.st_info)!=type)
     {
-      symnameUnmangled=unmangleSymbolName(symname);
+      continue;
     }
-    if(!strcmp(symnameUnmangled,symbolNameUnmangled))
+    AddressInterval* interval=sym.st_size?&intervals[numIntervals++]:&points[numPoints++];
+    interval->low=sym.st_value;
+    interval->high=sym.st_value+sym.st_size;
+    interval->symIdx=i;
+  }
+  qsort(intervals,numIntervals,sizeof(AddressInterval),cmpAddressIntervals);
+  qsort(points,numPoints,sizeof(AddressInterval),cmpAddressIntervals);
+
+  //size 0 symbols: keep the first symbol at each address
+  index->pointAddrs=zmalloc((max(numPoints,1))*sizeof(addr_t));
+  index->pointSyms=zmalloc((max(numPoints,1))*sizeof(idx_t));
+  for(int i=0;i<numPoints;i++)
+  {
+    if(index->numPoints && index->pointAddrs[index->numPoints-1]==points[i].low)
     {
-      found=true;
+      continue;
     }
-    if(symnameUnmangled!=symname)
+    index->pointAddrs[index->numPoints]=points[i].low;
+    index->pointSyms[index->numPoints]=points[i].symIdx;
+    index->numPoints++;
+  }
+  free(points);
+
+  //every boundary between segments
+  addr_t* bounds=zmalloc((max(2*numIntervals,1))*sizeof(addr_t));
+  for(int i=0;i<numIntervals;i++)
+  {
+    bounds[2*i]=intervals[i].low;
+    bounds[2*i+1]=intervals[i].high;
+  }
+  qsort(bounds,2*numIntervals,sizeof(addr_t),cmpAddrs);
+  index->segmentStarts=zmalloc((max(2*numIntervals,1))*sizeof(addr_t));
+  index->segmentSyms=zmalloc((max(2*numIntervals,1))*sizeof(idx_t));
+  AddressInterval** heap=zmalloc((max(numIntervals,1))*sizeof(AddressInterval*));
+  int heapSize=0;
+  int next=0;//next interval to open
+  for(int i=0;i<2*numIntervals;i++)
+  {
+    addr_t start=bounds[i];
+    if(i && bounds[i-1]==start)
     {
-      free(symnameUnmangled);
+      continue;
     }
-    if(found)
+    while(next<numIntervals && intervals[next].low==start)
     {
-      break;
+      heapPushInterval(heap,&heapSize,&intervals[next++]);
+    }
+    while(heapSize && heap[0]->high<=start)
+    {
+      heapPopInterval(heap,&heapSize);
     }
+    idx_t symIdx=heapSize?heap[0]->symIdx:STN_UNDEF;
+    //adjacent segments with the same symbol are one segment
+    if(index->numSegments && index->segmentSyms[index->numSegments-1]==symIdx)
+    {
+      continue;
+    }
+    index->segmentStarts[index->numSegments]=start;
+    index->segmentSyms[index->numSegments]=symIdx;
+    index->numSegments++;
   }
-  if(symbolNameUnmangled!=symbolName)
+  free(heap);
+  free(bounds);
+  free(intervals);
+  return index;
+}
+
+//returns NULL if e has no symbol table
+static AddressIndex* getAddressIndex(ElfInfo* e,byte type)
+{
+  if(!hasERS(e, ERS_SYMTAB) || type>=STT_NUM)
   {
-    free(symbolNameUnmangled);
+    return NULL;
+  }
+  Elf_Data* symTabData=getDataByERS(e,ERS_SYMTAB);
+  AddressIndex* index=e->addressIndices[type];
+  if(index && (index->data!=symTabData || index->symTabCount!=e->symTabCount))
+  {
+    freeAddressIndex(index);
+    index=NULL;
   }
-  if(found)
+  if(!index)
   {
-    return i;
+    index=buildAddressIndex(e,symTabData,type);
+    e->addressIndices[type]=index;
   }
-  logprintf(ELL_INFO_V1,ELS_SYMBOL,"Symbol '%s' not defined yet. This may or may not be a problem\n",symbolName);
-  return STN_UNDEF;
+  return index;
 }
 
-//find the index of a symbol whose st_value is addr or where
-//addr>st_value && addr<st_value+st_size
-//only match symbols whose type is type and are for section scnIdx
-//pass SHN_UNDEF for scnIdx to accept symbols referencing any section
-//todo: this is slow. Could do smth much faster with interval tress or something
-idx_t findSymbolContainingAddress(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx)
+//index of the last element of sorted addrs which is <= addr, or -1.
+//Only elements from start onwards are considered
+static int findLastAddrNotAbove(addr_t* addrs,int start,int num,addr_t addr)
 {
-  if(!hasERS(e, ERS_SYMTAB))
+  int low=start;
+  int high=num-1;
+  int result=start-1;
+  while(low<=high)
   {
-    //we don't have a .symtab, can't guess a function
-    return STN_UNDEF;
+    int mid=low+(high-low)/2;
+    if(addrs[mid]<=addr)
+    {
+      result=mid;
+      low=mid+1;
+    }
+    else
+    {
+      high=mid-1;
+    }
   }
+  return result;
+}
+
+//cursors are positions in the index the previous query left off at, so
+//that queries in ascending order only search what lies between them
+static idx_t lookupAddressIndex(AddressIndex* index,addr_t addr,
+                                int* segmentCursor,int* pointCursor)
+{
+  idx_t result=STN_UNDEF;
+  int seg=findLastAddrNotAbove(index->segmentStarts,max(*segmentCursor,0),
+                               index->numSegments,addr);
+  if(seg<0 || seg<*segmentCursor)
+  {
+    //addr is lower than the previous query, start again
+    seg=findLastAddrNotAbove(index->segmentStarts,0,index->numSegments,addr);
+  }
+  *segmentCursor=seg;
+  if(seg>=0)
+  {
+    result=index->segmentSyms[seg];
+  }
+  int point=findLastAddrNotAbove(index->pointAddrs,max(*pointCursor,0),
+                                 index->numPoints,addr);
+  if(point<0 || point<*pointCursor)
+  {
+    point=findLastAddrNotAbove(index->pointAddrs,0,index->numPoints,addr);
+  }
+  *pointCursor=point;
+  if(point>=0 && index->pointAddrs[point]==addr &&
+     (STN_UNDEF==result || index->pointSyms[point]<result))
+  {
+    result=index->pointSyms[point];
+  }
+  return result;
+}
+
+//linear scan for the case where we have to restrict to one section
+static idx_t findSymbolContainingAddressInSection(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx)
+{
   Elf_Data* symTabData=getDataByERS(e,ERS_SYMTAB);
   for (int i = 1; i < e->symTabCount; ++i)
   {
@@ -453,7 +822,7 @@ idx_t findSymbolContainingAddress(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx)
     if(!gelf_getsym(symTabData,i,&sym))
     {death("gelf_getsym failed\n");}
     if(ELFXX_ST_TYPE(sym.st_info)==type &&
-       (sym.st_shndx==scnIdx || SHN_UNDEF==scnIdx) &&
+       sym.st_shndx==scnIdx &&
        (sym.st_value==addr || 
         (sym.st_value<=addr &&
          sym.st_value+sym.st_size > addr)))
@@ -465,3 +834,39 @@ idx_t findSymbolContainingAddress(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx)
   return STN_UNDEF;
 }
 
+//find the index of a symbol whose st_value is addr or where
+//addr>st_value && addr<st_value+st_size
+//only match symbols whose type is type and are for section scnIdx
+//pass SHN_UNDEF for scnIdx to accept symbols referencing any section
+idx_t findSymbolContainingAddress(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx)
+{
+  if(!hasERS(e, ERS_SYMTAB))
+  {
+    //we don't have a .symtab, can't guess a function
+    return STN_UNDEF;
+  }
+  if(SHN_UNDEF!=scnIdx)
+  {
+    return findSymbolContainingAddressInSection(e,addr,type,scnIdx);
+  }
+  AddressIndex* index=getAddressIndex(e,type);
+  if(!index)
+  {
+    return STN_UNDEF;
+  }
+  int segmentCursor=0;
+  int pointCursor=0;
+  return lookupAddressIndex(index,addr,&segmentCursor,&pointCursor);
+}
+
+void findSymbolsContainingAddresses(ElfInfo* e,addr_t* addrs,int numAddrs,
+                                    byte type,idx_t* symsOut)
+{
+  AddressIndex* index=getAddressIndex(e,type);
+  int segmentCursor=0;
+  int pointCursor=0;
+  for(int i=0;i<numAddrs;i++)
+  {
+    symsOut[i]=index?lookupAddressIndex(index,addrs[i],&segmentCursor,&pointCursor):STN_UNDEF;
+  }
+}
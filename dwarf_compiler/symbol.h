@@ -76,6 +76,9 @@ typedef enum
   ESFF_FUZZY_MATCHING_OK=ESFF_MANGLED_OK | ESFF_VERSIONED_SECTIONS_OK
 } E_SYMBOL_FIND_FLAGS;
 
+//free the name indices built for e's symbol tables by the lookups below
+void freeSymbolIndices(ElfInfo* e);
+
 //find the symbol matching the given symbol
 idx_t findSymbol(ElfInfo* e,GElf_Sym* sym,ElfInfo* ref,int flags);
 
@@ -92,5 +95,13 @@ int getSymtabIdx(ElfInfo* e,char* symbolName,int flags);
 
 //pass SHN_UNDEF for scnIdx to accept symbols referencing any section
 idx_t findSymbolContainingAddress(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx);
+
+//findSymbolContainingAddress for each of addrs (with any section),
+//results in symsOut. Fastest if addrs is sorted
+void findSymbolsContainingAddresses(ElfInfo* e,addr_t* addrs,int numAddrs,
+                                    byte type,idx_t* symsOut);
+
+//must be called if the values or sizes of existing symbols in e change
+void invalidateAddressIndices(ElfInfo* e);
 #endif
 
@@ -104,3 +104,15 @@ uint64_t hash64Bit(uint64_t key)
   key = key + (key << 31);
   return key;
 }
+
+//this is FNV-1a, see http://www.isthe.com/chongo/tech/comp/fnv/
+uint64_t hashBytes(const unsigned char* data,size_t len,uint64_t seed)
+{
+  uint64_t hash=seed;
+  for(size_t i=0;i<len;i++)
+  {
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
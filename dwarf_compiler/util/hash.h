@@ -59,6 +59,7 @@
 #define _HASH_H__
 
 #include <stdint.h> //for uint32_t and uint64_t
+#include <stddef.h> //for size_t
 
 
 #if __WORDSIZE==64
@@ -74,4 +75,10 @@ unsigned long hash1(char*);
 unsigned long hashInt(int);
 uint32_t hash32Bit(uint32_t key);
 uint64_t hash64Bit(uint64_t key);
+
+//hash of an arbitrary block of memory, for checksumming. To hash
+//several blocks as if they were one, pass the result for one block as
+//the seed for the next
+#define HASH_BYTES_SEED 14695981039346656037ULL
+uint64_t hashBytes(const unsigned char* data,size_t len,uint64_t seed);
 #endif